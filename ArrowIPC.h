@@ -0,0 +1,649 @@
+// Save an EventTable as an Arrow IPC file (Feather v2), and map one back in.
+//
+// Arrow is the column format pandas, polars, DuckDB and friends all
+// understand, so a skim saved like this can be opened from Python with
+// pyarrow.feather.read_table("skim.arrow") and no conversion step. Within
+// a record batch every column is one contiguous array, aligned to 64
+// bytes, so reading the file back is just mapping it into memory: the
+// columns are used where they lie in the page cache, and nothing is
+// parsed or decompressed.
+//
+// Besides the EventTable columns, any number of extra double columns can
+// be saved alongside, eg one weight per universe. The POT goes in the
+// schema's metadata.
+//
+//   SaveArrowEvents(table, "cc0pi.arrow", {{"weight_univ0", w0}, {"weight_univ1", w1}});
+//   ArrowEventFile f("cc0pi.arrow");
+//   const EventTable t = f.ToEventTable();
+//   const double* w0 = f.Column<double>(0, "weight_univ0"); // No copy
+//
+// Only what this needs is implemented: int32 and float64 columns with no
+// nulls, uncompressed, no dictionaries. The format is written directly
+// rather than through the Arrow C++ library, so there is nothing extra to
+// install. The metadata is FlatBuffers, and a FlatWriter/FlatTable with
+// just enough of that is included.
+
+#pragma once
+
+#include "EventTable.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Writes a FlatBuffer front to back. Tables are written before the things
+// they point to, which keeps every offset positive as the format needs:
+// Ref() leaves a hole for an offset, and Point() fills it in once the
+// target has been written.
+class FlatWriter
+{
+public:
+  struct Field
+  {
+    int slot;
+    int size;       // 1, 2, 4 or 8 bytes; 4 for an offset
+    uint64_t bits;  // The value, for scalars
+    bool isRef;     // An offset to fill in later
+  };
+
+  const std::vector<uint8_t>& Bytes() const {return fBuf;}
+  size_t Size() const {return fBuf.size();}
+
+  void Pad(size_t align) {while(fBuf.size() % align) fBuf.push_back(0);}
+
+  template<class T> void Put(size_t pos, T v) {memcpy(&fBuf[pos], &v, sizeof(T));}
+
+  template<class T> size_t Append(T v)
+  {
+    const size_t pos = fBuf.size();
+    fBuf.resize(pos + sizeof(T));
+    Put(pos, v);
+    return pos;
+  }
+
+  size_t Ref()
+  {
+    Pad(4);
+    return Append<uint32_t>(0);
+  }
+
+  void Point(size_t ref, size_t target) {Put<uint32_t>(ref, target - ref);}
+
+  // Returns the table's position. The positions of its offset fields are
+  // added to refs, in the order they were given.
+  size_t Table(const std::vector<Field>& fields, std::vector<size_t>& refs)
+  {
+    // Biggest first, so nothing needs padding
+    std::vector<size_t> order(fields.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b){return fields[a].size > fields[b].size;});
+    int nSlots = 0;
+    std::vector<uint16_t> offsets(fields.size());
+    size_t cur = 4; // After the offset to the vtable
+    for(size_t i: order){
+      nSlots = std::max(nSlots, fields[i].slot+1);
+      cur = (cur + fields[i].size - 1) / fields[i].size * fields[i].size;
+      offsets[i] = cur;
+      cur += fields[i].size;
+    }
+
+    Pad(2);
+    const size_t vtable = fBuf.size();
+    Append<uint16_t>(4 + 2*nSlots);
+    Append<uint16_t>(cur);
+    std::vector<uint16_t> slots(nSlots, 0);
+    for(size_t i = 0; i < fields.size(); ++i) slots[fields[i].slot] = offsets[i];
+    for(uint16_t s: slots) Append<uint16_t>(s);
+
+    Pad(8);
+    const size_t table = fBuf.size();
+    fBuf.resize(table + cur, 0);
+    Put<int32_t>(table, table - vtable);
+    for(size_t i = 0; i < fields.size(); ++i){
+      memcpy(&fBuf[table + offsets[i]], &fields[i].bits, fields[i].size); // Little-endian
+      if(fields[i].isRef) refs.push_back(table + offsets[i]);
+    }
+    return table;
+  }
+
+  // A vector of n offsets, to fill in with Point()
+  size_t RefVector(size_t n, std::vector<size_t>& refs)
+  {
+    Pad(4);
+    const size_t pos = Append<uint32_t>(n);
+    for(size_t i = 0; i < n; ++i) refs.push_back(Append<uint32_t>(0));
+    return pos;
+  }
+
+  size_t String(const std::string& s)
+  {
+    Pad(4);
+    const size_t pos = Append<uint32_t>(s.size());
+    fBuf.insert(fBuf.end(), s.begin(), s.end());
+    fBuf.push_back(0);
+    return pos;
+  }
+
+  // A vector of n structs of elemSize bytes each, aligned to 8
+  size_t StructVector(const void* data, size_t n, size_t elemSize)
+  {
+    while((fBuf.size() + 4) % 8) fBuf.push_back(0);
+    const size_t pos = Append<uint32_t>(n);
+    if(n > 0) fBuf.insert(fBuf.end(), (const uint8_t*)data, (const uint8_t*)data + n*elemSize);
+    return pos;
+  }
+
+protected:
+  std::vector<uint8_t> fBuf;
+};
+
+// Reads a table in a FlatBuffer. A null table reads as all defaults.
+class FlatTable
+{
+public:
+  // A table at p, in the buffer [begin, end). Every read is checked
+  // against the buffer, so a corrupt file stops with an error rather than
+  // reading outside it.
+  FlatTable(const uint8_t* p = 0, const uint8_t* begin = 0, const uint8_t* end = 0)
+    : fP(p), fBegin(begin), fEnd(end)
+  {
+  }
+
+  // The root table of the buffer [buf, end)
+  static FlatTable Root(const uint8_t* buf, const uint8_t* end)
+  {
+    const FlatTable b(buf, buf, end);
+    return FlatTable(b.At(b.ReadAt<uint32_t>(0), 4), buf, end);
+  }
+
+  bool IsNull() const {return !fP;}
+
+  template<class T> T Get(int slot, T def = 0) const
+  {
+    const uint16_t off = Offset(slot);
+    return off ? ReadAt<T>(Pos() + off) : def;
+  }
+
+  FlatTable Sub(int slot) const {return FlatTable(Target(slot), fBegin, fEnd);}
+
+  // Elements of a vector, each elemSize bytes, and how many there are
+  const uint8_t* Vector(int slot, uint32_t& n, size_t elemSize = 1) const
+  {
+    const uint8_t* p = Target(slot);
+    n = 0;
+    if(!p) return 0;
+    n = ReadAt<uint32_t>(p - fBegin);
+    return At(p - fBegin + 4, uint64_t(n)*elemSize);
+  }
+
+  // Element i of a vector of tables
+  FlatTable TableAt(int slot, uint32_t i) const
+  {
+    uint32_t n;
+    const uint8_t* elems = Vector(slot, n, 4);
+    if(i >= n) Corrupt();
+    const int64_t pos = elems - fBegin + 4*int64_t(i);
+    return FlatTable(At(pos + ReadAt<uint32_t>(pos), 4), fBegin, fEnd);
+  }
+
+  std::string String(int slot) const
+  {
+    uint32_t n;
+    const uint8_t* p = Vector(slot, n);
+    return p ? std::string((const char*)p, n) : "";
+  }
+
+  template<class T> static T Read(const uint8_t* p)
+  {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+  }
+
+protected:
+  [[noreturn]] static void Corrupt()
+  {
+    std::cerr << "FlatTable: an offset points outside the buffer; the file is corrupt" << std::endl;
+    abort();
+  }
+
+  int64_t Pos() const {return fP - fBegin;}
+
+  // The byte at pos in the buffer, checking the n bytes from there are in it
+  const uint8_t* At(int64_t pos, uint64_t n) const
+  {
+    const int64_t size = fEnd - fBegin;
+    if(pos < 0 || pos > size || uint64_t(size - pos) < n) Corrupt();
+    return fBegin + pos;
+  }
+
+  template<class T> T ReadAt(int64_t pos) const {return Read<T>(At(pos, sizeof(T)));}
+
+  uint16_t Offset(int slot) const
+  {
+    if(!fP) return 0;
+    const int64_t vt = Pos() - ReadAt<int32_t>(Pos());
+    if(4 + 2*slot >= ReadAt<uint16_t>(vt)) return 0;
+    return ReadAt<uint16_t>(vt + 4 + 2*slot);
+  }
+
+  const uint8_t* Target(int slot) const
+  {
+    const uint16_t off = Offset(slot);
+    if(!off) return 0;
+    const int64_t pos = Pos() + off;
+    return At(pos + ReadAt<uint32_t>(pos), 0);
+  }
+
+  const uint8_t* fP;
+  const uint8_t* fBegin;
+  const uint8_t* fEnd;
+};
+
+// Numbers from the Arrow format's Schema.fbs, Message.fbs and File.fbs
+namespace arrowfmt
+{
+  const int16_t kMetadataV5 = 4;
+  const uint8_t kHeaderSchema = 1, kHeaderRecordBatch = 3;
+  const uint8_t kTypeInt = 2, kTypeFloatingPoint = 3;
+  const int16_t kPrecisionDouble = 2;
+
+  struct FieldNode {int64_t length, nullCount;};
+  struct Buffer {int64_t offset, length;};
+  struct Block {int64_t offset; int32_t metaDataLength; int32_t pad; int64_t bodyLength;};
+}
+
+// One column to write: n int32s or doubles
+struct ArrowColumn
+{
+  std::string name;
+  bool isInt;
+  const void* data;
+};
+
+// Schema.fbs: Schema{endianness, fields, custom_metadata}
+size_t WriteArrowSchema(FlatWriter& fb, const std::vector<ArrowColumn>& cols,
+                        const std::map<std::string, std::string>& meta)
+{
+  using F = FlatWriter::Field;
+  std::vector<size_t> refs;
+  const size_t schema = fb.Table({F{1, 4, 0, true}, F{2, 4, 0, true}}, refs);
+  const size_t fieldsRef = refs[0], metaRef = refs[1];
+
+  std::vector<size_t> fieldRefs;
+  fb.Point(fieldsRef, fb.RefVector(cols.size(), fieldRefs));
+  for(size_t i = 0; i < cols.size(); ++i){
+    // Field{name, nullable, type_type, type, dictionary, children}
+    std::vector<size_t> r;
+    const uint8_t typeType = cols[i].isInt ? arrowfmt::kTypeInt : arrowfmt::kTypeFloatingPoint;
+    const size_t field = fb.Table({F{0, 4, 0, true}, F{2, 1, typeType, false},
+                                   F{3, 4, 0, true}, F{5, 4, 0, true}}, r);
+    fb.Point(fieldRefs[i], field);
+    fb.Point(r[0], fb.String(cols[i].name));
+    std::vector<size_t> none;
+    if(cols[i].isInt) // Int{bitWidth, is_signed}
+      fb.Point(r[1], fb.Table({F{0, 4, 32, false}, F{1, 1, 1, false}}, none));
+    else // FloatingPoint{precision}
+      fb.Point(r[1], fb.Table({F{0, 2, uint64_t(arrowfmt::kPrecisionDouble), false}}, none));
+    fb.Point(r[2], fb.RefVector(0, none)); // No children, but readers want the vector
+  }
+
+  std::vector<size_t> kvRefs;
+  fb.Point(metaRef, fb.RefVector(meta.size(), kvRefs));
+  size_t i = 0;
+  for(const auto& kv: meta){
+    std::vector<size_t> r;
+    fb.Point(kvRefs[i++], fb.Table({F{0, 4, 0, true}, F{1, 4, 0, true}}, r));
+    fb.Point(r[0], fb.String(kv.first));
+    fb.Point(r[1], fb.String(kv.second));
+  }
+  return schema;
+}
+
+// Write one encapsulated message: a marker, the metadata length, the
+// metadata, and the body. The metadata is padded so the body starts on a
+// 64-byte boundary.
+arrowfmt::Block WriteArrowMessage(std::ofstream& out, const std::vector<uint8_t>& flat,
+                                  const std::vector<uint8_t>& body)
+{
+  arrowfmt::Block block{int64_t(out.tellp()), 0, 0, int64_t(body.size())};
+  size_t metaLen = flat.size();
+  while((block.offset + 8 + metaLen) % 64) ++metaLen;
+  block.metaDataLength = 8 + metaLen;
+
+  const uint32_t marker = 0xFFFFFFFF;
+  const int32_t len = metaLen;
+  out.write((const char*)&marker, 4);
+  out.write((const char*)&len, 4);
+  out.write((const char*)flat.data(), flat.size());
+  const std::vector<char> zeros(metaLen - flat.size(), 0);
+  out.write(zeros.data(), zeros.size());
+  out.write((const char*)body.data(), body.size());
+  return block;
+}
+
+void WriteArrowFile(const std::string& fname, const std::vector<ArrowColumn>& cols, size_t nRows,
+                    const std::map<std::string, std::string>& meta, size_t batchSize = 1 << 16)
+{
+  using F = FlatWriter::Field;
+  std::ofstream out(fname, std::ios::binary);
+  if(!out){
+    std::cerr << "WriteArrowFile: can't write " << fname << std::endl;
+    abort();
+  }
+  out.write("ARROW1\0\0", 8);
+
+  // Message{version, header_type, header, bodyLength}
+  {
+    FlatWriter fb;
+    const size_t root = fb.Ref();
+    std::vector<size_t> r;
+    fb.Point(root, fb.Table({F{0, 2, uint64_t(arrowfmt::kMetadataV5), false},
+                             F{1, 1, arrowfmt::kHeaderSchema, false},
+                             F{2, 4, 0, true}, F{3, 8, 0, false}}, r));
+    fb.Point(r[0], WriteArrowSchema(fb, cols, meta));
+    WriteArrowMessage(out, fb.Bytes(), {});
+  }
+
+  std::vector<arrowfmt::Block> blocks;
+  for(size_t begin = 0; begin < nRows; begin += batchSize){
+    const size_t n = std::min(batchSize, nRows - begin);
+
+    // Each column is an empty validity buffer (no nulls) and its values
+    std::vector<uint8_t> body;
+    std::vector<arrowfmt::FieldNode> nodes;
+    std::vector<arrowfmt::Buffer> buffers;
+    for(const ArrowColumn& c: cols){
+      const size_t size = c.isInt ? 4 : 8;
+      nodes.push_back({int64_t(n), 0});
+      buffers.push_back({int64_t(body.size()), 0});
+      buffers.push_back({int64_t(body.size()), int64_t(n*size)});
+      const uint8_t* p = (const uint8_t*)c.data + begin*size;
+      body.insert(body.end(), p, p + n*size);
+      body.resize((body.size() + 63) / 64 * 64, 0);
+    }
+
+    // RecordBatch{length, nodes, buffers}
+    FlatWriter fb;
+    const size_t root = fb.Ref();
+    std::vector<size_t> r;
+    fb.Point(root, fb.Table({F{0, 2, uint64_t(arrowfmt::kMetadataV5), false},
+                             F{1, 1, arrowfmt::kHeaderRecordBatch, false},
+                             F{2, 4, 0, true}, F{3, 8, body.size(), false}}, r));
+    std::vector<size_t> rb;
+    fb.Point(r[0], fb.Table({F{0, 8, n, false}, F{1, 4, 0, true}, F{2, 4, 0, true}}, rb));
+    fb.Point(rb[0], fb.StructVector(nodes.data(), nodes.size(), sizeof(arrowfmt::FieldNode)));
+    fb.Point(rb[1], fb.StructVector(buffers.data(), buffers.size(), sizeof(arrowfmt::Buffer)));
+    blocks.push_back(WriteArrowMessage(out, fb.Bytes(), body));
+  }
+
+  // Footer{version, schema, dictionaries, recordBatches}
+  FlatWriter fb;
+  const size_t root = fb.Ref();
+  std::vector<size_t> r;
+  fb.Point(root, fb.Table({F{0, 2, uint64_t(arrowfmt::kMetadataV5), false},
+                           F{1, 4, 0, true}, F{2, 4, 0, true}, F{3, 4, 0, true}}, r));
+  fb.Point(r[0], WriteArrowSchema(fb, cols, meta));
+  fb.Point(r[1], fb.StructVector(0, 0, sizeof(arrowfmt::Block)));
+  fb.Point(r[2], fb.StructVector(blocks.data(), blocks.size(), sizeof(arrowfmt::Block)));
+  fb.Pad(8);
+
+  out.write((const char*)fb.Bytes().data(), fb.Size());
+  const int32_t footerLen = fb.Size();
+  out.write((const char*)&footerLen, 4);
+  out.write("ARROW1", 6);
+  if(!out){
+    std::cerr << "WriteArrowFile: error writing " << fname << std::endl;
+    abort();
+  }
+}
+
+// An extra column to save with the events, eg one universe's weights
+struct ExtraColumn
+{
+  std::string name;
+  std::vector<double> values; // One per event
+};
+
+void SaveArrowEvents(const EventTable& t, const std::string& fname,
+                     const std::vector<ExtraColumn>& extras = {})
+{
+  std::vector<ArrowColumn> cols;
+  for(const IntColumn& c: kIntColumns) cols.push_back({c.name, true, (t.*c.col).data()});
+  for(const DoubleColumn& c: kDoubleColumns) cols.push_back({c.name, false, (t.*c.col).data()});
+  for(const ExtraColumn& e: extras){
+    if(e.values.size() != t.Size()){
+      std::cerr << "SaveArrowEvents: column " << e.name << " has " << e.values.size()
+                << " values for " << t.Size() << " events" << std::endl;
+      abort();
+    }
+    cols.push_back({e.name, false, e.values.data()});
+  }
+
+  // Enough digits that the POT reads back exactly
+  char pot[64];
+  snprintf(pot, sizeof(pot), "%.17g", t.pot);
+  WriteArrowFile(fname, cols, t.Size(), {{"pot", pot}});
+}
+
+// An Arrow IPC file mapped into memory. Columns are read in place.
+class ArrowEventFile
+{
+public:
+  explicit ArrowEventFile(const std::string& fname)
+  {
+    const int fd = open(fname.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0){
+      std::cerr << "ArrowEventFile: can't open " << fname << std::endl;
+      abort();
+    }
+    fSize = st.st_size;
+    fBase = (const uint8_t*)mmap(0, fSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(fBase == MAP_FAILED || fSize < 18 ||
+       memcmp(fBase, "ARROW1", 6) != 0 || memcmp(fBase + fSize - 6, "ARROW1", 6) != 0){
+      std::cerr << "ArrowEventFile: " << fname << " isn't an Arrow IPC file" << std::endl;
+      abort();
+    }
+
+    // The footer lies between the leading magic (padded to 8) and its length
+    const int32_t footerLen = FlatTable::Read<int32_t>(fBase + fSize - 10);
+    if(footerLen <= 0 || size_t(footerLen) > fSize - 18) Corrupt(fname, "footer size");
+    const uint8_t* footerEnd = fBase + fSize - 10;
+    const FlatTable footer = FlatTable::Root(footerEnd - footerLen, footerEnd);
+    ReadSchema(footer.Sub(1));
+
+    uint32_t nBlocks;
+    const uint8_t* blocks = footer.Vector(3, nBlocks, sizeof(arrowfmt::Block));
+    for(uint32_t b = 0; b < nBlocks; ++b){
+      arrowfmt::Block block;
+      memcpy(&block, blocks + b*sizeof(block), sizeof(block));
+      ReadBatch(fname, block);
+    }
+  }
+
+  ~ArrowEventFile() {munmap((void*)fBase, fSize);}
+
+  ArrowEventFile(const ArrowEventFile&) = delete;
+
+  size_t NBatches() const {return fBatches.size();}
+  size_t BatchRows(size_t b) const {return fBatches[b].nRows;}
+
+  size_t NRows() const
+  {
+    size_t n = 0;
+    for(const Batch& b: fBatches) n += b.nRows;
+    return n;
+  }
+
+  const std::vector<std::string>& ColumnNames() const {return fNames;}
+
+  std::string Metadata(const std::string& key) const
+  {
+    auto it = fMeta.find(key);
+    return it == fMeta.end() ? "" : it->second;
+  }
+
+  // Column name in batch b, where it lies in the file. T must be int or
+  // double, matching the column.
+  template<class T> const T* Column(size_t b, const std::string& name) const
+  {
+    const int c = ColumnIndex(name);
+    if(fIsInt[c] != std::is_same<T, int>::value){
+      std::cerr << "ArrowEventFile: column " << name << " has the other type" << std::endl;
+      abort();
+    }
+    return (const T*)fBatches[b].columns[c];
+  }
+
+  // A column from every batch, as one vector
+  template<class T> std::vector<T> ReadColumn(const std::string& name) const
+  {
+    std::vector<T> ret;
+    ret.reserve(NRows());
+    for(size_t b = 0; b < NBatches(); ++b){
+      const T* p = Column<T>(b, name);
+      ret.insert(ret.end(), p, p + BatchRows(b));
+    }
+    return ret;
+  }
+
+  EventTable ToEventTable() const
+  {
+    EventTable t;
+    t.Reserve(NRows());
+    for(const IntColumn& c: kIntColumns) t.*c.col = ReadColumn<int>(c.name);
+    for(const DoubleColumn& c: kDoubleColumns) t.*c.col = ReadColumn<double>(c.name);
+    t.pot = strtod(Metadata("pot").c_str(), 0);
+    return t;
+  }
+
+protected:
+  struct Batch
+  {
+    size_t nRows;
+    std::vector<const uint8_t*> columns;
+  };
+
+  [[noreturn]] static void Corrupt(const std::string& fname, const std::string& what)
+  {
+    std::cerr << "ArrowEventFile: " << fname << " is corrupt: bad " << what << std::endl;
+    abort();
+  }
+
+  int ColumnIndex(const std::string& name) const
+  {
+    for(size_t c = 0; c < fNames.size(); ++c) if(fNames[c] == name) return c;
+    std::cerr << "ArrowEventFile: no column called " << name << std::endl;
+    abort();
+  }
+
+  void ReadSchema(const FlatTable& schema)
+  {
+    uint32_t nFields;
+    schema.Vector(1, nFields, 4);
+    for(uint32_t i = 0; i < nFields; ++i){
+      const FlatTable field = schema.TableAt(1, i);
+      const uint8_t typeType = field.Get<uint8_t>(2);
+      const FlatTable type = field.Sub(3);
+      const bool isInt32 = typeType == arrowfmt::kTypeInt && type.Get<int32_t>(0) == 32;
+      const bool isDouble = typeType == arrowfmt::kTypeFloatingPoint &&
+                            type.Get<int16_t>(0) == arrowfmt::kPrecisionDouble;
+      if(!isInt32 && !isDouble){
+        std::cerr << "ArrowEventFile: column " << field.String(0)
+                  << " is neither int32 nor float64" << std::endl;
+        abort();
+      }
+      fNames.push_back(field.String(0));
+      fIsInt.push_back(isInt32);
+    }
+
+    uint32_t nMeta;
+    schema.Vector(2, nMeta, 4);
+    for(uint32_t i = 0; i < nMeta; ++i){
+      const FlatTable kv = schema.TableAt(2, i);
+      fMeta[kv.String(0)] = kv.String(1);
+    }
+  }
+
+  void ReadBatch(const std::string& fname, const arrowfmt::Block& block)
+  {
+    // The block must lie in the file: the metadata (with its 8-byte prefix)
+    // and then the body
+    const uint64_t size = fSize;
+    if(block.offset < 0 || block.metaDataLength < 8 || block.bodyLength < 0 ||
+       uint64_t(block.offset) > size ||
+       uint64_t(block.metaDataLength) > size - block.offset ||
+       uint64_t(block.bodyLength) > size - block.offset - block.metaDataLength)
+      Corrupt(fname, "record batch block");
+
+    const uint8_t* msg = fBase + block.offset;
+    if(FlatTable::Read<uint32_t>(msg) != 0xFFFFFFFF){
+      std::cerr << "ArrowEventFile: bad message at " << block.offset << std::endl;
+      abort();
+    }
+    const FlatTable message = FlatTable::Root(msg + 8, msg + block.metaDataLength);
+    if(message.Get<uint8_t>(1) != arrowfmt::kHeaderRecordBatch) return;
+    const FlatTable rb = message.Sub(2);
+    if(!rb.Sub(3).IsNull()){
+      std::cerr << "ArrowEventFile: compressed batches aren't supported" << std::endl;
+      abort();
+    }
+
+    uint32_t nNodes, nBuffers;
+    const uint8_t* nodes = rb.Vector(1, nNodes, sizeof(arrowfmt::FieldNode));
+    const uint8_t* buffers = rb.Vector(2, nBuffers, sizeof(arrowfmt::Buffer));
+    if(nNodes != fNames.size() || nBuffers != 2*fNames.size()){
+      std::cerr << "ArrowEventFile: batch doesn't match the schema" << std::endl;
+      abort();
+    }
+
+    Batch batch;
+    const int64_t nRows = rb.Get<int64_t>(0);
+    if(nRows < 0 || uint64_t(nRows) > uint64_t(block.bodyLength)) Corrupt(fname, "row count");
+    batch.nRows = nRows;
+    const uint8_t* body = msg + block.metaDataLength;
+    for(size_t c = 0; c < fNames.size(); ++c){
+      arrowfmt::FieldNode node;
+      arrowfmt::Buffer data;
+      memcpy(&node, nodes + c*sizeof(node), sizeof(node));
+      memcpy(&data, buffers + (2*c+1)*sizeof(data), sizeof(data));
+      if(node.nullCount != 0){
+        std::cerr << "ArrowEventFile: column " << fNames[c] << " has nulls" << std::endl;
+        abort();
+      }
+      // Every row's value must be inside the body
+      const uint64_t need = uint64_t(nRows)*(fIsInt[c] ? sizeof(int32_t) : sizeof(double));
+      if(node.length != nRows || data.offset < 0 || data.length < 0 ||
+         uint64_t(data.offset) > uint64_t(block.bodyLength) ||
+         uint64_t(data.length) > uint64_t(block.bodyLength) - data.offset ||
+         uint64_t(data.length) < need)
+        Corrupt(fname, "buffer for column " + fNames[c]);
+      batch.columns.push_back(body + data.offset);
+    }
+    fBatches.push_back(batch);
+  }
+
+  const uint8_t* fBase;
+  size_t fSize;
+  std::vector<std::string> fNames;
+  std::vector<bool> fIsInt;
+  std::map<std::string, std::string> fMeta;
+  std::vector<Batch> fBatches;
+};
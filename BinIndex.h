@@ -0,0 +1,401 @@
+// Refill a spectrum with new weights without working out the bins again.
+//
+// Once the axis and the cut are fixed, each event always lands in the same
+// bin (in a given kinematic universe, like a muon energy shift). Only the
+// weight changes when you reweight for a new flux, a new cross-section
+// tune, or a weight syst like ResNorm. A BinIndexCache records, for every
+// event and every kinematic universe, which bin the event falls in and
+// whether it passes the cut, packed into one byte (or two, for more than
+// 126 bins):
+//
+//   top bit:  passes the cut
+//   the rest: bin number, ROOT style (0 is underflow, NBins()+1 overflow)
+//
+// Refilling with new weights is then a single pass over those bytes and
+// the weights, adding each weight to its bin. No Var or Cut is evaluated,
+// and the memory read is one or two bytes plus the weight per event.
+// RefillMany() does many sets of weights in one pass.
+//
+// An event is kept if it passes the cut in at least one universe, since a
+// different universe can move it into the selection; events that fail in
+// every universe can never contribute and are dropped. Table() holds the
+// kept events' unshifted columns, in the same order, for working out new
+// weights, and OriginalIndex() says where each one was among all the events
+// read.
+//
+//   BinIndexCache cache(loader, axRecoQEFormula, kCC0PiSelection, {kNoShift, SystShifts(&kEMuScale, +1)});
+//   loader.Go();
+//   TH1D* h = cache.Refill(0, kMyFluxWeight, 1e20);
+
+#pragma once
+
+#include "CountingHistogram.h"
+#include "EventTable.h"
+
+#include "TFile.h"
+#include "TTree.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+class BinIndexCache
+{
+public:
+  // Record while loader.Go() runs. Universes are kinematic shifts; universe
+  // 0 is usually kNoShift.
+  BinIndexCache(SpectrumLoaderBase& loader,
+                const HistAxis& axis,
+                const Cut& cut,
+                const std::vector<SystShifts>& universes = {kNoShift})
+    : fData(new Data)
+  {
+    if(axis.GetVars().size() != 1){
+      std::cerr << "BinIndexCache: only works with 1D axes" << std::endl;
+      abort();
+    }
+    const Binning& bins = axis.GetBinnings()[0];
+    fData->label = axis.GetLabels()[0];
+    fData->edges = bins.Edges();
+    fData->wide = NeedsWide(bins.NBins());
+    fData->codes8.resize(universes.size());
+    fData->codes16.resize(universes.size());
+    fData->shiftWeight.resize(universes.size());
+
+    // Every universe is worked out in the one callback, so we know whether
+    // the event passes in any of them before deciding to keep it
+    std::shared_ptr<Data> data = fData;
+    const Var var = axis.GetVars()[0];
+    std::vector<std::vector<const ISyst*>> systs;
+    for(const SystShifts& shift: universes) systs.push_back(shift.ActiveSysts());
+    fSpect = OnEachEvent(loader, kNoCut, kNoShift,
+                         [data, var, cut, universes, systs](const caf::SRProxy* sr, double)
+                         {
+                           const size_t nUniv = universes.size();
+                           std::vector<bool> pass(nUniv);
+                           std::vector<int> bin(nUniv);
+                           std::vector<double> w(nUniv, 1);
+                           bool any = false;
+                           for(size_t u = 0; u < nUniv; ++u){
+                             Restorer restore; // Puts the record back after each universe
+                             caf::SRProxy* shifted = const_cast<caf::SRProxy*>(sr);
+                             for(const ISyst* syst: systs[u])
+                               syst->Shift(universes[u].GetShift(syst), restore, shifted, w[u]);
+                             pass[u] = cut(sr);
+                             bin[u] = data->FindBin(var(sr));
+                             any = any || pass[u];
+                           }
+                           if(any){
+                             for(size_t u = 0; u < nUniv; ++u) data->Append(u, pass[u], bin[u], w[u]);
+                             data->table.Append(sr, 1);
+                             data->index.push_back(data->nRead);
+                           }
+                           ++data->nRead;
+                         });
+  }
+
+  // The events kept, and all the events read
+  size_t NEvents() const {return Table().Size();}
+  uint64_t NEventsRead() const {return fData->nRead;}
+  int NUniverses() const {return fData->codes8.size();}
+  int NBins() const {return fData->edges.size()-1;}
+  bool Wide() const {return fData->wide;}
+
+  // The events, unshifted, in the same order as the bin codes. Only
+  // meaningful after loader.Go().
+  const EventTable& Table() const
+  {
+    if(fSpect) fData->table.pot = fSpect->POT();
+    return fData->table;
+  }
+
+  // Where kept event i was among all the events read, counting from 0
+  uint64_t OriginalIndex(size_t i) const {return fData->index[i];}
+
+  // Histogram universe univ with weight w[i] for event i, scaled to pot.
+  // Weights that the universe's own systs apply are included. If every
+  // weight is 1 the events are just counted.
+  TH1D* Refill(int univ, const std::vector<double>& w, double pot) const
+  {
+    CheckSize(w.size());
+    std::vector<double> acc(NBins()+3, 0), acc2(NBins()+3, 0);
+    const std::vector<float>& sw = fData->shiftWeight[univ];
+    const bool unit = sw.empty() && std::all_of(w.begin(), w.end(), [](double x){return x == 1;});
+    if(unit){
+      if(Wide()) Count(fData->codes16[univ], acc);
+      else Count(fData->codes8[univ], acc);
+      acc2 = acc; // The sum of 1^2 is the count
+    }
+    else{
+      if(Wide()) Gather(fData->codes16[univ], w.data(), sw, acc, acc2);
+      else Gather(fData->codes8[univ], w.data(), sw, acc, acc2);
+    }
+    return ToTH1(acc, acc2, 0, 1, pot);
+  }
+
+  // The same, working the weights out from the table
+  TH1D* Refill(int univ, const TableVar& wei, double pot) const
+  {
+    const EventTable& t = Table();
+    std::vector<double> w(t.Size());
+    for(size_t i = 0; i < w.size(); ++i) w[i] = wei(t, i);
+    return Refill(univ, w, pot);
+  }
+
+  // K sets of weights at once. w[i*K + k] is the weight of event i in set
+  // k. Each event's bin is only looked up once, which makes this much
+  // faster than K calls to Refill().
+  std::vector<TH1D*> RefillMany(int univ, const std::vector<double>& w, int K, double pot) const
+  {
+    CheckSize(w.size()/K);
+    std::vector<double> acc((NBins()+3)*K, 0), acc2((NBins()+3)*K, 0);
+    if(Wide()) GatherMany(fData->codes16[univ], w.data(), K, fData->shiftWeight[univ], acc, acc2);
+    else GatherMany(fData->codes8[univ], w.data(), K, fData->shiftWeight[univ], acc, acc2);
+
+    std::vector<TH1D*> ret;
+    for(int k = 0; k < K; ++k) ret.push_back(ToTH1(acc, acc2, k, K, pot));
+    return ret;
+  }
+
+  // Write the table (with SaveEventTable()) and the bin codes to fname
+  void Save(const std::string& fname) const
+  {
+    SaveEventTable(Table(), fname);
+
+    TFile fout(fname.c_str(), "UPDATE");
+    // The file owns the trees
+    TTree* meta = new TTree("binidx_meta", "Binning of the bin codes");
+    std::vector<double> edges = fData->edges;
+    std::string label = fData->label;
+    int nUniv = NUniverses();
+    ULong64_t nRead = NEventsRead();
+    meta->Branch("edges", &edges);
+    meta->Branch("label", &label);
+    meta->Branch("nUniverses", &nUniv);
+    meta->Branch("nRead", &nRead, "nRead/l");
+    meta->Fill();
+
+    TTree* codes = new TTree("binidx", "Bin code of every event in every universe");
+    std::vector<uint16_t> c(NUniverses());
+    std::vector<float> sw(NUniverses());
+    ULong64_t index;
+    codes->Branch("index", &index, "index/l");
+    for(int u = 0; u < NUniverses(); ++u){
+      codes->Branch(("code_" + std::to_string(u)).c_str(), &c[u],
+                    ("code_" + std::to_string(u) + "/s").c_str());
+      codes->Branch(("weight_" + std::to_string(u)).c_str(), &sw[u],
+                    ("weight_" + std::to_string(u) + "/F").c_str());
+    }
+    for(size_t i = 0; i < NEvents(); ++i){
+      index = OriginalIndex(i);
+      for(int u = 0; u < NUniverses(); ++u){
+        c[u] = Wide() ? fData->codes16[u][i] : ToWide(fData->codes8[u][i]);
+        sw[u] = fData->shiftWeight[u].empty() ? 1 : fData->shiftWeight[u][i];
+      }
+      codes->Fill();
+    }
+    fout.Write();
+    fout.Close();
+  }
+
+  // Read back a cache written by Save(), without the CAFs
+  static BinIndexCache Load(const std::string& fname)
+  {
+    BinIndexCache ret;
+    ret.fData->table = LoadEventTable(fname);
+
+    TFile* fin = TFile::Open(fname.c_str());
+    TTree* meta = 0;
+    TTree* codes = 0;
+    if(fin){
+      fin->GetObject("binidx_meta", meta);
+      fin->GetObject("binidx", codes);
+    }
+    if(!meta || !codes){
+      std::cerr << "BinIndexCache::Load: no bin codes in " << fname << std::endl;
+      abort();
+    }
+
+    std::vector<double>* edges = 0;
+    std::string* label = 0;
+    int nUniv;
+    ULong64_t nRead;
+    meta->SetBranchAddress("edges", &edges);
+    meta->SetBranchAddress("label", &label);
+    meta->SetBranchAddress("nUniverses", &nUniv);
+    meta->SetBranchAddress("nRead", &nRead);
+    meta->GetEntry(0);
+
+    Data& d = *ret.fData;
+    d.edges = *edges;
+    d.label = *label;
+    d.wide = NeedsWide(d.edges.size()-1);
+    d.codes8.resize(nUniv);
+    d.codes16.resize(nUniv);
+    d.shiftWeight.resize(nUniv);
+    d.nRead = nRead;
+
+    std::vector<uint16_t> c(nUniv);
+    std::vector<float> sw(nUniv);
+    ULong64_t index;
+    codes->SetBranchAddress("index", &index);
+    for(int u = 0; u < nUniv; ++u){
+      codes->SetBranchAddress(("code_" + std::to_string(u)).c_str(), &c[u]);
+      codes->SetBranchAddress(("weight_" + std::to_string(u)).c_str(), &sw[u]);
+    }
+    for(Long64_t i = 0; i < codes->GetEntries(); ++i){
+      codes->GetEntry(i);
+      d.index.push_back(index);
+      for(int u = 0; u < nUniv; ++u){
+        if(d.wide) d.codes16[u].push_back(c[u]);
+        else d.codes8[u].push_back(ToNarrow(c[u]));
+        d.AppendWeight(u, sw[u], i);
+      }
+    }
+
+    delete fin;
+    return ret;
+  }
+
+protected:
+  BinIndexCache() : fData(new Data) {}
+
+  static constexpr uint8_t kPass8 = 0x80;
+  static constexpr uint16_t kPass16 = 0x8000;
+
+  static bool NeedsWide(int nBins)
+  {
+    if(nBins+1 >= kPass16){
+      std::cerr << "BinIndexCache: too many bins (" << nBins << ")" << std::endl;
+      abort();
+    }
+    return nBins+1 >= kPass8;
+  }
+
+  static uint16_t ToWide(uint8_t c) {return (c & kPass8) ? kPass16 | (c & ~kPass8) : c;}
+  static uint8_t ToNarrow(uint16_t c) {return (c & kPass16) ? kPass8 | (c & ~kPass16) : c;}
+
+  // Shared with the loader's callbacks, which may outlive us
+  struct Data
+  {
+    std::string label;
+    std::vector<double> edges;
+    bool wide;
+    std::vector<std::vector<uint8_t>> codes8;
+    std::vector<std::vector<uint16_t>> codes16;
+    // The weight each universe's systs apply. Left empty while it is all 1s.
+    std::vector<std::vector<float>> shiftWeight;
+    EventTable table;
+    std::vector<uint64_t> index; // Of each kept event among all those read
+    uint64_t nRead = 0;
+
+    int FindBin(double x) const
+    {
+      return std::upper_bound(edges.begin(), edges.end(), x) - edges.begin();
+    }
+
+    void Append(int u, bool pass, int bin, double w)
+    {
+      if(wide) codes16[u].push_back((pass ? kPass16 : 0) | bin);
+      else codes8[u].push_back((pass ? kPass8 : 0) | bin);
+      AppendWeight(u, w, (wide ? codes16[u].size() : codes8[u].size()) - 1);
+    }
+
+    // Event i of universe u has syst weight w
+    void AppendWeight(int u, double w, size_t i)
+    {
+      std::vector<float>& sw = shiftWeight[u];
+      if(sw.empty() && w == 1) return;
+      if(sw.empty()) sw.resize(i, 1);
+      sw.push_back(w);
+    }
+  };
+
+  // The inner loops. Events that fail the cut go in the extra last slot of
+  // acc, which avoids a branch.
+  template<class T> static size_t Slot(T code, size_t dump)
+  {
+    const T pass = T(1) << (8*sizeof(T)-1);
+    return (code & pass) ? size_t(code & T(~pass)) : dump;
+  }
+
+  // All weights 1: count, spreading neighbouring events over several
+  // copies of the histogram (see CountingHistogram.h)
+  template<class T> static void Count(const std::vector<T>& codes, std::vector<double>& acc)
+  {
+    const int C = CountingHistogram::kCopies;
+    const size_t stride = acc.size();
+    const size_t dump = stride-1;
+    std::vector<uint64_t> counts(C*stride, 0);
+    const size_t n = codes.size();
+    size_t i = 0;
+    for(; i + C <= n; i += C)
+      for(int c = 0; c < C; ++c) ++counts[c*stride + Slot(codes[i+c], dump)];
+    for(; i < n; ++i) ++counts[Slot(codes[i], dump)];
+
+    for(size_t b = 0; b < stride; ++b)
+      for(int c = 0; c < C; ++c) acc[b] += counts[c*stride + b];
+  }
+
+  template<class T> static void Gather(const std::vector<T>& codes, const double* w,
+                                       const std::vector<float>& sw,
+                                       std::vector<double>& acc, std::vector<double>& acc2)
+  {
+    const size_t dump = acc.size()-1;
+    const size_t n = codes.size();
+    for(size_t i = 0; i < n; ++i){
+      const double wi = sw.empty() ? w[i] : w[i]*sw[i];
+      const size_t slot = Slot(codes[i], dump);
+      acc[slot] += wi;
+      acc2[slot] += wi*wi;
+    }
+  }
+
+  template<class T> static void GatherMany(const std::vector<T>& codes, const double* w, int K,
+                                           const std::vector<float>& sw,
+                                           std::vector<double>& acc, std::vector<double>& acc2)
+  {
+    const size_t dump = acc.size()/K - 1;
+    const size_t n = codes.size();
+    for(size_t i = 0; i < n; ++i){
+      const size_t slot = Slot(codes[i], dump);
+      double* a = &acc[K*slot];
+      double* a2 = &acc2[K*slot];
+      const double* wi = &w[i*K];
+      const double s = sw.empty() ? 1 : sw[i];
+      for(int k = 0; k < K; ++k){
+        const double x = wi[k]*s;
+        a[k] += x;
+        a2[k] += x*x;
+      }
+    }
+  }
+
+  // Turn entry k of every K in acc (sums of weights) and acc2 (sums of
+  // squares) into a histogram
+  TH1D* ToTH1(const std::vector<double>& acc, const std::vector<double>& acc2,
+              int k, int K, double pot) const
+  {
+    TH1D* h = MakeEmptyTH1(fData->label, Binning::Custom(fData->edges));
+    for(int b = 0; b <= NBins()+1; ++b){
+      h->SetBinContent(b, acc[b*K + k]);
+      h->SetBinError(b, sqrt(acc2[b*K + k]));
+    }
+    const double tablePOT = Table().pot;
+    if(tablePOT > 0) h->Scale(pot/tablePOT);
+    return h;
+  }
+
+  void CheckSize(size_t n) const
+  {
+    if(n != NEvents()){
+      std::cerr << "BinIndexCache: " << n << " weights for " << NEvents() << " events" << std::endl;
+      abort();
+    }
+  }
+
+  std::shared_ptr<Data> fData;
+  std::unique_ptr<Spectrum> fSpect; // Not after Load()
+};
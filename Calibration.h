@@ -0,0 +1,235 @@
+// Measure the best loader settings for this machine, and remember them.
+//
+// Calibrate() takes a few of the input files and times short passes over
+// them with different settings:
+//
+//  - how many loaders to run at once, each on its share of the files
+//  - how many files FileSchedule warms ahead of the loader
+//  - the batch size and prefetch depth of SelectedEvents()
+//
+// Each setting is tuned in turn, and the later trials use the best values
+// found so far: the read-ahead trials run the best number of loaders, and
+// the streaming trials read through a FileSchedule with the best
+// read-ahead. The fastest settings are saved as this host's profile (see
+// HostProfile.h), and are the defaults from then on. It only needs running
+// once per machine, or again when the storage changes.
+//
+// By default the sample files are read once before the first pass, so
+// every pass reads them from memory and the passes are compared fairly.
+// That can't show what read-ahead gains on slow storage. With evictCache
+// the files are dropped from the page cache before each pass instead, so
+// every pass reads them from the disk or network as a real job would. The
+// page cache belongs to the whole machine, so on a shared node this also
+// drops the files for anyone else reading them: only use it on a machine
+// you have to yourself, or on files nobody else is reading.
+//
+//   Calibrate(CAFS).Print();
+
+#pragma once
+
+#include "SystematicsCommon.h"
+#include "EventStream.h"
+#include "EventTable.h"
+#include "FileScheduler.h"
+#include "HostProfile.h"
+#include "LoaderTools.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct CalibrationOptions
+{
+  size_t nFiles = 4;                         // How many files to time on
+  std::vector<unsigned int> threadCounts;    // Empty means 1, 2, 4, ... up to the number of cores
+  std::vector<unsigned int> readAheadDepths = {1, 2, 4, kReadAheadAll};
+  std::vector<size_t> batchSizes = {1000, 10000, 100000};
+  std::vector<size_t> prefetchDepths = {1, 4, 16};
+  bool evictCache = false;                   // Read from storage every pass, not from memory. See above
+  bool save = true;                          // Write the result to HostProfile::Path()
+};
+
+// Count the events a loader reads, and time it
+class ThroughputTrial
+{
+public:
+  explicit ThroughputTrial(bool evict) : fEvict(evict) {}
+
+  // Before the pass: forget any cached copies of these files, and start the clock
+  void Start(const std::vector<std::string>& files)
+  {
+    if(fEvict) for(const std::string& f: files) EvictFile(f);
+    fStart = std::chrono::steady_clock::now();
+  }
+
+  std::unique_ptr<Spectrum> Count(SpectrumLoaderBase& loader)
+  {
+    std::atomic<long>* n = &fNEvents;
+    return OnEachEvent(loader, kNoCut, kNoShift, [n](const caf::SRProxy*, double){++*n;});
+  }
+
+  void Add(long n) {fNEvents += n;}
+
+  double EventsPerSecond() const
+  {
+    const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - fStart;
+    return dt.count() > 0 ? fNEvents/dt.count() : 0;
+  }
+
+protected:
+  bool fEvict;
+  std::atomic<long> fNEvents{0};
+  std::chrono::steady_clock::time_point fStart;
+};
+
+// Every nThreads'th file, starting from each of the first nThreads
+std::vector<std::vector<std::string>> ShareFiles(const std::vector<std::string>& files,
+                                                 unsigned int nThreads)
+{
+  std::vector<std::vector<std::string>> shares(nThreads);
+  for(size_t i = 0; i < files.size(); ++i) shares[i % nThreads].push_back(files[i]);
+  return shares;
+}
+
+// nThreads loaders at once, each reading every nThreads'th file
+double TrialThreads(const std::vector<std::string>& files, unsigned int nThreads, bool evict)
+{
+  const std::vector<std::vector<std::string>> shares = ShareFiles(files, nThreads);
+
+  ThroughputTrial trial(evict);
+  std::vector<std::unique_ptr<SpectrumLoader>> loaders;
+  std::vector<std::unique_ptr<Spectrum>> counters;
+  for(const auto& share: shares){
+    if(share.empty()) continue;
+    loaders.emplace_back(new SpectrumLoader(share));
+    counters.push_back(trial.Count(*loaders.back()));
+  }
+
+  LoaderPool pool(nThreads);
+  trial.Start(files);
+  std::vector<std::shared_future<void>> fs;
+  for(auto& l: loaders) fs.push_back(GoAsync(*l, pool));
+  WaitAll(fs);
+  return trial.EventsPerSecond();
+}
+
+// nThreads loaders at once, as TrialThreads(), each over its own
+// FileSchedule that warms readAheadDepth files ahead
+double TrialReadAhead(const std::vector<std::string>& files, unsigned int nThreads,
+                      unsigned int readAheadDepth, bool evict)
+{
+  ThroughputTrial trial(evict);
+  trial.Start(files); // Evict before the schedules look at what is cached
+
+  std::vector<std::unique_ptr<FileSchedule>> scheds;
+  std::vector<std::unique_ptr<SpectrumLoader>> loaders;
+  std::vector<std::unique_ptr<Spectrum>> counters;
+  for(const auto& share: ShareFiles(files, nThreads)){
+    if(share.empty()) continue;
+    scheds.emplace_back(new FileSchedule(share, readAheadDepth));
+    loaders.emplace_back(new SpectrumLoader(scheds.back()->Files()));
+    counters.push_back(trial.Count(*loaders.back()));
+  }
+
+  LoaderPool pool(nThreads);
+  std::vector<std::shared_future<void>> fs;
+  for(auto& l: loaders) fs.push_back(GoAsync(*l, pool));
+  WaitAll(fs);
+  return trial.EventsPerSecond();
+}
+
+// Stream every event out of one loader with these options, reading the
+// files through a FileSchedule that warms readAheadDepth files ahead
+double TrialStream(const std::vector<std::string>& files, unsigned int readAheadDepth,
+                   size_t batchSize, size_t prefetchDepth, bool evict)
+{
+  StreamOptions opts;
+  opts.batchSize = batchSize;
+  opts.prefetchDepth = prefetchDepth;
+
+  ThroughputTrial trial(evict);
+  trial.Start(files);
+  FileSchedule sched(files, readAheadDepth);
+  SpectrumLoader loader(sched.Files());
+  for(const EventTable& batch: SelectedEvents(loader, kNoCut, kNoShift, opts))
+    trial.Add(batch.Size());
+  return trial.EventsPerSecond();
+}
+
+HostProfile Calibrate(const std::string& wildcard,
+                      const CalibrationOptions& opts = CalibrationOptions())
+{
+  const std::vector<std::string> all = ExpandGlob(wildcard);
+  if(all.empty()){
+    std::cerr << "Calibrate: no files match " << wildcard << std::endl;
+    abort();
+  }
+
+  // Spread the sample over the whole list, in case the files differ
+  std::vector<std::string> files;
+  const size_t n = std::min(opts.nFiles, all.size());
+  for(size_t i = 0; i < n; ++i) files.push_back(all[i*all.size()/n]);
+
+  std::vector<unsigned int> threadCounts = opts.threadCounts;
+  if(threadCounts.empty()){
+    const unsigned int nCores = NCores();
+    for(unsigned int t = 1; t < nCores; t *= 2) threadCounts.push_back(t);
+    threadCounts.push_back(nCores);
+  }
+
+  std::cout << "Calibrating on " << files.size() << " of " << all.size() << " files" << std::endl;
+
+  // Without eviction, get every file into memory now, so the first pass
+  // isn't the only one to read from storage
+  if(!opts.evictCache){
+    const std::atomic<bool> stop(false);
+    for(const std::string& f: files) WarmFile(f, stop);
+  }
+
+  HostProfile best;
+
+  bool tried = false;
+  for(unsigned int t: threadCounts){
+    if(t == 0 || (t > 1 && t > 2*files.size())) continue; // Not enough files to keep them busy
+    tried = true;
+    const double r = TrialThreads(files, t, opts.evictCache);
+    std::cout << "  " << t << " loaders: " << r << " events/s" << std::endl;
+    if(r > best.eventsPerSecond){best.eventsPerSecond = r; best.nLoaders = t;}
+  }
+  if(!tried){
+    std::cerr << "Calibrate: every loader count asked for is more than twice the "
+              << files.size() << " sample files; ask for fewer, or more files" << std::endl;
+    abort();
+  }
+  if(best.nLoaders == 0){
+    std::cerr << "Calibrate: no events were read from the sample files. Are they empty, or unreadable?" << std::endl;
+    abort();
+  }
+
+  double bestReadAhead = 0;
+  for(unsigned int d: opts.readAheadDepths){
+    const double r = TrialReadAhead(files, best.nLoaders, d, opts.evictCache);
+    std::cout << "  read-ahead " << (d == 0 || d == kReadAheadAll ? "all" : std::to_string(d))
+              << ": " << r << " events/s" << std::endl;
+    // Saved as kReadAheadAll rather than 0, which would mean "not measured"
+    if(r > bestReadAhead){bestReadAhead = r; best.readAheadDepth = d == 0 ? kReadAheadAll : d;}
+  }
+
+  double bestStream = 0;
+  for(size_t b: opts.batchSizes){
+    for(size_t d: opts.prefetchDepths){
+      const double r = TrialStream(files, best.readAheadDepth, b, d, opts.evictCache);
+      std::cout << "  batches of " << b << ", prefetch " << d << ": " << r << " events/s" << std::endl;
+      if(r > bestStream){bestStream = r; best.batchSize = b; best.prefetchDepth = d;}
+    }
+  }
+
+  if(opts.save && best.Save())
+    std::cout << "Saved to " << HostProfile::Path()
+              << ". New loaders in new sessions on this host will use it." << std::endl;
+  return best;
+}
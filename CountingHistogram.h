@@ -0,0 +1,152 @@
+// A histogram that counts in integers for as long as every weight is 1.
+//
+// Central-value spectra usually have unit weights until they are scaled to
+// a POT at the end. Adding 1.0 to a double is slower than incrementing an
+// integer, the count is exact however many events there are, and the
+// errors come for free (the sum of weights squared is just the count). A
+// CountingHistogram starts out counting, and switches to ordinary double
+// sums of w and w^2 the first time it sees a weight that isn't 1.
+//
+// While counting, bins are collected in a short buffer and added to
+// kCopies separate copies of the histogram in turn. Neighbouring events
+// often land in the same bin; with one copy each increment would have to
+// wait for the previous one to finish, but with several they can overlap.
+// Merging per-thread histograms with Add() is plain integer addition.
+//
+// Reading a histogram never changes it: the const accessors count in
+// whatever is still in the buffer without emptying it, so several threads
+// may read the same histogram at once. Call Flush() first if you will read
+// it a lot, which makes each read a plain lookup.
+
+#pragma once
+
+#include "TraceSpan.h"
+
+#include "CAFAna/Core/Binning.h"
+
+#include "TH1.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+class CountingHistogram
+{
+public:
+  static const int kCopies = 4;
+  static const size_t kBufferSize = 4096;
+
+  explicit CountingHistogram(const ana::Binning& bins)
+    : fEdges(bins.Edges()), fCounts(bins.NBins()+2, 0)
+  {
+    fPending.reserve(kBufferSize);
+  }
+
+  int NBins() const {return fEdges.size()-1;}
+
+  // Still counting, ie every weight so far has been 1
+  bool IsInteger() const {return fInteger;}
+
+  // Bin 0 is underflow and NBins()+1 overflow, like ROOT
+  int FindBin(double x) const
+  {
+    return std::upper_bound(fEdges.begin(), fEdges.end(), x) - fEdges.begin();
+  }
+
+  void Fill(double x, double w = 1)
+  {
+    const int bin = FindBin(x);
+    if(fInteger){
+      if(w == 1){
+        fPending.push_back(bin);
+        if(fPending.size() == kBufferSize) Flush();
+        return;
+      }
+      ToDouble();
+    }
+    fSumW[bin] += w;
+    fSumW2[bin] += w*w;
+  }
+
+  void Add(const CountingHistogram& h)
+  {
+    Flush();
+    const std::vector<uint64_t> counts = h.fInteger ? h.Counts() : std::vector<uint64_t>();
+    if(fInteger && h.fInteger){
+      for(size_t i = 0; i < fCounts.size(); ++i) fCounts[i] += counts[i];
+      return;
+    }
+    ToDouble();
+    for(size_t i = 0; i < fSumW.size(); ++i){
+      fSumW[i] += h.fInteger ? counts[i] : h.fSumW[i];
+      fSumW2[i] += h.fInteger ? counts[i] : h.fSumW2[i];
+    }
+  }
+
+  double BinContent(int bin) const
+  {
+    if(!fInteger) return fSumW[bin];
+    return fCounts[bin] + std::count(fPending.begin(), fPending.end(), bin);
+  }
+
+  double BinError(int bin) const
+  {
+    return fInteger ? sqrt(BinContent(bin)) : sqrt(fSumW2[bin]);
+  }
+
+  // Put the contents and errors, including under- and overflow, into h,
+  // which must have the same binning
+  void FillTH1(TH1D* h) const
+  {
+    const std::vector<uint64_t> counts = fInteger ? Counts() : std::vector<uint64_t>();
+    for(int i = 0; i <= NBins()+1; ++i){
+      h->SetBinContent(i, fInteger ? counts[i] : fSumW[i]);
+      h->SetBinError(i, sqrt(fInteger ? counts[i] : fSumW2[i]));
+    }
+  }
+
+  // Count the buffered bins into the copies, then add those up
+  void Flush()
+  {
+    if(fPending.empty()) return;
+    TraceSpan span("histogram fill", "fill");
+    const size_t stride = fCounts.size();
+    std::vector<uint32_t>& copies = fCopies; // The buffer is far too short to overflow these
+    copies.resize(kCopies*stride, 0);
+    const size_t n = fPending.size();
+    size_t i = 0;
+    for(; i + kCopies <= n; i += kCopies)
+      for(int c = 0; c < kCopies; ++c) ++copies[c*stride + fPending[i+c]];
+    for(; i < n; ++i) ++copies[fPending[i]];
+
+    for(size_t b = 0; b < stride; ++b)
+      for(int c = 0; c < kCopies; ++c) fCounts[b] += copies[c*stride + b];
+    std::fill(copies.begin(), copies.end(), 0);
+    fPending.clear();
+  }
+
+protected:
+  // The counts, including what is still in the buffer
+  std::vector<uint64_t> Counts() const
+  {
+    std::vector<uint64_t> ret = fCounts;
+    for(int bin: fPending) ++ret[bin];
+    return ret;
+  }
+
+  void ToDouble()
+  {
+    Flush();
+    fInteger = false;
+    fSumW.assign(fCounts.begin(), fCounts.end());
+    fSumW2 = fSumW;
+  }
+
+  std::vector<double> fEdges;
+  bool fInteger = true;
+  std::vector<uint64_t> fCounts;
+  std::vector<int> fPending;
+  std::vector<uint32_t> fCopies;
+  std::vector<double> fSumW, fSumW2; // Once a weight isn't 1
+};
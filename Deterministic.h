@@ -0,0 +1,238 @@
+// Get exactly the same answer every time, on any machine, with any number
+// of threads.
+//
+// Three things can make two runs of the same macro disagree:
+//
+//  1. The order the wildcard expands in. Use ExpandGlob() (from
+//     LoaderTools.h), which always sorts the files, and pass the list to
+//     SpectrumLoader instead of the wildcard.
+//
+//  2. Systs that draw from gRandom, like EMuSmear and ThetaSmear. The
+//     number each event gets depends on how many were drawn before it. The
+//     "Det" versions below instead work out each event's random number from
+//     the event's own identity, so it gets the same smearing whatever order
+//     the events come in.
+//
+//  3. Adding up floating-point numbers in a different order gives a
+//     slightly different answer. ExactHistogram adds weights as integers
+//     (in fixed point) instead, and integer addition doesn't care about
+//     order, so filling with 1 thread or 64 gives identical bins.
+
+#pragma once
+
+#include "EventTable.h"
+#include "LoaderTools.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A key for the event made only from things stored in the event itself.
+// The true energy is mixed in as well as the run/subrun/event numbers, in
+// case different files reuse those numbers.
+uint64_t IntrinsicEventKey(int run, int subrun, int event, float Ev)
+{
+  uint32_t evBits;
+  memcpy(&evBits, &Ev, sizeof(evBits));
+  return MixBits(EventKey(run, subrun, event) ^ evBits);
+}
+
+uint64_t IntrinsicEventKey(const caf::SRProxy* sr)
+{
+  return IntrinsicEventKey(sr->run, sr->subrun, sr->event, sr->Ev);
+}
+
+// A standard normal number that is always the same for the same event and
+// stream. Use a different stream for each syst, so their smearings are
+// independent.
+double EventGaus(uint64_t key, uint64_t stream)
+{
+  const double u1 = 1 - HashToUniform(key, 2*stream);   // (0, 1], so the log is safe
+  const double u2 = HashToUniform(key, 2*stream+1);
+  return sqrt(-2*log(u1)) * cos(2*TMath::Pi()*u2);
+}
+
+// EMuSmear, but reproducible. Two systs with the same stream use the same
+// random numbers ("common random numbers"), so the difference between
+// their spectra isn't swamped by different smearings. An antithetic syst
+// uses minus those numbers: averaging the spectra from a syst and its
+// antithetic partner cancels most of the smearing noise. The stream is part
+// of the short name, eg "muSmearDet_s1", so every stream is a distinct syst.
+class DetEMuSmear: public ISyst
+{
+public:
+  DetEMuSmear(uint64_t stream = 1, bool antithetic = false)
+    : ISyst((antithetic ? "muSmearDetAnti_s" : "muSmearDet_s") + std::to_string(stream),
+            antithetic ? "Muon energy smearing (deterministic, antithetic)" : "Muon energy smearing (deterministic)"),
+      fStream(stream), fSign(antithetic ? -1 : +1)
+  {
+  }
+
+  virtual void Shift(double sigma,
+                     Restorer& restore,
+                     caf::SRProxy* sr,
+                     double& weight) const override
+  {
+    restore.Add(sr->Elep_reco);
+    sr->Elep_reco *= 1 + sigma*0.2*fSign*EventGaus(IntrinsicEventKey(sr), fStream);
+  }
+
+  uint64_t Stream() const {return fStream;}
+  int Sign() const {return fSign;}
+
+protected:
+  uint64_t fStream;
+  int fSign;
+};
+
+// ThetaSmear, but reproducible. See DetEMuSmear for stream and antithetic.
+class DetThetaSmear: public ISyst
+{
+public:
+  DetThetaSmear(uint64_t stream = 2, bool antithetic = false)
+    : ISyst((antithetic ? "thetaSmearDetAnti_s" : "thetaSmearDet_s") + std::to_string(stream),
+            antithetic ? "Muon angle smearing (deterministic, antithetic)" : "Muon angle smearing (deterministic)"),
+      fStream(stream), fSign(antithetic ? -1 : +1)
+  {
+  }
+
+  virtual void Shift(double sigma,
+                     Restorer& restore,
+                     caf::SRProxy* sr,
+                     double& weight) const override
+  {
+    restore.Add(sr->theta_reco);
+    sr->theta_reco += sigma*TMath::Pi()/6.0*fSign*EventGaus(IntrinsicEventKey(sr), fStream);
+  }
+
+  uint64_t Stream() const {return fStream;}
+  int Sign() const {return fSign;}
+
+protected:
+  uint64_t fStream;
+  int fSign;
+};
+
+const DetEMuSmear kDetEMuSmear;
+const DetThetaSmear kDetThetaSmear;
+const DetEMuSmear kDetEMuSmearAnti(1, true);
+const DetThetaSmear kDetThetaSmearAnti(2, true);
+
+// Put the rows of a table in a fixed order, sorted by event key, no matter
+// what order they were read in. Rows with the same key (two events whose
+// keys collide, or the same event in two files) are ordered by each column
+// in turn, run, subrun and event first, so only rows that are identical in
+// every column can end up in either order.
+EventTable CanonicalOrder(const EventTable& t)
+{
+  std::vector<size_t> idx(t.Size());
+  for(size_t i = 0; i < idx.size(); ++i) idx[i] = i;
+  std::vector<uint64_t> keys(t.Size());
+  for(size_t i = 0; i < t.Size(); ++i)
+    keys[i] = IntrinsicEventKey(t.run[i], t.subrun[i], t.event[i], t.Ev[i]);
+
+  // Doubles are compared by their bits, which is a total order even with NaNs
+  auto bits = [](double x){uint64_t b; memcpy(&b, &x, sizeof(b)); return b;};
+  std::sort(idx.begin(), idx.end(), [&](size_t a, size_t b){
+      if(keys[a] != keys[b]) return keys[a] < keys[b];
+      for(const IntColumn& c: kIntColumns){
+        const int x = (t.*c.col)[a], y = (t.*c.col)[b];
+        if(x != y) return x < y;
+      }
+      for(const DoubleColumn& c: kDoubleColumns){
+        const uint64_t x = bits((t.*c.col)[a]), y = bits((t.*c.col)[b]);
+        if(x != y) return x < y;
+      }
+      return false;
+    });
+
+  EventTable ret;
+  ret.pot = t.pot;
+  ret.Reserve(t.Size());
+  for(size_t i: idx) ret.Append(t, i);
+  return ret;
+}
+
+// A histogram whose contents don't depend on the order it was filled in.
+// Each weight is rounded to a multiple of 2^-32 (about 2e-10) and added as
+// an integer.
+class ExactHistogram
+{
+public:
+  explicit ExactHistogram(const Binning& bins)
+    : fEdges(bins.Edges()), fSumW(bins.NBins()+2, 0), fSumW2(bins.NBins()+2, 0)
+  {
+  }
+
+  void Fill(double x, double w)
+  {
+    // Bin 0 is underflow and NBins()+1 overflow, like ROOT
+    const int bin = std::upper_bound(fEdges.begin(), fEdges.end(), x) - fEdges.begin();
+    fSumW[bin] += ToFixed(w);
+    fSumW2[bin] += ToFixed(w*w);
+  }
+
+  // Adding histograms is exact too, so merging per-thread copies in any
+  // order gives the same answer
+  void Add(const ExactHistogram& h)
+  {
+    for(size_t i = 0; i < fSumW.size(); ++i){
+      fSumW[i] += h.fSumW[i];
+      fSumW2[i] += h.fSumW2[i];
+    }
+  }
+
+  double BinContent(int bin) const {return ToDouble(fSumW[bin]);}
+
+  // Like Spectrum::ToTH1(pot), for a histogram that corresponds to histPOT
+  TH1D* ToTH1(const std::string& label, double pot, double histPOT) const
+  {
+    TH1D* h = MakeEmptyTH1(label, Binning::Custom(fEdges));
+    for(size_t i = 0; i < fSumW.size(); ++i){
+      h->SetBinContent(i, ToDouble(fSumW[i]));
+      h->SetBinError(i, sqrt(ToDouble(fSumW2[i])));
+    }
+    if(histPOT > 0) h->Scale(pot/histPOT);
+    return h;
+  }
+
+  bool operator==(const ExactHistogram& h) const
+  {
+    return fEdges == h.fEdges && fSumW == h.fSumW && fSumW2 == h.fSumW2;
+  }
+
+protected:
+  static __int128 ToFixed(double x) {return (__int128)llround(x * 0x1p32);}
+  static double ToDouble(__int128 x) {return double(x) * 0x1p-32;}
+
+  std::vector<double> fEdges;
+  std::vector<__int128> fSumW, fSumW2;
+};
+
+// Fill an ExactHistogram from a table using nThreads threads. Each thread
+// fills its own copy from a slice of the table and the copies are added up,
+// so the answer is identical for any nThreads.
+ExactHistogram FillExact(const EventTable& t,
+                         const Binning& bins,
+                         const TableVar& var,
+                         const TableCut& cut = kTableNoCut,
+                         unsigned int nThreads = 1)
+{
+  nThreads = std::max(nThreads, 1u);
+  std::vector<ExactHistogram> parts(nThreads, ExactHistogram(bins));
+  std::vector<std::thread> threads;
+  const size_t n = t.Size();
+  for(unsigned int k = 0; k < nThreads; ++k){
+    threads.emplace_back([&, k]{
+        for(size_t i = n*k/nThreads; i < n*(k+1)/nThreads; ++i)
+          if(cut(t, i)) parts[k].Fill(var(t, i), t.weight[i]);
+      });
+  }
+  for(std::thread& th: threads) th.join();
+
+  ExactHistogram ret(bins);
+  for(const ExactHistogram& p: parts) ret.Add(p);
+  return ret;
+}
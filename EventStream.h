@@ -0,0 +1,231 @@
+// Pull selected events out of a loader one batch at a time.
+//
+// loader.Go() pushes every event through your Spectrum objects and only
+// gives control back at the very end. SelectedEvents() turns that around:
+// it is a C++20 coroutine that you loop over, and each step hands you the
+// next batch of events that passed the cut (with the shift applied).
+//
+//   for(const EventTable& batch: SelectedEvents(loader, kCC0PiSelection)){
+//     ... look at batch.Eqe, batch.weight etc ...
+//     if(enough) break;
+//   }
+//
+// The loader runs on a background thread, so the next few batches are
+// being read and decompressed while you work on this one. At most
+// prefetchDepth batches wait in memory; after that the reading pauses until
+// you catch up. The final batch carries the POT the loader read, the
+// others have pot == 0. Leaving the loop early (break, return, an exception...)
+// stops the loader at the next event that passes the cut. A loader that has
+// been stopped like this can't be used again.
+//
+// You need ROOT built with C++20 for this one.
+
+#pragma once
+
+#include "EventTable.h"
+#include "HostProfile.h"
+
+#include "TROOT.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+
+// A minimal generator coroutine: co_yield values and loop over them with a
+// range-based for. The yielded value is only valid until the next step.
+template<class T> class Generator
+{
+public:
+  struct promise_type
+  {
+    const T* fValue = nullptr;
+    std::exception_ptr fError;
+
+    Generator get_return_object()
+    {
+      return Generator(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept {return {};}
+    std::suspend_always final_suspend() noexcept {return {};}
+    std::suspend_always yield_value(const T& x) noexcept {fValue = &x; return {};}
+    void return_void() {}
+    void unhandled_exception() {fError = std::current_exception();}
+  };
+
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  struct Sentinel {};
+
+  class Iterator
+  {
+  public:
+    explicit Iterator(Handle h) : fH(h) {}
+    const T& operator*() const {return *fH.promise().fValue;}
+    Iterator& operator++()
+    {
+      fH.resume();
+      Rethrow(fH);
+      return *this;
+    }
+    bool operator==(Sentinel) const {return fH.done();}
+  protected:
+    Handle fH;
+  };
+
+  explicit Generator(Handle h) : fH(h) {}
+  Generator(Generator&& g) : fH(g.fH) {g.fH = nullptr;}
+  Generator(const Generator&) = delete;
+  ~Generator() {if(fH) fH.destroy();}
+
+  Iterator begin()
+  {
+    fH.resume();
+    Rethrow(fH);
+    return Iterator(fH);
+  }
+  Sentinel end() {return {};}
+
+protected:
+  static void Rethrow(Handle h)
+  {
+    if(h.done() && h.promise().fError) std::rethrow_exception(h.promise().fError);
+  }
+
+  Handle fH;
+};
+
+// A queue that holds at most a fixed number of items. Push() waits while it
+// is full, which stops a fast producer running away from a slow consumer.
+template<class T> class BoundedQueue
+{
+public:
+  explicit BoundedQueue(size_t capacity) : fCapacity(std::max(capacity, size_t(1))) {}
+
+  // Returns false if the queue was closed instead
+  bool Push(T&& x)
+  {
+    std::unique_lock<std::mutex> lock(fMutex);
+    fNotFull.wait(lock, [this]{return fClosed || fItems.size() < fCapacity;});
+    if(fClosed) return false;
+    fItems.push_back(std::move(x));
+    fNotEmpty.notify_one();
+    return true;
+  }
+
+  // Returns false once the queue is closed and empty
+  bool Pop(T& x)
+  {
+    std::unique_lock<std::mutex> lock(fMutex);
+    fNotEmpty.wait(lock, [this]{return fClosed || !fItems.empty();});
+    if(fItems.empty()) return false;
+    x = std::move(fItems.front());
+    fItems.pop_front();
+    fNotFull.notify_one();
+    return true;
+  }
+
+  // No more pushes. Anything already queued can still be popped.
+  void Close()
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    fClosed = true;
+    fNotFull.notify_all();
+    fNotEmpty.notify_all();
+  }
+
+  size_t Size() const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fItems.size();
+  }
+
+protected:
+  size_t fCapacity;
+  std::deque<T> fItems;
+  mutable std::mutex fMutex;
+  std::condition_variable fNotFull, fNotEmpty;
+  bool fClosed = false;
+};
+
+// The defaults come from this host's profile, if Calibrate() has been run
+struct StreamOptions
+{
+  size_t batchSize = ProfileOr<size_t>(CurrentHostProfile().batchSize, 10000);   // Events per batch
+  size_t prefetchDepth = ProfileOr<size_t>(CurrentHostProfile().prefetchDepth, 4); // Batches read ahead of the consumer
+  std::stop_token stop;      // Optional: request_stop() on its source to cancel from elsewhere
+};
+
+// Thrown from inside the loader's event loop to make Go() return early
+struct StreamCancelled {};
+
+Generator<EventTable> SelectedEvents(SpectrumLoaderBase& loader,
+                                     Cut cut,
+                                     SystShifts shift = kNoShift,
+                                     StreamOptions opts = StreamOptions())
+{
+  ROOT::EnableThreadSafety();
+
+  struct State
+  {
+    explicit State(size_t depth) : queue(depth) {}
+    BoundedQueue<EventTable> queue;
+    EventTable pending;
+    std::atomic<bool> cancelled{false};
+    std::exception_ptr error;
+  };
+  auto state = std::make_shared<State>(opts.prefetchDepth);
+  const size_t batchSize = opts.batchSize;
+  const std::stop_token stop = opts.stop;
+
+  std::unique_ptr<Spectrum> callback =
+    OnEachEvent(loader, cut, shift,
+                [state, batchSize, stop](const caf::SRProxy* sr, double w)
+                {
+                  if(state->cancelled || stop.stop_requested()) throw StreamCancelled();
+                  state->pending.Append(sr, w);
+                  if(state->pending.Size() >= batchSize){
+                    if(!state->queue.Push(std::move(state->pending))) throw StreamCancelled();
+                    state->pending = EventTable();
+                    state->pending.Reserve(batchSize);
+                  }
+                });
+
+  std::thread producer([state, &loader, &callback]{
+      try{
+        loader.Go();
+        // The last batch, even if it is empty, carries the POT
+        state->pending.pot = callback->POT();
+        state->queue.Push(std::move(state->pending));
+      }
+      catch(StreamCancelled&){}
+      catch(...){state->error = std::current_exception();}
+      state->queue.Close();
+    });
+
+  // However we leave this function - finishing, the consumer breaking out
+  // of its loop, or an exception - stop and wait for the loader thread.
+  struct Joiner
+  {
+    State& s;
+    std::thread& t;
+    ~Joiner()
+    {
+      s.cancelled = true;
+      s.queue.Close();
+      t.join();
+    }
+  } joiner{*state, producer};
+
+  EventTable batch;
+  while(state->queue.Pop(batch)){
+    co_yield batch;
+  }
+
+  if(state->error) std::rethrow_exception(state->error);
+}
@@ -0,0 +1,330 @@
+// Keep a copy of the selected events in memory.
+//
+// A Spectrum only remembers the histogram of its Var. Sometimes you want
+// the events themselves, to make plots that don't fit the Spectrum model or
+// to try lots of variations without reading the files again. An EventTable
+// holds one column per CAF field used in these exercises, plus the event
+// weight, with one entry per selected event.
+//
+// To fill one, attach an EventRecorder to your loader alongside your
+// Spectrum objects. After loader.Go() it holds every event that passed the
+// cut, and the POT the loader saw.
+
+#pragma once
+
+#include "SystematicsCommon.h"
+#include "CountingHistogram.h"
+
+#include "TFile.h"
+#include "TH1.h"
+#include "TTree.h"
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+struct EventTable
+{
+  // Identify the event
+  std::vector<int> run, subrun, event;
+
+  // Truth
+  std::vector<int> mode;
+  std::vector<double> Ev;
+
+  // Final state
+  std::vector<int> LepPDG, nP, nipip, nipim, nipi0;
+
+  // Reconstruction
+  std::vector<double> Elep_reco, theta_reco;
+  std::vector<double> Eqe; // RecoQEEnergy(Elep_reco, theta_reco), worked out once
+
+  // Weight, including any syst reweighting applied when recording
+  std::vector<double> weight;
+
+  // Exposure the events correspond to
+  double pot = 0;
+
+  size_t Size() const {return weight.size();}
+
+  void Reserve(size_t n)
+  {
+    run.reserve(n); subrun.reserve(n); event.reserve(n);
+    mode.reserve(n); Ev.reserve(n);
+    LepPDG.reserve(n); nP.reserve(n); nipip.reserve(n); nipim.reserve(n); nipi0.reserve(n);
+    Elep_reco.reserve(n); theta_reco.reserve(n); Eqe.reserve(n);
+    weight.reserve(n);
+  }
+
+  void Clear()
+  {
+    run.clear(); subrun.clear(); event.clear();
+    mode.clear(); Ev.clear();
+    LepPDG.clear(); nP.clear(); nipip.clear(); nipim.clear(); nipi0.clear();
+    Elep_reco.clear(); theta_reco.clear(); Eqe.clear();
+    weight.clear();
+  }
+
+  void Append(const caf::SRProxy* sr, double w)
+  {
+    run.push_back(sr->run); subrun.push_back(sr->subrun); event.push_back(sr->event);
+    mode.push_back(sr->mode); Ev.push_back(sr->Ev);
+    LepPDG.push_back(sr->LepPDG); nP.push_back(sr->nP);
+    nipip.push_back(sr->nipip); nipim.push_back(sr->nipim); nipi0.push_back(sr->nipi0);
+    Elep_reco.push_back(sr->Elep_reco); theta_reco.push_back(sr->theta_reco);
+    Eqe.push_back(RecoQEEnergy(sr->Elep_reco, sr->theta_reco));
+    weight.push_back(w);
+  }
+
+  // Copy row i of another table onto the end of this one
+  void Append(const EventTable& t, size_t i)
+  {
+    run.push_back(t.run[i]); subrun.push_back(t.subrun[i]); event.push_back(t.event[i]);
+    mode.push_back(t.mode[i]); Ev.push_back(t.Ev[i]);
+    LepPDG.push_back(t.LepPDG[i]); nP.push_back(t.nP[i]);
+    nipip.push_back(t.nipip[i]); nipim.push_back(t.nipim[i]); nipi0.push_back(t.nipi0[i]);
+    Elep_reco.push_back(t.Elep_reco[i]); theta_reco.push_back(t.theta_reco[i]);
+    Eqe.push_back(t.Eqe[i]);
+    weight.push_back(t.weight[i]);
+  }
+};
+
+// The columns of an EventTable by name, for code that treats them all alike
+struct IntColumn {const char* name; std::vector<int> EventTable::* col;};
+struct DoubleColumn {const char* name; std::vector<double> EventTable::* col;};
+
+const std::vector<IntColumn> kIntColumns = {
+  {"run", &EventTable::run}, {"subrun", &EventTable::subrun}, {"event", &EventTable::event},
+  {"mode", &EventTable::mode}, {"LepPDG", &EventTable::LepPDG}, {"nP", &EventTable::nP},
+  {"nipip", &EventTable::nipip}, {"nipim", &EventTable::nipim}, {"nipi0", &EventTable::nipi0}
+};
+
+const std::vector<DoubleColumn> kDoubleColumns = {
+  {"Ev", &EventTable::Ev}, {"Elep_reco", &EventTable::Elep_reco}, {"theta_reco", &EventTable::theta_reco},
+  {"Eqe", &EventTable::Eqe}, {"weight", &EventTable::weight}
+};
+
+// Call a function for every event that passes the cut, after the shift has
+// been applied. The callback gets the shifted record and its weight.
+//
+// CAFAna only lets us see events through Vars, so this works by attaching a
+// one-bin Spectrum whose Var does the work. Its POT() is the exposure the
+// loader read. Keep the returned Spectrum alive until after loader.Go().
+std::unique_ptr<Spectrum> OnEachEvent(SpectrumLoaderBase& loader,
+                                      const Cut& cut,
+                                      const SystShifts& shift,
+                                      std::function<void(const caf::SRProxy*, double)> callback)
+{
+  const std::vector<const ISyst*> systs = shift.ActiveSysts();
+
+  // We apply the shift ourselves, rather than handing it to the Spectrum,
+  // so that we can see the weight the systs produce.
+  const Var kCallback([=](const caf::SRProxy* sr)
+                      {
+                        double weight = 1;
+                        Restorer restore; // Puts the record back when it goes out of scope
+                        caf::SRProxy* shifted = const_cast<caf::SRProxy*>(sr);
+                        for(const ISyst* syst: systs)
+                          syst->Shift(shift.GetShift(syst), restore, shifted, weight);
+
+                        if(cut(sr)) callback(sr, weight);
+                        return 0.;
+                      });
+
+  const HistAxis axCallback("", Binning::Simple(1, -1, +1), kCallback);
+  return std::unique_ptr<Spectrum>(new Spectrum(loader, axCallback, kNoCut));
+}
+
+// Record the events passing a cut into an EventTable
+class EventRecorder
+{
+public:
+  EventRecorder(SpectrumLoaderBase& loader,
+                const Cut& cut = kNoCut,
+                const SystShifts& shift = kNoShift)
+    : fTable(new EventTable)
+  {
+    std::shared_ptr<EventTable> table = fTable;
+    fSpect = OnEachEvent(loader, cut, shift,
+                         [table](const caf::SRProxy* sr, double w){table->Append(sr, w);});
+  }
+
+  // Only meaningful after loader.Go()
+  const EventTable& Table() const
+  {
+    fTable->pot = fSpect->POT();
+    return *fTable;
+  }
+
+  std::shared_ptr<EventTable> TablePtr() const
+  {
+    Table();
+    return fTable;
+  }
+
+protected:
+  std::shared_ptr<EventTable> fTable;
+  std::unique_ptr<Spectrum> fSpect;
+};
+
+// Cuts, Vars and weights that act on a row of an EventTable rather than on
+// a caf::SRProxy. They get the table and the row number.
+typedef std::function<bool(const EventTable&, size_t)> TableCut;
+typedef std::function<double(const EventTable&, size_t)> TableVar;
+
+const TableCut kTableNoCut = [](const EventTable&, size_t){return true;};
+const TableVar kTableEqe = [](const EventTable& t, size_t i){return t.Eqe[i];};
+const TableVar kTableWeight = [](const EventTable& t, size_t i){return t.weight[i];};
+
+// Make an empty histogram with the binning, and a title built from the label
+TH1D* MakeEmptyTH1(const std::string& label, const Binning& bins)
+{
+  TH1D* h = new TH1D(UniqueName().c_str(), (";"+label).c_str(),
+                     bins.NBins(), &bins.Edges()[0]);
+  h->Sumw2();
+  return h;
+}
+
+// Histogram a table, scaled to pot like Spectrum::ToTH1(pot). While the
+// weights are all 1 (the usual case for a central value) this just counts.
+TH1D* TableToTH1(const EventTable& table,
+                 const std::string& label,
+                 const Binning& bins,
+                 const TableVar& var,
+                 double pot,
+                 const TableCut& cut = kTableNoCut,
+                 const TableVar& wei = kTableWeight)
+{
+  CountingHistogram counts(bins);
+  for(size_t i = 0; i < table.Size(); ++i){
+    if(cut(table, i)) counts.Fill(var(table, i), wei(table, i));
+  }
+  TH1D* h = MakeEmptyTH1(label, bins);
+  counts.FillTH1(h);
+  if(table.pot > 0) h->Scale(pot/table.pot);
+  return h;
+}
+
+// Scramble a 64-bit number (the "splitmix64" mixer). Inputs that differ by
+// a single bit give completely different outputs.
+uint64_t MixBits(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// A number for each event, built from its run, subrun and event numbers.
+// It doesn't depend on which file the event was in or what order it was
+// read in. The three numbers are hashed in turn rather than packed into
+// bit fields, which couldn't hold three full 32-bit numbers, so two events
+// only share a key by chance (about 1 in 2^64 for any given pair).
+uint64_t EventKey(int run, int subrun, int event)
+{
+  uint64_t h = MixBits(uint32_t(run));
+  h = MixBits(h ^ uint32_t(subrun));
+  return MixBits(h ^ uint32_t(event));
+}
+
+uint64_t EventKey(const EventTable& t, size_t i)
+{
+  return EventKey(t.run[i], t.subrun[i], t.event[i]);
+}
+
+// A "random" number in [0, 1) that is always the same for the same key and
+// seed. Use a different seed for each independent use.
+double HashToUniform(uint64_t key, uint64_t seed)
+{
+  return (MixBits(key ^ MixBits(seed)) >> 11) * 0x1.0p-53;
+}
+
+// Save a table to a ROOT file, so it can be read back without the CAFs
+void SaveEventTable(const EventTable& t, const std::string& fname)
+{
+  TFile fout(fname.c_str(), "RECREATE");
+
+  // The file owns the trees, and deletes them when it is closed
+  TTree* events = new TTree("events", "Selected events");
+  int run, subrun, event, mode, LepPDG, nP, nipip, nipim, nipi0;
+  double Ev, Elep_reco, theta_reco, Eqe, weight;
+  events->Branch("run", &run); events->Branch("subrun", &subrun); events->Branch("event", &event);
+  events->Branch("mode", &mode); events->Branch("Ev", &Ev);
+  events->Branch("LepPDG", &LepPDG); events->Branch("nP", &nP);
+  events->Branch("nipip", &nipip); events->Branch("nipim", &nipim); events->Branch("nipi0", &nipi0);
+  events->Branch("Elep_reco", &Elep_reco); events->Branch("theta_reco", &theta_reco);
+  events->Branch("Eqe", &Eqe); events->Branch("weight", &weight);
+
+  for(size_t i = 0; i < t.Size(); ++i){
+    run = t.run[i]; subrun = t.subrun[i]; event = t.event[i];
+    mode = t.mode[i]; Ev = t.Ev[i];
+    LepPDG = t.LepPDG[i]; nP = t.nP[i];
+    nipip = t.nipip[i]; nipim = t.nipim[i]; nipi0 = t.nipi0[i];
+    Elep_reco = t.Elep_reco[i]; theta_reco = t.theta_reco[i];
+    Eqe = t.Eqe[i]; weight = t.weight[i];
+    events->Fill();
+  }
+
+  // Like the CAFs, keep the exposure in a "meta" tree
+  TTree* meta = new TTree("meta", "Exposure");
+  double pot = t.pot;
+  meta->Branch("pot", &pot);
+  meta->Fill();
+
+  fout.Write();
+  fout.Close();
+}
+
+// Read back a table written by SaveEventTable()
+EventTable LoadEventTable(const std::string& fname)
+{
+  TFile* fin = TFile::Open(fname.c_str());
+  if(!fin || fin->IsZombie()){
+    std::cerr << "LoadEventTable: can't open " << fname << std::endl;
+    abort();
+  }
+
+  TTree* events = 0;
+  TTree* meta = 0;
+  fin->GetObject("events", events);
+  fin->GetObject("meta", meta);
+  if(!events || !meta){
+    std::cerr << "LoadEventTable: " << fname << " isn't an event table file" << std::endl;
+    abort();
+  }
+
+  EventTable t;
+
+  double pot;
+  meta->SetBranchAddress("pot", &pot);
+  meta->GetEntry(0);
+  t.pot = pot;
+
+  int run, subrun, event, mode, LepPDG, nP, nipip, nipim, nipi0;
+  double Ev, Elep_reco, theta_reco, Eqe, weight;
+  events->SetBranchAddress("run", &run); events->SetBranchAddress("subrun", &subrun);
+  events->SetBranchAddress("event", &event);
+  events->SetBranchAddress("mode", &mode); events->SetBranchAddress("Ev", &Ev);
+  events->SetBranchAddress("LepPDG", &LepPDG); events->SetBranchAddress("nP", &nP);
+  events->SetBranchAddress("nipip", &nipip); events->SetBranchAddress("nipim", &nipim);
+  events->SetBranchAddress("nipi0", &nipi0);
+  events->SetBranchAddress("Elep_reco", &Elep_reco); events->SetBranchAddress("theta_reco", &theta_reco);
+  events->SetBranchAddress("Eqe", &Eqe); events->SetBranchAddress("weight", &weight);
+
+  const Long64_t n = events->GetEntries();
+  t.Reserve(n);
+  for(Long64_t i = 0; i < n; ++i){
+    events->GetEntry(i);
+    t.run.push_back(run); t.subrun.push_back(subrun); t.event.push_back(event);
+    t.mode.push_back(mode); t.Ev.push_back(Ev);
+    t.LepPDG.push_back(LepPDG); t.nP.push_back(nP);
+    t.nipip.push_back(nipip); t.nipim.push_back(nipim); t.nipi0.push_back(nipi0);
+    t.Elep_reco.push_back(Elep_reco); t.theta_reco.push_back(theta_reco);
+    t.Eqe.push_back(Eqe); t.weight.push_back(weight);
+  }
+
+  delete fin;
+  return t;
+}
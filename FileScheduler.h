@@ -0,0 +1,175 @@
+// Read the files that are already in memory first.
+//
+// If you ran over CAF_FHC_90*.root recently, some of those files may still
+// be in the operating system's page cache, so reading them costs no disk
+// or network time at all. A SpectrumLoader reads files in the order the
+// wildcard lists them, so it may well wait on a cold file while warm ones
+// sit there.
+//
+// A FileSchedule checks how much of each file is cached (with mincore()),
+// puts the warmest files first, and asks the system to start reading the
+// cold ones in the background. By the time the loader has got through the
+// warm files, the cold ones are hopefully warm too.
+//
+//   FileSchedule sched(CAFS);
+//   sched.Print();
+//   SpectrumLoader loader(sched.Files());
+
+#pragma once
+
+#include "LoaderTools.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// What fraction of a file is in the page cache right now. -1 if we can't
+// tell, for example because it isn't a local or NFS-mounted file.
+double ResidentFraction(const std::string& fname)
+{
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0) return -1;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0){
+    close(fd);
+    return -1;
+  }
+
+  // Mapping the file doesn't read anything; mincore() just reports which
+  // of its pages are already in memory
+  void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) return -1;
+
+  const long pageSize = sysconf(_SC_PAGESIZE);
+  const size_t nPages = (st.st_size + pageSize - 1)/pageSize;
+  std::vector<unsigned char> vec(nPages);
+  double ret = -1;
+  if(mincore(p, st.st_size, vec.data()) == 0){
+    size_t nResident = 0;
+    for(unsigned char v: vec) nResident += v & 1;
+    ret = double(nResident)/nPages;
+  }
+  munmap(p, st.st_size);
+  return ret;
+}
+
+// Ask for a file to be read into the page cache, and wait until it has
+// been. Reading in chunks, rather than just hinting, works on filesystems
+// that ignore hints too. Gives up early if stop is set.
+void WarmFile(const std::string& fname, const std::atomic<bool>& stop)
+{
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0) return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+  std::vector<char> buf(8 << 20);
+  off_t offset = 0;
+  while(!stop){
+    const ssize_t n = pread(fd, buf.data(), buf.size(), offset);
+    if(n <= 0) break;
+    offset += n;
+  }
+  close(fd);
+}
+
+// Drop a file from the page cache, so the next read really goes to the
+// disk (or network). Only affects pages nobody else has mapped. The page
+// cache is shared by the whole machine, so this slows down anyone else
+// reading the same file too. A file that was only just written is flushed
+// to storage first, since pages not yet written out can't be dropped.
+void EvictFile(const std::string& fname)
+{
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0) return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+class FileSchedule
+{
+public:
+  // readAheadDepth is how many of the cold files to warm in the background
+  // (0 or kReadAheadAll means all of them). Keep it small if memory is
+  // tight, or the files we warm may push each other back out of the cache.
+  // The default comes from this host's profile, if Calibrate() has been
+  // run.
+  FileSchedule(const std::string& wildcard,
+               unsigned int readAheadDepth = CurrentHostProfile().readAheadDepth)
+    : FileSchedule(ExpandGlob(wildcard), readAheadDepth)
+  {
+  }
+
+  FileSchedule(const std::vector<std::string>& files,
+               unsigned int readAheadDepth = CurrentHostProfile().readAheadDepth)
+  {
+    for(const std::string& f: files)
+      fEntries.push_back({f, ResidentFraction(f)});
+
+    // Warmest first. Ties (eg all completely cold) keep alphabetical order.
+    std::stable_sort(fEntries.begin(), fEntries.end(),
+                     [](const Entry& a, const Entry& b){return a.resident > b.resident;});
+
+    std::vector<std::string> cold;
+    for(const Entry& e: fEntries)
+      if(e.resident < .99) cold.push_back(e.fname);
+    if(readAheadDepth > 0 && cold.size() > readAheadDepth) cold.resize(readAheadDepth);
+
+    if(!cold.empty()){
+      fWarmer = std::thread([this, cold]{
+          for(const std::string& f: cold){
+            if(fStop) break;
+            WarmFile(f, fStop);
+          }
+        });
+    }
+  }
+
+  ~FileSchedule()
+  {
+    fStop = true;
+    if(fWarmer.joinable()) fWarmer.join();
+  }
+
+  FileSchedule(const FileSchedule&) = delete;
+
+  // The files in the order to read them. Give this to SpectrumLoader.
+  std::vector<std::string> Files() const
+  {
+    std::vector<std::string> ret;
+    for(const Entry& e: fEntries) ret.push_back(e.fname);
+    return ret;
+  }
+
+  void Print() const
+  {
+    std::cout << "Reading files in this order (% already in memory):" << std::endl;
+    for(const Entry& e: fEntries){
+      std::cout << "  " << e.fname << "  ";
+      if(e.resident < 0) std::cout << "unknown";
+      else std::cout << int(100*e.resident) << "%";
+      std::cout << std::endl;
+    }
+  }
+
+protected:
+  struct Entry
+  {
+    std::string fname;
+    double resident;
+  };
+
+  std::vector<Entry> fEntries;
+  std::atomic<bool> fStop{false};
+  std::thread fWarmer;
+};
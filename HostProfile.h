@@ -0,0 +1,109 @@
+// The loader settings that work best on this machine.
+//
+// The right number of threads, batch size and read-ahead depth on a laptop
+// reading local files is nothing like the right one on a 64-core node
+// reading from /pnfs. Calibrate() (see Calibration.h) measures them, and
+// saves them in ~/.dunesyst/<hostname>.profile. From then on, on that
+// host, LoaderPool, StreamOptions and FileSchedule use them as their
+// defaults. Anything you set explicitly still wins. Delete the file to go
+// back to the built-in defaults.
+
+#pragma once
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A read-ahead depth meaning "warm every file". Not 0, which in a profile
+// means the depth wasn't measured.
+const unsigned int kReadAheadAll = std::numeric_limits<unsigned int>::max();
+
+struct HostProfile
+{
+  // 0 means "not measured, use the built-in default"
+  unsigned int nLoaders = 0;       // Loaders to run at once (LoaderPool)
+  size_t batchSize = 0;            // Events per batch (StreamOptions)
+  size_t prefetchDepth = 0;        // Batches read ahead (StreamOptions)
+  unsigned int readAheadDepth = 0; // Files warmed ahead (FileSchedule), or kReadAheadAll
+  double eventsPerSecond = 0;      // The best throughput seen, for information
+
+  static std::string HostName()
+  {
+    char buf[256] = {0};
+    if(gethostname(buf, sizeof(buf)-1) != 0) return "unknown";
+    return buf;
+  }
+
+  static std::string Dir()
+  {
+    const char* home = getenv("HOME");
+    return std::string(home ? home : ".") + "/.dunesyst";
+  }
+
+  static std::string Path() {return Dir() + "/" + HostName() + ".profile";}
+
+  // An empty profile if there is no file
+  static HostProfile Load(const std::string& fname = Path())
+  {
+    HostProfile ret;
+    std::ifstream in(fname);
+    std::string key;
+    while(in >> key){
+      if(key[0] == '#'){std::getline(in, key); continue;}
+      // Profiles saved before the key was renamed call it nThreads
+      if(key == "nLoaders" || key == "nThreads") in >> ret.nLoaders;
+      else if(key == "batchSize") in >> ret.batchSize;
+      else if(key == "prefetchDepth") in >> ret.prefetchDepth;
+      else if(key == "readAheadDepth") in >> ret.readAheadDepth;
+      else if(key == "eventsPerSecond") in >> ret.eventsPerSecond;
+      else{
+        std::cerr << "HostProfile: ignoring unknown setting " << key << " in " << fname << std::endl;
+        std::getline(in, key);
+      }
+    }
+    return ret;
+  }
+
+  bool Save(const std::string& fname = Path()) const
+  {
+    if(fname == Path()) mkdir(Dir().c_str(), 0755);
+    std::ofstream out(fname);
+    if(!out){
+      std::cerr << "HostProfile: can't write " << fname << std::endl;
+      return false;
+    }
+    out << "# Loader settings for " << HostName() << ", from Calibrate()\n"
+        << "nLoaders " << nLoaders << "\n"
+        << "batchSize " << batchSize << "\n"
+        << "prefetchDepth " << prefetchDepth << "\n"
+        << "readAheadDepth " << readAheadDepth << "\n"
+        << "eventsPerSecond " << eventsPerSecond << "\n";
+    return bool(out);
+  }
+
+  void Print() const
+  {
+    std::cout << "Loader settings for " << HostName() << ":" << std::endl
+              << "  loaders at once:  " << nLoaders << std::endl
+              << "  batch size:       " << batchSize << std::endl
+              << "  prefetch depth:   " << prefetchDepth << std::endl
+              << "  read-ahead depth: "
+              << (readAheadDepth == kReadAheadAll ? "all" : std::to_string(readAheadDepth)) << std::endl
+              << "  best throughput:  " << eventsPerSecond << " events/s" << std::endl;
+  }
+};
+
+// This host's profile, read once
+const HostProfile& CurrentHostProfile()
+{
+  static const HostProfile profile = HostProfile::Load();
+  return profile;
+}
+
+// The profile's value if it has one, otherwise def
+template<class T> T ProfileOr(T value, T def) {return value > 0 ? value : def;}
@@ -0,0 +1,287 @@
+// Memory placement for big buffers: huge pages, NUMA locality and pinning.
+//
+// A stack of a few thousand universe histograms, or a decoded column, can
+// run to gigabytes. With ordinary 4 kB pages the processor's TLB (its
+// cache of address translations) can only cover a tiny part of that, and
+// every miss costs a page-table walk. With 2 MB huge pages it covers 512
+// times as much. LargeVector asks for huge pages, either transparent ones
+// (the kernel may or may not manage to provide them) or explicit ones from
+// the hugetlbfs pool (only if the admin has reserved some; see
+// /proc/sys/vm/nr_hugepages). If they can't be had it quietly uses ordinary
+// pages.
+//
+// On a dual-socket node each socket has its own memory, and reading the
+// other socket's is slower. Linux puts a page on the node of the thread
+// that first writes to it ("first touch"), so a buffer should be created
+// (and zeroed) by the thread that will use it, and that thread should then
+// stay on the same socket. PinThisThread() and NumaTopology do that.
+//
+// PerfCounter reads the hardware counters, to check that it helped.
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum class HugePageMode
+{
+  kOff,         // Ordinary pages
+  kTransparent, // Ask the kernel to back the buffer with huge pages if it can
+  kExplicit     // Take huge pages from the reserved pool, or fall back to ordinary ones
+};
+
+const size_t kHugePageSize = 2 << 20;
+
+// Allocate bytes of untouched memory, aligned to a huge page. Nothing is
+// placed on a NUMA node until it is first written to. With kOff this is
+// just the ordinary allocator, with no rounding up.
+void* AllocateLarge(size_t bytes, HugePageMode mode)
+{
+  if(mode == HugePageMode::kOff) return ::operator new(bytes);
+
+  const size_t size = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+
+  if(mode == HugePageMode::kExplicit){
+    void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(p != MAP_FAILED) return p;
+    // No reserved huge pages. Try for transparent ones instead.
+    mode = HugePageMode::kTransparent;
+  }
+
+  // Map a huge page more than we need, and trim the ends so what's left is
+  // aligned, which transparent huge pages need
+  const size_t padded = size + kHugePageSize;
+  char* p = (char*)mmap(0, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED) throw std::bad_alloc();
+
+  char* aligned = (char*)(((uintptr_t)p + kHugePageSize - 1) / kHugePageSize * kHugePageSize);
+  if(aligned > p) munmap(p, aligned - p);
+  const size_t tail = (p + padded) - (aligned + size);
+  if(tail > 0) munmap(aligned + size, tail);
+  madvise(aligned, size, MADV_HUGEPAGE);
+  return aligned;
+}
+
+// Free memory from AllocateLarge(), with the same bytes and mode
+void FreeLarge(void* p, size_t bytes, HugePageMode mode)
+{
+  if(mode == HugePageMode::kOff){
+    ::operator delete(p);
+    return;
+  }
+  const size_t size = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  munmap(p, size);
+}
+
+// A std allocator that uses AllocateLarge()
+template<class T> struct LargePageAllocator
+{
+  typedef T value_type;
+
+  HugePageMode mode;
+
+  LargePageAllocator(HugePageMode m = HugePageMode::kTransparent) : mode(m) {}
+  template<class U> LargePageAllocator(const LargePageAllocator<U>& a) : mode(a.mode) {}
+
+  T* allocate(size_t n)
+  {
+    if(n > std::numeric_limits<size_t>::max()/sizeof(T)) throw std::bad_alloc();
+    return (T*)AllocateLarge(n*sizeof(T), mode);
+  }
+  void deallocate(T* p, size_t n) {FreeLarge(p, n*sizeof(T), mode);}
+
+  template<class U> bool operator==(const LargePageAllocator<U>& a) const {return mode == a.mode;}
+  template<class U> bool operator!=(const LargePageAllocator<U>& a) const {return mode != a.mode;}
+};
+
+// A vector on huge pages. Make it in the thread that will use it, so its
+// pages land on that thread's NUMA node:
+//
+//   LargeVector<double> hists(n, 0, LargePageAllocator<double>(HugePageMode::kTransparent));
+template<class T> using LargeVector = std::vector<T, LargePageAllocator<T>>;
+
+// Expand a Linux CPU list like "0-3,8,10-11"
+std::vector<int> ParseCpuList(const std::string& s)
+{
+  std::vector<int> ret;
+  std::stringstream ss(s);
+  std::string range;
+  while(std::getline(ss, range, ',')){
+    if(range.empty()) continue;
+    const size_t dash = range.find('-');
+    const int lo = std::stoi(range.substr(0, dash));
+    const int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash+1));
+    for(int c = lo; c <= hi; ++c) ret.push_back(c);
+  }
+  return ret;
+}
+
+// The CPUs the calling thread may run on (eg as limited by taskset, or by
+// the batch system's cgroup)
+std::vector<int> AllowedCpus()
+{
+  std::vector<int> ret;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if(sched_getaffinity(0, sizeof(set), &set) != 0){
+    std::cerr << "AllowedCpus: sched_getaffinity failed: " << strerror(errno) << std::endl;
+    return ret;
+  }
+  for(int c = 0; c < CPU_SETSIZE; ++c) if(CPU_ISSET(c, &set)) ret.push_back(c);
+  return ret;
+}
+
+// Which CPUs belong to which NUMA node. Only the CPUs this process may run
+// on are listed, so a thread pinned to one of them stays within the
+// allocation the job was given.
+struct NumaTopology
+{
+  std::vector<std::vector<int>> nodeCpus;
+
+  static NumaTopology Detect()
+  {
+    std::vector<int> allowed = AllowedCpus();
+    if(allowed.empty()){
+      for(long c = 0; c < sysconf(_SC_NPROCESSORS_ONLN); ++c) allowed.push_back(c);
+    }
+
+    NumaTopology ret;
+    for(int node = 0; ; ++node){
+      std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+      if(!in) break;
+      std::string s;
+      std::getline(in, s);
+      std::vector<int> cpus;
+      for(int c: ParseCpuList(s))
+        if(std::find(allowed.begin(), allowed.end(), c) != allowed.end()) cpus.push_back(c);
+      if(!cpus.empty()) ret.nodeCpus.push_back(cpus);
+    }
+    // No NUMA information: one node with every CPU we may use
+    if(ret.nodeCpus.empty()) ret.nodeCpus.push_back(allowed);
+    return ret;
+  }
+
+  int NNodes() const {return nodeCpus.size();}
+
+  // Spread threads over the nodes in turn, so that two threads share a node
+  // only once every node has one
+  int NodeForThread(int k) const {return k % NNodes();}
+
+  int CpuForThread(int k) const
+  {
+    const std::vector<int>& cpus = nodeCpus[NodeForThread(k)];
+    return cpus[(k / NNodes()) % cpus.size()];
+  }
+};
+
+// Keep the calling thread on one CPU. Says why and returns false if the
+// CPU isn't one this thread may run on, or if pinning fails.
+bool PinThisThread(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if(sched_getaffinity(0, sizeof(set), &set) != 0){
+    std::cerr << "PinThisThread: sched_getaffinity failed: " << strerror(errno) << std::endl;
+    return false;
+  }
+  if(cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &set)){
+    std::cerr << "PinThisThread: CPU " << cpu << " is not in this thread's affinity mask" << std::endl;
+    return false;
+  }
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if(err != 0){
+    std::cerr << "PinThisThread: can't pin to CPU " << cpu << ": " << strerror(err) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// One hardware event counter, for the calling thread (and any threads it
+// starts after Start()). Not Valid() if the kernel won't let us count,
+// usually because /proc/sys/kernel/perf_event_paranoid is too high.
+class PerfCounter
+{
+public:
+  PerfCounter(uint32_t type, uint64_t config, const std::string& name)
+    : fName(name)
+  {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fFD = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  ~PerfCounter() {if(fFD >= 0) close(fFD);}
+  PerfCounter(const PerfCounter&) = delete;
+  PerfCounter(PerfCounter&& c) : fFD(c.fFD), fName(c.fName) {c.fFD = -1;}
+
+  bool Valid() const {return fFD >= 0;}
+  const std::string& Name() const {return fName;}
+
+  void Start()
+  {
+    if(!Valid()) return;
+    ioctl(fFD, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fFD, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  // The count since Start(), or -1 if we can't count
+  int64_t Stop()
+  {
+    if(!Valid()) return -1;
+    ioctl(fFD, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count = 0;
+    if(read(fFD, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+  }
+
+  // Data loads that missed the TLB
+  static PerfCounter DTLBLoadMisses()
+  {
+    return PerfCounter(PERF_TYPE_HW_CACHE,
+                       PERF_COUNT_HW_CACHE_DTLB |
+                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                       "dTLB load misses");
+  }
+
+  // Loads served from another NUMA node's memory
+  static PerfCounter NodeLoadMisses()
+  {
+    return PerfCounter(PERF_TYPE_HW_CACHE,
+                       PERF_COUNT_HW_CACHE_NODE |
+                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                       "remote-node loads");
+  }
+
+protected:
+  int fFD;
+  std::string fName;
+};
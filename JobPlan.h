@@ -0,0 +1,324 @@
+// Find out what a job will cost before running it.
+//
+// How much memory and time to ask for on the grid is usually a guess, and
+// guessing low gets the job killed. A PlannedLoader takes the same
+// spectrum declarations as the real job, and Plan() works out, without
+// reading the whole input:
+//
+//  - the files, their entries and sizes, from their metadata
+//  - which branches the spectra actually read, and so how many of the
+//    bytes will be read, from a short sample of the first file
+//  - how many spectra and universes there are, and how much memory their
+//    histograms and the ROOT I/O buffers take
+//  - the throughput in the sample, and so the projected run time
+//
+//   PlannedLoader loader(CAFS);
+//   loader.AddSpectrum(axRecoQEFormula, kCC0PiSelection);
+//   loader.AddUniverses(axRecoQEFormula, kCC0PiSelection, shifts);
+//   loader.Plan().Print();
+//   loader.Go(); // If the plan looks OK
+//
+// The sample is read with every spectrum attached, so the branches and the
+// throughput are those of the real job. Branches that are only read for
+// rare events may be missed if the sample is too short.
+
+#pragma once
+
+#include "SystematicsCommon.h"
+#include "EventTable.h"
+#include "LoaderTools.h"
+
+#include "TFile.h"
+#include "TLeaf.h"
+#include "TROOT.h"
+#include "TTree.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+struct PlanOptions
+{
+  long sampleEvents = 10000; // Events to time, from the first file
+  std::string treeName = "cafTree";
+};
+
+struct JobPlan
+{
+  struct FileInfo
+  {
+    std::string fname;
+    Long64_t entries = 0;
+    Long64_t bytes = 0;    // Size on disk
+    Long64_t zipBytes = 0; // Of the event tree, compressed
+  };
+
+  std::vector<FileInfo> files;
+  std::vector<std::string> badFiles;  // Couldn't be opened, or have no event tree
+  double openSeconds = 0;             // Per file, when reading the metadata
+
+  std::vector<std::string> branches;  // Read by the spectra, in the sample
+  double readFraction = 1;            // Of the compressed tree, in those branches
+
+  int nSpectra = 0;
+  int nUniverses = 0;                 // Distinct shifts, including the nominal
+  double histBytes = 0;               // Every spectrum's histogram
+  double bufferBytes = 0;             // ROOT's baskets and read cache
+  double baseBytes = 0;               // The process after the sample, excluding histograms
+  double peakBytes = 0;               // The process's peak so far
+
+  long sampleEvents = 0;
+  double eventsPerSecond = 0;
+
+  Long64_t TotalEntries() const
+  {
+    Long64_t n = 0;
+    for(const FileInfo& f: files) n += f.entries;
+    return n;
+  }
+
+  Long64_t TotalBytes() const
+  {
+    Long64_t n = 0;
+    for(const FileInfo& f: files) n += f.bytes;
+    return n;
+  }
+
+  // The compressed bytes of the branches the spectra read
+  double BytesToRead() const
+  {
+    double n = 0;
+    for(const FileInfo& f: files) n += f.zipBytes;
+    return n*readFraction;
+  }
+
+  // Memory to ask for
+  double EstimatedPeakBytes() const
+  {
+    return std::max(peakBytes, baseBytes + histBytes + bufferBytes);
+  }
+
+  double EstimatedSeconds() const
+  {
+    if(eventsPerSecond <= 0) return -1;
+    return TotalEntries()/eventsPerSecond + files.size()*openSeconds;
+  }
+
+  void Print() const
+  {
+    const double MB = 1 << 20;
+    std::cout << "Job plan:" << std::endl
+              << "  " << files.size() << " files, " << TotalEntries() << " entries, "
+              << TotalBytes()/MB << " MB on disk" << std::endl;
+    for(const std::string& f: badFiles) std::cout << "    can't use " << f << std::endl;
+    std::cout << "  " << branches.size() << " branches read, " << int(100*readFraction)
+              << "% of the event tree: " << BytesToRead()/MB << " MB to read" << std::endl;
+    for(const std::string& b: branches) std::cout << "    " << b << std::endl;
+    std::cout << "  " << nSpectra << " spectra, " << nUniverses << " universes" << std::endl
+              << "  Memory: histograms " << histBytes/MB << " MB, I/O buffers "
+              << bufferBytes/MB << " MB, the rest " << baseBytes/MB << " MB" << std::endl
+              << "          peak so far " << peakBytes/MB << " MB, ask for at least "
+              << EstimatedPeakBytes()/MB << " MB" << std::endl;
+    if(eventsPerSecond > 0)
+      std::cout << "  " << eventsPerSecond << " events/s over " << sampleEvents
+                << " sample events: about " << EstimatedSeconds()/60 << " minutes" << std::endl;
+    else
+      std::cout << "  No events in the sample, can't estimate the run time" << std::endl;
+  }
+};
+
+// Read a size in kB from /proc/self/status (eg "VmRSS"), in bytes
+double ProcStatusBytes(const std::string& key)
+{
+  std::ifstream in("/proc/self/status");
+  std::string k;
+  while(in >> k){
+    if(k == key + ":"){
+      double kb = 0;
+      in >> kb;
+      return 1024*kb;
+    }
+    std::getline(in, k);
+  }
+  return 0;
+}
+
+// Thrown from inside the sample pass to end it
+struct SampleDone {};
+
+class PlannedLoader
+{
+public:
+  PlannedLoader(const std::string& wildcard, const PlanOptions& opts = PlanOptions())
+    : fFiles(ExpandGlob(wildcard)), fOpts(opts)
+  {
+  }
+
+  PlannedLoader(const std::vector<std::string>& fnames, const PlanOptions& opts = PlanOptions())
+    : fFiles(fnames), fOpts(opts)
+  {
+  }
+
+  // Like the Spectrum constructor. Returns an index to look it up with
+  // after Go().
+  int AddSpectrum(const HistAxis& axis, const Cut& cut,
+                  const SystShifts& shift = kNoShift, const Var& wei = kUnweighted)
+  {
+    return fDecls.Declare(axis, cut, shift, "", wei);
+  }
+
+  // One spectrum per universe. Returns the index of the first.
+  int AddUniverses(const HistAxis& axis, const Cut& cut,
+                   const std::vector<SystShifts>& shifts, const Var& wei = kUnweighted)
+  {
+    return fDecls.DeclareUniverses(axis, cut, shifts, "", wei);
+  }
+
+  JobPlan Plan() const
+  {
+    JobPlan plan;
+    ReadMetadata(plan);
+    CountHistograms(plan);
+    if(!plan.files.empty()) Sample(plan);
+    return plan;
+  }
+
+  // Run the real job
+  void Go()
+  {
+    SpectrumLoader loader(fFiles);
+    fSpectra = fDecls.MakeSpectra(loader);
+    loader.Go();
+  }
+
+  const Spectrum& operator[](int idx) const {return *fSpectra[idx];}
+
+protected:
+  void ReadMetadata(JobPlan& plan) const
+  {
+    double openTime = 0;
+    for(const std::string& fname: fFiles){
+      const auto start = std::chrono::steady_clock::now();
+      std::unique_ptr<TFile> f(TFile::Open(fname.c_str()));
+      const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+      TTree* tree = 0;
+      if(f && !f->IsZombie()) f->GetObject(fOpts.treeName.c_str(), tree);
+      if(!tree){
+        plan.badFiles.push_back(fname);
+        continue;
+      }
+      openTime += dt.count();
+
+      JobPlan::FileInfo info;
+      info.fname = fname;
+      info.entries = tree->GetEntries();
+      info.bytes = f->GetSize();
+      info.zipBytes = tree->GetZipBytes();
+      plan.files.push_back(info);
+    }
+    if(!plan.files.empty()) plan.openSeconds = openTime/plan.files.size();
+  }
+
+  void CountHistograms(JobPlan& plan) const
+  {
+    // A universe is a distinct shift. SystShifts can't be compared, so go
+    // by the shift of each active syst.
+    std::set<std::vector<std::pair<const ISyst*, double>>> shifts;
+    for(const SpectrumDecl& d: fDecls){
+      // Contents and errors, including under- and overflow, plus the object itself
+      double nCells = 1;
+      for(const Binning& b: d.axis.GetBinnings()) nCells *= b.NBins()+2;
+      plan.histBytes += 2*sizeof(double)*nCells + 2048;
+
+      std::vector<std::pair<const ISyst*, double>> key;
+      for(const ISyst* s: d.shift.ActiveSysts()) key.emplace_back(s, d.shift.GetShift(s));
+      shifts.insert(key);
+    }
+    plan.nSpectra = fDecls.size();
+    plan.nUniverses = shifts.size();
+  }
+
+  // Read the start of the first file with every spectrum attached. Time it,
+  // and look at which branches of the tree were read.
+  void Sample(JobPlan& plan) const
+  {
+    const JobPlan::FileInfo& first = plan.files.front();
+    const long nSample = std::min<Long64_t>(fOpts.sampleEvents, first.entries);
+
+    SpectrumLoader loader(std::vector<std::string>{first.fname});
+    const std::vector<std::unique_ptr<Spectrum>> spectra = fDecls.MakeSpectra(loader);
+
+    long nSeen = 0;
+    std::chrono::steady_clock::time_point start;
+    double seconds = 0;
+    const std::string treeName = fOpts.treeName;
+    std::unique_ptr<Spectrum> probe =
+      OnEachEvent(loader, kNoCut, kNoShift,
+                  [&](const caf::SRProxy*, double){
+                    // Start the clock once the file is open
+                    if(nSeen++ == 0) start = std::chrono::steady_clock::now();
+                    if(nSeen < nSample) return;
+                    const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+                    seconds = dt.count();
+                    // The loader still has the file open, so the tree it
+                    // is reading is the one in memory
+                    TFile* f = (TFile*)gROOT->GetListOfFiles()->FindObject(first.fname.c_str());
+                    TTree* tree = 0;
+                    if(f) f->GetObject(treeName.c_str(), tree);
+                    if(tree) InspectBranches(tree, plan);
+                    throw SampleDone();
+                  });
+
+    try{
+      loader.Go();
+    }
+    catch(SampleDone&){}
+
+    plan.sampleEvents = nSeen;
+    if(seconds > 0) plan.eventsPerSecond = (nSeen-1)/seconds;
+    if(plan.branches.empty())
+      std::cerr << "PlannedLoader: couldn't see which branches were read; assuming all of them" << std::endl;
+
+    // The sample had every histogram allocated, so they are already in the
+    // process's size
+    plan.baseBytes = std::max(0., ProcStatusBytes("VmRSS") - plan.histBytes);
+    plan.peakBytes = ProcStatusBytes("VmHWM");
+  }
+
+  // Every branch that has had an entry read, and the buffers it needs
+  static void InspectBranches(TTree* tree, JobPlan& plan)
+  {
+    std::set<TBranch*> seen;
+    double readZip = 0;
+    TObjArray* leaves = tree->GetListOfLeaves();
+    for(int i = 0; i < leaves->GetEntriesFast(); ++i){
+      TBranch* br = ((TLeaf*)leaves->At(i))->GetBranch();
+      if(!br || !seen.insert(br).second || br->GetReadEntry() < 0) continue;
+      plan.branches.push_back(br->GetName());
+      readZip += br->GetZipBytes();
+      // One compressed and one uncompressed basket
+      plan.bufferBytes += 2*br->GetBasketSize();
+    }
+    std::sort(plan.branches.begin(), plan.branches.end());
+    if(tree->GetZipBytes() > 0) plan.readFraction = readZip/tree->GetZipBytes();
+
+    // The read cache holds a cluster of the branches being read
+    const Long64_t autoFlush = tree->GetAutoFlush();
+    double cluster = 0;
+    if(autoFlush > 0 && tree->GetEntries() > 0)
+      cluster = readZip*std::min<Long64_t>(autoFlush, tree->GetEntries())/tree->GetEntries();
+    else if(autoFlush < 0)
+      cluster = -autoFlush*plan.readFraction;
+    plan.bufferBytes += std::max<double>(cluster, tree->GetCacheSize());
+  }
+
+  std::vector<std::string> fFiles;
+  PlanOptions fOpts;
+  SpectrumDecls fDecls;
+  std::vector<std::unique_ptr<Spectrum>> fSpectra;
+};
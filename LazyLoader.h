@@ -0,0 +1,232 @@
+// Only fill the spectra you actually look at.
+//
+// While exploring it is easy to end up with a macro that declares a dozen
+// Spectra and then only draws three of them, but the loader fills all
+// twelve. A LazyLoader doesn't fill anything when you declare a spectrum.
+// The files are only read when you first ask one of them for a result
+// (ToTH1(), POT(), ...), and then only the spectra that have been asked
+// for get filled.
+//
+// At that first request the loader can't know which other spectra you are
+// about to draw. It fills:
+//
+//  - the one being asked for
+//  - any you marked with Require()
+//  - any that were used the last time the macro ran (if you gave the
+//    loader a name, it remembers this in <name>.lazy)
+//
+// If you then ask for one that wasn't filled, it warns you and goes over the
+// files again, filling that one (and any newly Require()d). Each miss costs
+// a pass, but next time the one you missed will be in the first pass.
+// If you would rather have at most one more pass, SetFillAllOnMiss(): a
+// miss then fills every spectrum still empty, except those you marked with
+// Skip(). Only asking for a Skip()ped one after that reads the files again.
+// When the loader is destroyed it lists the spectra that were declared but
+// never used.
+//
+//   LazyLoader loader(CAFS, "Systematics2");
+//   LazySpectrum& sCV = loader.Declare(axRecoQEFormula, kCC0PiSelection, kNoShift, "cv");
+//   LazySpectrum& sUp = loader.Declare(axRecoQEFormula, kCC0PiSelection, SystShifts(&kEMuScale, +1), "up");
+//   sCV.ToTH1(1e20)->Draw("HIST"); // Fills cv (and up, if it was used last time)
+
+#pragma once
+
+#include "SystematicsCommon.h"
+#include "LoaderTools.h"
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+class LazyLoader;
+
+// A Spectrum that is only filled when something uses it
+class LazySpectrum
+{
+public:
+  const Spectrum& Get() const;
+
+  TH1D* ToTH1(double pot, Color_t col = kBlack, Style_t style = kSolid) const
+  {
+    return Get().ToTH1(pot, col, style);
+  }
+  TH2D* ToTH2(double pot) const {return Get().ToTH2(pot);}
+  double POT() const {return Get().POT();}
+
+  // Fill this one in the first pass, whether or not it was used last time
+  void Require() {fRequired = true;}
+
+  // With SetFillAllOnMiss(), don't fill this one on a miss unless it is
+  // the one being asked for. For spectra you expect not to look at this
+  // time.
+  void Skip() {fSkipped = true;}
+
+  const std::string& Name() const;
+  bool Filled() const {return bool(fSpect);}
+  bool Used() const {return fUsed;}
+
+protected:
+  friend class LazyLoader;
+
+  LazySpectrum(LazyLoader* loader, int idx) : fLoader(loader), fIdx(idx) {}
+
+  LazyLoader* fLoader;
+  int fIdx; // Of its declaration in the loader
+
+  bool fRequired = false;
+  bool fSkipped = false;
+  mutable bool fUsed = false;
+  std::unique_ptr<Spectrum> fSpect;
+};
+
+class LazyLoader
+{
+public:
+  // Give a name to have the loader remember, between runs, which spectra
+  // were used
+  LazyLoader(const std::string& wildcard, const std::string& name = "")
+    : fWildcard(wildcard), fName(name)
+  {
+    if(fName.empty()) return;
+    std::ifstream in(ProfileName());
+    std::string s;
+    while(std::getline(in, s)) if(!s.empty()) fUsedLastTime.insert(s);
+  }
+
+  ~LazyLoader()
+  {
+    Report();
+    SaveProfile();
+  }
+
+  LazyLoader(const LazyLoader&) = delete;
+
+  // Like the Spectrum constructor. Names must be unique; by default the
+  // spectra are numbered in the order they are declared.
+  LazySpectrum& Declare(const HistAxis& axis, const Cut& cut,
+                        const SystShifts& shift = kNoShift,
+                        const std::string& name = "",
+                        const Var& wei = kUnweighted)
+  {
+    return Add(fDecls.Declare(axis, cut, shift, name, wei));
+  }
+
+  // One LazySpectrum per universe, named <name>_0, <name>_1, ...
+  std::vector<LazySpectrum*> DeclareUniverses(const HistAxis& axis, const Cut& cut,
+                                              const std::vector<SystShifts>& shifts,
+                                              const std::string& name,
+                                              const Var& wei = kUnweighted)
+  {
+    std::vector<LazySpectrum*> ret;
+    for(size_t i = fDecls.DeclareUniverses(axis, cut, shifts, name, wei); i < fDecls.size(); ++i)
+      ret.push_back(&Add(i));
+    return ret;
+  }
+
+  // On a miss after the first pass, fill every empty spectrum that isn't
+  // Skip()ped, not just the one asked for. Off by default.
+  void SetFillAllOnMiss(bool all) {fFillAllOnMiss = all;}
+
+  // How many times we have been over the files
+  int NPasses() const {return fNPasses;}
+
+  // List the spectra that were declared but never used
+  void Report() const
+  {
+    std::vector<std::string> unused, wasted;
+    for(const auto& s: fSpectra){
+      if(s->Used()) continue;
+      unused.push_back(s->Name());
+      if(s->Filled()) wasted.push_back(s->Name());
+    }
+    if(unused.empty()) return;
+
+    std::cout << "LazyLoader: " << unused.size() << " of " << fSpectra.size()
+              << " spectra were declared but never used:";
+    for(const std::string& n: unused) std::cout << " " << n;
+    std::cout << std::endl;
+    if(!wasted.empty()){
+      std::cout << "  of which these were filled anyway (Require()d, used last time, or with the rest on a miss):";
+      for(const std::string& n: wasted) std::cout << " " << n;
+      std::cout << std::endl;
+    }
+  }
+
+protected:
+  friend class LazySpectrum;
+
+  // The LazySpectrum for declaration idx
+  LazySpectrum& Add(int idx)
+  {
+    const std::string& n = fDecls[idx].name;
+    for(const auto& s: fSpectra){
+      if(s->Name() == n){
+        std::cerr << "LazyLoader: two spectra called " << n << std::endl;
+        abort();
+      }
+    }
+    fSpectra.emplace_back(new LazySpectrum(this, idx));
+    return *fSpectra.back();
+  }
+
+  // Called the first time something uses s
+  void Demand(const LazySpectrum* s)
+  {
+    if(s->Filled()) return;
+
+    // Only with SetFillAllOnMiss() does a miss fill what nobody has asked
+    // for yet
+    const bool again = fNPasses > 0;
+    const bool all = again && fFillAllOnMiss;
+    std::vector<LazySpectrum*> todo;
+    for(const auto& t: fSpectra){
+      if(t->Filled()) continue;
+      if(t.get() == s || t->fRequired || fUsedLastTime.count(t->Name()) || (all && !t->fSkipped))
+        todo.push_back(t.get());
+    }
+
+    if(again){
+      std::cerr << "LazyLoader: going over the files again for " << s->Name();
+      if(todo.size() > 1) std::cerr << ", and filling " << todo.size()-1 << " other spectra too";
+      if(!fName.empty()) std::cerr << " (next time " << s->Name() << " will be filled in the first pass)";
+      std::cerr << std::endl;
+    }
+
+    SpectrumLoader loader(fWildcard);
+    for(LazySpectrum* t: todo) t->fSpect = fDecls[t->fIdx].MakeSpectrum(loader);
+    loader.Go();
+    ++fNPasses;
+  }
+
+  std::string ProfileName() const {return fName + ".lazy";}
+
+  void SaveProfile() const
+  {
+    if(fName.empty()) return;
+    std::ofstream out(ProfileName());
+    for(const auto& s: fSpectra) if(s->Used()) out << s->Name() << "\n";
+  }
+
+  std::string fWildcard;
+  std::string fName;
+  std::set<std::string> fUsedLastTime;
+  SpectrumDecls fDecls;
+  std::vector<std::unique_ptr<LazySpectrum>> fSpectra; // One per declaration
+  bool fFillAllOnMiss = false;
+  int fNPasses = 0;
+};
+
+inline const std::string& LazySpectrum::Name() const
+{
+  return fLoader->fDecls[fIdx].name;
+}
+
+inline const Spectrum& LazySpectrum::Get() const
+{
+  fUsed = true;
+  fLoader->Demand(this);
+  return *fSpect;
+}
@@ -0,0 +1,239 @@
+// Run SpectrumLoaders in the background.
+//
+// loader.Go() doesn't return until every file has been read, so in
+// Systematics1Solution the second and third loaders can't start until the
+// first one has finished. GoAsync() hands the loader to a pool of worker
+// threads and returns straight away with a future. Call .get() (or
+// WaitAll()) on it when you need the loader's spectra.
+//
+//   auto f1 = GoAsync(lFirstCaf);
+//   auto f2 = GoAsync(lSecondCaf);
+//   f1.get();           // sFirstCaf is filled from here on...
+//   hFirstCaf->Draw();  // ...while lSecondCaf may still be reading
+//   WaitAll({f1, f2});
+//
+// Don't touch a loader, or any Spectrum attached to it, until its future
+// is ready.
+//
+// Don't use kEMuSmear or kThetaSmear (or anything else that draws from
+// gRandom) in loaders that may run at the same time. gRandom is a single
+// object shared by every thread, and drawing from it on two threads at once
+// is a data race: the behaviour is undefined, not just unrepeatable. Use
+// kDetEMuSmear and kDetThetaSmear from Deterministic.h instead, which
+// compute their smearing from the event and need no shared state. Loaders
+// with the gRandom systs must be run one at a time, with Go().
+
+#pragma once
+
+#include "HostProfile.h"
+
+#include "CAFAna/Core/Cut.h"
+#include "CAFAna/Core/HistAxis.h"
+#include "CAFAna/Core/Spectrum.h"
+#include "CAFAna/Core/SpectrumLoaderBase.h"
+#include "CAFAna/Core/SystShifts.h"
+#include "CAFAna/Core/Var.h"
+
+#include "TROOT.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glob.h>
+
+using namespace ana;
+
+// One per core. The default for work on events already in memory, which
+// is limited by the CPUs rather than by reading the files.
+unsigned int NCores()
+{
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// A fixed set of worker threads that run jobs in the order they arrive
+class LoaderPool
+{
+public:
+  explicit LoaderPool(unsigned int nThreads = DefaultNLoaders())
+  {
+    // ROOT I/O from more than one thread needs this switched on first
+    ROOT::EnableThreadSafety();
+
+    for(unsigned int i = 0; i < std::max(nThreads, 1u); ++i)
+      fWorkers.emplace_back([this]{WorkerLoop();});
+  }
+
+  ~LoaderPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fStopping = true;
+    }
+    fWake.notify_all();
+    for(std::thread& t: fWorkers) t.join();
+  }
+
+  LoaderPool(const LoaderPool&) = delete;
+  LoaderPool& operator=(const LoaderPool&) = delete;
+
+  unsigned int NThreads() const {return fWorkers.size();}
+
+  // How many loaders to run at once: from this host's profile if
+  // Calibrate() has been run, otherwise one per core. Only for reading
+  // files; it says nothing about how many threads other work should use.
+  static unsigned int DefaultNLoaders()
+  {
+    return ProfileOr(CurrentHostProfile().nLoaders, NCores());
+  }
+
+  // Queue a job. Any exception it throws comes back out of the future's get()
+  std::shared_future<void> Submit(std::function<void()> job)
+  {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::move(job));
+    std::shared_future<void> ret = task->get_future().share();
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fJobs.push([task]{(*task)();});
+    }
+    fWake.notify_one();
+    return ret;
+  }
+
+protected:
+  void WorkerLoop()
+  {
+    while(true){
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(fMutex);
+        fWake.wait(lock, [this]{return fStopping || !fJobs.empty();});
+        // Finish everything that was queued before shutting down
+        if(fJobs.empty()) return;
+        job = std::move(fJobs.front());
+        fJobs.pop();
+      }
+      job();
+    }
+  }
+
+  std::vector<std::thread> fWorkers;
+  std::queue<std::function<void()>> fJobs;
+  std::mutex fMutex;
+  std::condition_variable fWake;
+  bool fStopping = false;
+};
+
+// The pool GoAsync() uses unless you give it another one
+LoaderPool& DefaultLoaderPool()
+{
+  static LoaderPool pool;
+  return pool;
+}
+
+// Start loader.Go() in the background. The loader must stay alive until
+// the returned future is ready.
+std::shared_future<void> GoAsync(SpectrumLoaderBase& loader,
+                                 LoaderPool& pool = DefaultLoaderPool())
+{
+  return pool.Submit([&loader]{loader.Go();});
+}
+
+// Has this loader finished yet? Doesn't wait.
+bool IsReady(const std::shared_future<void>& f)
+{
+  return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+// Block until every loader has finished. If any of them failed, the first
+// error is thrown once they have all stopped.
+void WaitAll(const std::vector<std::shared_future<void>>& fs)
+{
+  for(const auto& f: fs) f.wait();
+  for(const auto& f: fs) f.get();
+}
+
+// The files a wildcard like CAF_FHC_90*.root matches, in alphabetical order
+std::vector<std::string> ExpandGlob(const std::string& wildcard)
+{
+  std::vector<std::string> ret;
+  glob_t g;
+  if(glob(wildcard.c_str(), 0, 0, &g) == 0){
+    for(size_t i = 0; i < g.gl_pathc; ++i) ret.push_back(g.gl_pathv[i]);
+  }
+  globfree(&g);
+  std::sort(ret.begin(), ret.end());
+  return ret;
+}
+
+// A spectrum declared to a loader that fills it later (see JobPlan.h,
+// LazyLoader.h, QueryPlanner.h and ResilientLoader.h): the arguments of the
+// Spectrum constructor, and a name to report it by
+struct SpectrumDecl
+{
+  std::string name;
+  HistAxis axis;
+  Cut cut;
+  SystShifts shift;
+  Var wei;
+
+  std::unique_ptr<Spectrum> MakeSpectrum(SpectrumLoaderBase& loader) const
+  {
+    return std::unique_ptr<Spectrum>(new Spectrum(loader, axis, cut, shift, wei));
+  }
+};
+
+// The spectra declared so far, in the order they were declared
+class SpectrumDecls
+{
+public:
+  // Like the Spectrum constructor. Returns an index to look the spectrum
+  // up by. Unnamed spectra are called #0, #1, ... in the order declared.
+  int Declare(const HistAxis& axis, const Cut& cut,
+              const SystShifts& shift = kNoShift,
+              const std::string& name = "",
+              const Var& wei = kUnweighted)
+  {
+    const std::string n = name.empty() ? "#" + std::to_string(fDecls.size()) : name;
+    fDecls.push_back({n, axis, cut, shift, wei});
+    return fDecls.size()-1;
+  }
+
+  // One spectrum per universe, named <name>_0, <name>_1, ... (or numbered,
+  // without a name). Returns the index of the first.
+  int DeclareUniverses(const HistAxis& axis, const Cut& cut,
+                       const std::vector<SystShifts>& shifts,
+                       const std::string& name = "",
+                       const Var& wei = kUnweighted)
+  {
+    const int ret = fDecls.size();
+    for(unsigned int i = 0; i < shifts.size(); ++i)
+      Declare(axis, cut, shifts[i], name.empty() ? "" : name + "_" + std::to_string(i), wei);
+    return ret;
+  }
+
+  size_t size() const {return fDecls.size();}
+  bool empty() const {return fDecls.empty();}
+  const SpectrumDecl& operator[](int idx) const {return fDecls[idx];}
+  std::vector<SpectrumDecl>::const_iterator begin() const {return fDecls.begin();}
+  std::vector<SpectrumDecl>::const_iterator end() const {return fDecls.end();}
+
+  // Attach every declared spectrum to loader, in order
+  std::vector<std::unique_ptr<Spectrum>> MakeSpectra(SpectrumLoaderBase& loader) const
+  {
+    std::vector<std::unique_ptr<Spectrum>> ret;
+    for(const SpectrumDecl& d: fDecls) ret.push_back(d.MakeSpectrum(loader));
+    return ret;
+  }
+
+protected:
+  std::vector<SpectrumDecl> fDecls;
+};
@@ -0,0 +1,328 @@
+// Small-integer columns stored as one-byte codes, and cuts evaluated on
+// them many events at a time.
+//
+// mode, LepPDG, nP and the pion counts only ever take a handful of values,
+// but an EventTable keeps each in a 4-byte int. A PackedColumn keeps the
+// distinct values in a sorted dictionary and one byte per event saying
+// which of them it is, so a scan over it reads a quarter of the memory.
+//
+// A cut on such a column, like abs(LepPDG) == 13, is worked out once per
+// dictionary entry rather than once per event. Because the dictionary is
+// sorted, the codes that pass nearly always form one or two runs (here
+// the codes of -13 and 13; for nP >= 1, every code from that of 1 up). So
+// the per-event work is "is this code in one of these runs", which SIMD
+// instructions do for 32 events at once (AVX2) or 16 (SSE2), with a plain
+// loop for other processors. The result is a Bitmap, one bit per event,
+// and cuts on several columns are combined by ANDing the bitmaps 64
+// events at a time.
+//
+//   const PackedEvents packed(table);
+//   const Bitmap sel = kPackedCC0Pi.Evaluate(packed);
+//   TH1D* h = TableToTH1(table, "E", binsEnergy, kTableEqe, 1e20, BitmapCut(sel));
+//
+// A cut on the sum of columns, like the total number of pions, needs the
+// sum as a column of its own. PackedEvents adds nPi for that.
+
+#pragma once
+
+#include "EventTable.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACKED_X86 1
+#endif
+
+// One bit per event
+class Bitmap
+{
+public:
+  explicit Bitmap(size_t n = 0, bool value = false)
+    : fN(n), fWords((n + 63)/64, value ? ~uint64_t(0) : 0)
+  {
+    ClearTail();
+  }
+
+  size_t Size() const {return fN;}
+  bool Test(size_t i) const {return (fWords[i/64] >> (i%64)) & 1;}
+  void Set(size_t i) {fWords[i/64] |= uint64_t(1) << (i%64);}
+
+  size_t Count() const
+  {
+    size_t n = 0;
+    for(uint64_t w: fWords) n += __builtin_popcountll(w);
+    return n;
+  }
+
+  Bitmap& operator&=(const Bitmap& b)
+  {
+    for(size_t i = 0; i < fWords.size(); ++i) fWords[i] &= b.fWords[i];
+    return *this;
+  }
+
+  Bitmap& operator|=(const Bitmap& b)
+  {
+    for(size_t i = 0; i < fWords.size(); ++i) fWords[i] |= b.fWords[i];
+    return *this;
+  }
+
+  uint64_t* Words() {return fWords.data();}
+  const uint64_t* Words() const {return fWords.data();}
+
+protected:
+  void ClearTail()
+  {
+    if(fN % 64) fWords.back() &= (uint64_t(1) << (fN % 64)) - 1;
+  }
+
+  size_t fN;
+  std::vector<uint64_t> fWords;
+};
+
+// Which SIMD instructions the packed cuts use
+enum class SimdLevel {kScalar, kSSE2, kAVX2};
+
+// The best this processor has
+SimdLevel DetectSimdLevel()
+{
+#ifdef PACKED_X86
+  if(__builtin_cpu_supports("avx2")) return SimdLevel::kAVX2;
+  if(__builtin_cpu_supports("sse2")) return SimdLevel::kSSE2;
+#endif
+  return SimdLevel::kScalar;
+}
+
+// What the packed cuts use, unless told otherwise (eg to compare them)
+SimdLevel& PackedSimdLevel()
+{
+  static SimdLevel level = DetectSimdLevel();
+  return level;
+}
+
+// Codes lo to hi inclusive
+struct CodeRun {uint8_t lo, hi;};
+
+// Set bit i of words where codes[i] is in any of the runs. Each function
+// does the multiple of 64 events it can; the caller finishes the rest.
+size_t MatchRunsScalar(const uint8_t* codes, size_t n, const std::vector<CodeRun>& runs, uint64_t* words)
+{
+  const size_t n64 = n/64*64;
+  for(size_t i = 0; i < n64; i += 64){
+    uint64_t w = 0;
+    for(int j = 0; j < 64; ++j){
+      const uint8_t c = codes[i+j];
+      bool pass = false;
+      for(const CodeRun& r: runs) pass |= uint8_t(c - r.lo) <= uint8_t(r.hi - r.lo);
+      w |= uint64_t(pass) << j;
+    }
+    words[i/64] = w;
+  }
+  return n64;
+}
+
+#ifdef PACKED_X86
+// c - lo <= hi - lo, unsigned, is the same as min(c - lo, hi - lo) == c - lo
+__attribute__((target("sse2")))
+size_t MatchRunsSSE2(const uint8_t* codes, size_t n, const std::vector<CodeRun>& runs, uint64_t* words)
+{
+  const size_t n64 = n/64*64;
+  for(size_t i = 0; i < n64; i += 64){
+    uint64_t w = 0;
+    for(int k = 0; k < 4; ++k){
+      const __m128i c = _mm_loadu_si128((const __m128i*)(codes + i + 16*k));
+      __m128i pass = _mm_setzero_si128();
+      for(const CodeRun& r: runs){
+        const __m128i d = _mm_sub_epi8(c, _mm_set1_epi8(r.lo));
+        const __m128i span = _mm_set1_epi8(uint8_t(r.hi - r.lo));
+        pass = _mm_or_si128(pass, _mm_cmpeq_epi8(_mm_min_epu8(d, span), d));
+      }
+      w |= uint64_t(uint16_t(_mm_movemask_epi8(pass))) << (16*k);
+    }
+    words[i/64] = w;
+  }
+  return n64;
+}
+
+__attribute__((target("avx2")))
+size_t MatchRunsAVX2(const uint8_t* codes, size_t n, const std::vector<CodeRun>& runs, uint64_t* words)
+{
+  const size_t n64 = n/64*64;
+  for(size_t i = 0; i < n64; i += 64){
+    uint64_t w = 0;
+    for(int k = 0; k < 2; ++k){
+      const __m256i c = _mm256_loadu_si256((const __m256i*)(codes + i + 32*k));
+      __m256i pass = _mm256_setzero_si256();
+      for(const CodeRun& r: runs){
+        const __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8(r.lo));
+        const __m256i span = _mm256_set1_epi8(uint8_t(r.hi - r.lo));
+        pass = _mm256_or_si256(pass, _mm256_cmpeq_epi8(_mm256_min_epu8(d, span), d));
+      }
+      w |= uint64_t(uint32_t(_mm256_movemask_epi8(pass))) << (32*k);
+    }
+    words[i/64] = w;
+  }
+  return n64;
+}
+#endif
+
+// A column of small ints as one-byte codes into a sorted dictionary
+class PackedColumn
+{
+public:
+  PackedColumn() {}
+
+  explicit PackedColumn(const std::vector<int>& values)
+  {
+    fDict = values;
+    std::sort(fDict.begin(), fDict.end());
+    fDict.erase(std::unique(fDict.begin(), fDict.end()), fDict.end());
+    if(fDict.size() > 256){
+      std::cerr << "PackedColumn: " << fDict.size() << " distinct values won't fit in a byte" << std::endl;
+      abort();
+    }
+
+    fCodes.reserve(values.size());
+    for(int v: values)
+      fCodes.push_back(std::lower_bound(fDict.begin(), fDict.end(), v) - fDict.begin());
+  }
+
+  size_t Size() const {return fCodes.size();}
+  int Value(size_t i) const {return fDict[fCodes[i]];}
+  const std::vector<int>& Dictionary() const {return fDict;}
+  const uint8_t* Codes() const {return fCodes.data();}
+
+  size_t Bytes() const {return fCodes.size() + fDict.size()*sizeof(int);}
+
+  // The events whose value passes pred. pred is only called once for each
+  // distinct value.
+  Bitmap Select(const std::function<bool(int)>& pred, SimdLevel level = PackedSimdLevel()) const
+  {
+    // The passing codes, as runs
+    std::vector<CodeRun> runs;
+    for(size_t c = 0; c < fDict.size(); ++c){
+      if(!pred(fDict[c])) continue;
+      if(!runs.empty() && runs.back().hi == c-1) runs.back().hi = c;
+      else runs.push_back({uint8_t(c), uint8_t(c)});
+    }
+
+    Bitmap ret(Size());
+    if(runs.empty()) return ret;
+
+    size_t done = 0;
+#ifdef PACKED_X86
+    if(level == SimdLevel::kAVX2) done = MatchRunsAVX2(Codes(), Size(), runs, ret.Words());
+    else if(level == SimdLevel::kSSE2) done = MatchRunsSSE2(Codes(), Size(), runs, ret.Words());
+    else
+#endif
+      done = MatchRunsScalar(Codes(), Size(), runs, ret.Words());
+
+    for(size_t i = done; i < Size(); ++i){
+      for(const CodeRun& r: runs){
+        if(fCodes[i] >= r.lo && fCodes[i] <= r.hi){ret.Set(i); break;}
+      }
+    }
+    return ret;
+  }
+
+protected:
+  std::vector<int> fDict;
+  std::vector<uint8_t> fCodes;
+};
+
+// The small-int columns of an EventTable, packed
+class PackedEvents
+{
+public:
+  explicit PackedEvents(const EventTable& t) : fN(t.Size())
+  {
+    for(const char* name: {"mode", "LepPDG", "nP", "nipip", "nipim", "nipi0"}){
+      for(const IntColumn& c: kIntColumns)
+        if(c.name == std::string(name)) fColumns[name] = PackedColumn(t.*c.col);
+    }
+
+    // The total number of pions, so cuts on it can be packed too
+    std::vector<int> nPi(fN);
+    for(size_t i = 0; i < fN; ++i) nPi[i] = t.nipip[i] + t.nipim[i] + t.nipi0[i];
+    fColumns["nPi"] = PackedColumn(nPi);
+  }
+
+  size_t Size() const {return fN;}
+
+  const PackedColumn& Column(const std::string& name) const
+  {
+    auto it = fColumns.find(name);
+    if(it == fColumns.end()){
+      std::cerr << "PackedEvents: no packed column called " << name << std::endl;
+      abort();
+    }
+    return it->second;
+  }
+
+  // Packed, against 4 bytes an event unpacked
+  size_t Bytes() const
+  {
+    size_t n = 0;
+    for(const auto& c: fColumns) n += c.second.Bytes();
+    return n;
+  }
+
+protected:
+  size_t fN;
+  std::map<std::string, PackedColumn> fColumns;
+};
+
+// A cut made of conditions on packed columns, all of which must pass
+class PackedCut
+{
+public:
+  PackedCut(const std::string& column, const std::function<bool(int)>& pred)
+  {
+    fTerms.push_back({column, pred});
+  }
+
+  Bitmap Evaluate(const PackedEvents& events, SimdLevel level = PackedSimdLevel()) const
+  {
+    Bitmap ret = events.Column(fTerms[0].column).Select(fTerms[0].pred, level);
+    for(size_t i = 1; i < fTerms.size(); ++i)
+      ret &= events.Column(fTerms[i].column).Select(fTerms[i].pred, level);
+    return ret;
+  }
+
+  PackedCut operator&&(const PackedCut& c) const
+  {
+    PackedCut ret = *this;
+    ret.fTerms.insert(ret.fTerms.end(), c.fTerms.begin(), c.fTerms.end());
+    return ret;
+  }
+
+protected:
+  struct Term
+  {
+    std::string column;
+    std::function<bool(int)> pred;
+  };
+
+  std::vector<Term> fTerms;
+};
+
+// kHasCC0PiFinalState, on packed columns
+const PackedCut kPackedCC0Pi =
+  PackedCut("LepPDG", [](int pdg){return abs(pdg) == 13;}) &&
+  PackedCut("nP", [](int nP){return nP >= 1;}) &&
+  PackedCut("nPi", [](int nPi){return nPi == 0;});
+
+// Use a bitmap as a cut on the table it was made from
+TableCut BitmapCut(const Bitmap& sel)
+{
+  auto bm = std::make_shared<Bitmap>(sel);
+  return [bm](const EventTable&, size_t i){return bm->Test(i);};
+}
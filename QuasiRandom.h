@@ -0,0 +1,163 @@
+// Throw universes that cover the space of syst shifts more evenly than
+// random ones do.
+//
+// Random universes clump together in some places and leave gaps in others,
+// so the band they make only converges like 1/sqrt(N). A Sobol sequence
+// places each new universe in the biggest remaining gap, and for smooth
+// effects like EMuScale or ResNorm the band converges much faster, close
+// to 1/N. The points are scrambled (Owen scrambling, done with a hash as
+// in Burley, "Practical Hash-based Owen Scrambling", 2020), which keeps
+// that evenness but makes each seed give a different, unbiased set of
+// universes. Each coordinate is then turned into a standard normal with the
+// inverse normal CDF.
+//
+// This only helps with the systs' sigmas. The per-event random numbers of
+// EMuSmear and ThetaSmear are still pseudo-random.
+//
+//   SobolSampler sobol;
+//   AdaptiveOptions opts;
+//   opts.sampler = &sobol;
+//   engine.RunAdaptive(gen, opts);
+
+#pragma once
+
+#include "Universes.h"
+
+#include "TMath.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// Primitive polynomials and initial direction numbers for the Sobol
+// sequence, from the new-joe-kuo-6.21201 table of Joe and Kuo. Dimension 1
+// (not listed) is the van der Corput sequence.
+struct SobolPolynomial
+{
+  int s;                // Degree
+  unsigned int a;       // Coefficients, without the leading and trailing 1s
+  std::vector<unsigned int> m; // Initial direction numbers
+};
+
+const std::vector<SobolPolynomial> kSobolPolynomials = {
+  {1,  0, {1}},
+  {2,  1, {1, 3}},
+  {3,  1, {1, 3, 1}},
+  {3,  2, {1, 1, 1}},
+  {4,  1, {1, 1, 3, 3}},
+  {4,  4, {1, 3, 5, 13}},
+  {5,  2, {1, 1, 5, 5, 17}},
+  {5,  4, {1, 1, 5, 5, 5}},
+  {5,  7, {1, 1, 7, 11, 19}},
+  {5, 11, {1, 1, 5, 1, 1}},
+  {5, 13, {1, 1, 1, 3, 11}},
+  {5, 14, {1, 3, 5, 5, 31}},
+  {6,  1, {1, 3, 3, 9, 7, 49}},
+  {6, 13, {1, 1, 1, 15, 21, 21}},
+  {6, 16, {1, 3, 1, 13, 27, 49}},
+  {6, 19, {1, 1, 1, 15, 7, 5}},
+  {6, 22, {1, 3, 1, 15, 13, 25}},
+  {6, 25, {1, 1, 5, 5, 19, 61}},
+  {7,  1, {1, 3, 7, 11, 23, 15, 103}},
+  {7,  4, {1, 3, 7, 13, 13, 15, 69}}
+};
+
+const int kSobolMaxDims = kSobolPolynomials.size() + 1;
+
+class SobolSampler: public IUniverseSampler
+{
+public:
+  SobolSampler(unsigned int seed = 42) {Reset(seed);}
+
+  virtual TMatrixD Next(int nUniverses, int nDims) override
+  {
+    if(nDims > kSobolMaxDims){
+      std::cerr << "SobolSampler: only have direction numbers for " << kSobolMaxDims
+                << " dimensions, not " << nDims << std::endl;
+      abort();
+    }
+    if(int(fX.size()) != nDims) Init(nDims);
+
+    TMatrixD ret(nUniverses, nDims);
+    for(int u = 0; u < nUniverses; ++u){
+      for(int d = 0; d < nDims; ++d){
+        const uint32_t x = OwenScramble(fX[d], fSeeds[d]);
+        ret(u, d) = TMath::NormQuantile((x + .5) * 0x1p-32); // Never exactly 0 or 1
+      }
+
+      // Gray code order: flip the direction number of the lowest zero bit
+      // of the index
+      const int c = __builtin_ctz(~fIndex);
+      for(int d = 0; d < nDims; ++d) fX[d] ^= fV[d][c];
+      ++fIndex;
+    }
+    return ret;
+  }
+
+  virtual void Reset(unsigned int seed) override
+  {
+    fSeed = seed;
+    fIndex = 0;
+    fX.clear(); // Init() on the next call
+  }
+
+protected:
+  void Init(int nDims)
+  {
+    fV.assign(nDims, std::vector<uint32_t>(32));
+    for(int k = 0; k < 32; ++k) fV[0][k] = 1u << (31-k);
+
+    for(int d = 1; d < nDims; ++d){
+      const SobolPolynomial& p = kSobolPolynomials[d-1];
+      std::vector<uint32_t>& v = fV[d];
+      for(int k = 0; k < 32 && k < p.s; ++k) v[k] = p.m[k] << (31-k);
+      for(int k = p.s; k < 32; ++k){
+        v[k] = v[k-p.s] ^ (v[k-p.s] >> p.s);
+        for(int j = 1; j < p.s; ++j)
+          if((p.a >> (p.s-1-j)) & 1) v[k] ^= v[k-j];
+      }
+    }
+
+    fX.assign(nDims, 0);
+    fSeeds.resize(nDims);
+    for(int d = 0; d < nDims; ++d) fSeeds[d] = Hash32(Hash32(fSeed ^ 0x5bd1e995u) + d);
+  }
+
+  static uint32_t Hash32(uint32_t x)
+  {
+    x ^= x >> 16; x *= 0x7feb352du;
+    x ^= x >> 15; x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+  }
+
+  // Nested uniform (Owen) scrambling, in the Laine-Karras form: a hash in
+  // which each bit only depends on the bits below it, applied to the
+  // reversed bits, so each bit depends on the ones above it
+  static uint32_t OwenScramble(uint32_t x, uint32_t seed)
+  {
+    x = Reverse(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return Reverse(x);
+  }
+
+  static uint32_t Reverse(uint32_t x)
+  {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+  unsigned int fSeed;
+  uint32_t fIndex;
+  std::vector<std::vector<uint32_t>> fV; // Direction numbers, per dimension
+  std::vector<uint32_t> fX;              // Current point, unscrambled
+  std::vector<uint32_t> fSeeds;          // Scramble, per dimension
+};
@@ -0,0 +1,603 @@
+// Work out what a set of spectra have in common before filling them, and
+// only compute each shared piece once.
+//
+// The spectra of an exercise like Systematics3 (sCV, sScaleUp, sScaleDn,
+// sSmear, sThetaSmear) all use the same cut and the same axis Var, and the
+// systs only touch one or two fields of the record each. A QueryLoader
+// takes the spectrum declarations and first builds a QueryPlan: a graph of
+//
+//  - reads of record fields
+//  - shifts, one per distinct set of syst shifts
+//  - Vars (axis and weight) and Cuts, each under the shift it depends on
+//  - fills, one per distinct spectrum
+//
+// with identical nodes merged. Two spectra declared the same way become
+// one fill. A Var or Cut is only put under the part of the shift that
+// changes a field it reads, so kHasCC0PiFinalState, which only looks at
+// truth fields, is worked out once per event whatever the shift, and the
+// muon energy under "muScale +1" is the same node with or without
+// "resNorm +1". Go() then fills the spectra through the usual
+// SpectrumLoader, with each merged Var or Cut evaluated once per event and
+// its value reused everywhere else it appears.
+//
+//   QueryLoader loader(CAFS);
+//   const int cv = loader.Declare(axRecoQEFormula, kCC0PiSelection, kNoShift, "cv");
+//   const int up = loader.Declare(axRecoQEFormula, kCC0PiSelection, SystShifts(&kEMuScale, +1), "up");
+//   loader.Plan().Print();   // What is shared, and why
+//   loader.Go();
+//   loader.Plan().Print();   // Now with how often each node was reused
+//   loader[cv].ToTH1(1e20)->Draw("hist");
+//
+// Which fields a Var or Cut reads and which a syst changes can't be seen
+// from the compiled code, so they are declared: the ones in
+// SystematicsCommon.h and Deterministic.h already are, and DescribeVar(),
+// DescribeCut() and DescribeSyst() add your own. Anything undescribed is
+// assumed to read, or change, every field, which is always safe but shares
+// less. Getting a description wrong (leaving out a field) gives wrong
+// spectra, so keep them next to the definitions. Systs that draw from
+// gRandom are never shared between shifts, as each shift draws its own
+// numbers.
+//
+// A value is only reused within the entry it was computed for. A probe
+// attached before any of the spectra counts the entries, and each value is
+// tagged with the count and the event's IntrinsicEventKey(), so two entries
+// that look the same never share values. The loader runs on one thread.
+
+#pragma once
+
+#include "SystematicsCommon.h"
+#include "Deterministic.h"
+#include "LoaderTools.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// What a Var or Cut reads from the record
+struct Footprint
+{
+  std::string name;
+  std::set<std::string> reads;
+  bool known = false;
+};
+
+// What a syst changes in the record. Event weights aren't fields, so a
+// syst that only reweights changes nothing here.
+struct SystFootprint
+{
+  std::set<std::string> writes;
+  bool random = false; // Draws from gRandom
+  bool known = false;
+};
+
+class FootprintRegistry
+{
+public:
+  static FootprintRegistry& Instance()
+  {
+    static FootprintRegistry r;
+    return r;
+  }
+
+  void Describe(const Var& v, const std::string& name, const std::set<std::string>& reads)
+  {
+    fVars[v.ID()] = {name, reads, true};
+  }
+
+  void Describe(const Cut& c, const std::string& name, const std::set<std::string>& reads)
+  {
+    fCuts[c.ID()] = {name, reads, true};
+  }
+
+  void Describe(const ISyst* s, const std::set<std::string>& writes, bool random)
+  {
+    fSysts[s] = {writes, random, true};
+  }
+
+  Footprint Find(const Var& v) const
+  {
+    auto it = fVars.find(v.ID());
+    return it == fVars.end() ? Footprint() : it->second;
+  }
+
+  Footprint Find(const Cut& c) const
+  {
+    auto it = fCuts.find(c.ID());
+    return it == fCuts.end() ? Footprint() : it->second;
+  }
+
+  SystFootprint Find(const ISyst* s) const
+  {
+    auto it = fSysts.find(s);
+    if(it != fSysts.end()) return it->second;
+    // Every instance of these, not just the standard ones
+    if(dynamic_cast<const DetEMuSmear*>(s)) return {{"Elep_reco"}, false, true};
+    if(dynamic_cast<const DetThetaSmear*>(s)) return {{"theta_reco"}, false, true};
+    return SystFootprint();
+  }
+
+protected:
+  FootprintRegistry()
+  {
+    const std::set<std::string> cc0pi = {"LepPDG", "nP", "nipip", "nipim", "nipi0"};
+    Describe(kUnweighted, "kUnweighted", {});
+    Describe(kNoCut, "kNoCut", {});
+    Describe(kRecoMuonEnergy, "kRecoMuonEnergy", {"Elep_reco"});
+    Describe(kRecoQEFormulaEnergy, "kRecoQEFormulaEnergy", {"Elep_reco", "theta_reco"});
+    Describe(kHasCC0PiFinalState, "kHasCC0PiFinalState", cc0pi);
+    std::set<std::string> sel = cc0pi;
+    sel.insert({"Elep_reco", "theta_reco"});
+    Describe(kCC0PiSelection, "kCC0PiSelection", sel);
+
+    Describe(&kEMuScale, {"Elep_reco"}, false);
+    Describe(&kEMuSmear, {"Elep_reco"}, true);
+    Describe(&kResNorm, {}, false);
+    Describe(&kThetaSmear, {"theta_reco"}, true);
+  }
+
+  std::map<int, Footprint> fVars, fCuts;
+  std::map<const ISyst*, SystFootprint> fSysts;
+};
+
+// Declare what your own Vars, Cuts and systs use, so the planner can share
+// them. The name is what QueryPlan::Print() calls them.
+void DescribeVar(const Var& v, const std::string& name, const std::set<std::string>& reads)
+{
+  FootprintRegistry::Instance().Describe(v, name, reads);
+}
+
+void DescribeCut(const Cut& c, const std::string& name, const std::set<std::string>& reads)
+{
+  FootprintRegistry::Instance().Describe(c, name, reads);
+}
+
+void DescribeSyst(const ISyst* s, const std::set<std::string>& writes, bool random = false)
+{
+  FootprintRegistry::Instance().Describe(s, writes, random);
+}
+
+struct PlanNode
+{
+  enum Kind {kRead, kShift, kVar, kCut, kFill};
+
+  Kind kind;
+  std::string label;
+  std::vector<int> inputs;
+  std::vector<std::string> notes;   // What was merged into it, and why
+  int users = 0;                    // Declared spectra that need it
+
+  // Filled in by QueryLoader::Go(), for Vars and Cuts
+  long calls = 0;                   // Asked for by the loader
+  long evals = 0;                   // Actually computed
+};
+
+class QueryPlan
+{
+public:
+  const std::vector<PlanNode>& Nodes() const {return fNodes;}
+  int NDeclared() const {return fNDeclared;}
+
+  int NNodes(PlanNode::Kind kind) const
+  {
+    int n = 0;
+    for(const PlanNode& node: fNodes) if(node.kind == kind) ++n;
+    return n;
+  }
+
+  void Print() const
+  {
+    static const char* kinds[] = {"read", "shift", "var", "cut", "fill"};
+    std::cout << "Query plan: " << fNDeclared << " spectra declared, "
+              << NNodes(PlanNode::kFill) << " fills, "
+              << NNodes(PlanNode::kShift) << " shifts, "
+              << NNodes(PlanNode::kVar) << " vars, "
+              << NNodes(PlanNode::kCut) << " cuts, reading "
+              << NNodes(PlanNode::kRead) << " fields" << std::endl;
+    for(size_t i = 0; i < fNodes.size(); ++i){
+      const PlanNode& node = fNodes[i];
+      std::cout << "  [" << i << "] " << kinds[node.kind] << " " << node.label;
+      if(!node.inputs.empty()){
+        std::cout << "  <-";
+        for(int in: node.inputs) std::cout << " [" << in << "]";
+      }
+      if(node.users > 1) std::cout << "  (used by " << node.users << " spectra)";
+      std::cout << std::endl;
+      for(const std::string& note: node.notes) std::cout << "        " << note << std::endl;
+      if(node.calls > 0)
+        std::cout << "        computed " << node.evals << " times for " << node.calls
+                  << " uses (" << int(100.*(node.calls - node.evals)/node.calls) << "% reused)" << std::endl;
+    }
+  }
+
+protected:
+  friend class QueryLoader;
+
+  std::vector<PlanNode> fNodes;
+  int fNDeclared = 0;
+};
+
+class QueryLoader
+{
+public:
+  QueryLoader(const std::string& wildcard) : fFiles(ExpandGlob(wildcard)) {}
+  QueryLoader(const std::vector<std::string>& fnames) : fFiles(fnames) {}
+
+  QueryLoader(const QueryLoader&) = delete;
+
+  // Like the Spectrum constructor. Returns an index to look it up with
+  // after Go(). The name is only for QueryPlan::Print().
+  int Declare(const HistAxis& axis, const Cut& cut,
+              const SystShifts& shift = kNoShift,
+              const std::string& name = "",
+              const Var& wei = kUnweighted)
+  {
+    CheckNotRun();
+    fBuilt = false;
+    return fDecls.Declare(axis, cut, shift, name, wei);
+  }
+
+  // One spectrum per universe, named <name>_0, <name>_1, ... Returns the
+  // index of the first.
+  int DeclareUniverses(const HistAxis& axis, const Cut& cut,
+                       const std::vector<SystShifts>& shifts,
+                       const std::string& name,
+                       const Var& wei = kUnweighted)
+  {
+    CheckNotRun();
+    fBuilt = false;
+    return fDecls.DeclareUniverses(axis, cut, shifts, name, wei);
+  }
+
+  const QueryPlan& Plan()
+  {
+    if(!fBuilt) Build();
+    return fPlan;
+  }
+
+  // Fill every spectrum, following the plan
+  void Go()
+  {
+    if(fRan){
+      std::cerr << "QueryLoader: Go() called twice" << std::endl;
+      abort();
+    }
+    Plan();
+
+    // Attached first, so the loader runs it before anything else on each
+    // entry: the nominal shift and kNoCut come first
+    SpectrumLoader loader(fFiles);
+    auto entry = std::make_shared<uint64_t>(0);
+    const std::unique_ptr<Spectrum> probe =
+      OnEachEvent(loader, kNoCut, kNoShift, [entry](const caf::SRProxy*, double){++*entry;});
+
+    // Each Var and Cut node becomes one wrapper, which remembers its value
+    // for the entry it was last asked about
+    std::map<int, std::shared_ptr<NodeCache>> caches;
+    std::map<int, Var> vars;
+    std::map<int, Cut> cuts;
+    for(const auto& it: fVarOf){
+      auto c = caches[it.first] = std::make_shared<NodeCache>();
+      const Var v = it.second;
+      vars.emplace(it.first, Var([c, v, entry](const caf::SRProxy* sr){
+            ++c->calls;
+            const uint64_t key = IntrinsicEventKey(sr);
+            if(!c->valid || c->entry != *entry || c->key != key){
+              c->value = v(sr);
+              c->entry = *entry;
+              c->key = key;
+              c->valid = true;
+              ++c->evals;
+            }
+            return c->value;
+          }));
+    }
+    for(const auto& it: fCutOf){
+      auto c = caches[it.first] = std::make_shared<NodeCache>();
+      const Cut cut = it.second;
+      cuts.emplace(it.first, Cut([c, cut, entry](const caf::SRProxy* sr){
+            ++c->calls;
+            const uint64_t key = IntrinsicEventKey(sr);
+            if(!c->valid || c->entry != *entry || c->key != key){
+              c->value = cut(sr);
+              c->entry = *entry;
+              c->key = key;
+              c->valid = true;
+              ++c->evals;
+            }
+            return c->value != 0;
+          }));
+    }
+
+    for(const FillDef& f: fFills){
+      std::vector<Var> axisVars;
+      for(int v: f.vars) axisVars.push_back(vars.at(v));
+      const HistAxis axis(f.labels, f.bins, axisVars);
+      fSpectra.emplace_back(new Spectrum(loader, axis, cuts.at(f.cut), fShiftOf.at(f.shift), vars.at(f.wei)));
+    }
+    loader.Go();
+    fRan = true;
+
+    for(const auto& it: caches){
+      fPlan.fNodes[it.first].calls = it.second->calls;
+      fPlan.fNodes[it.first].evals = it.second->evals;
+    }
+  }
+
+  const Spectrum& operator[](int idx) const
+  {
+    if(!fRan){
+      std::cerr << "QueryLoader: call Go() before using the spectra" << std::endl;
+      abort();
+    }
+    return *fSpectra[fFillOfDecl[idx]];
+  }
+
+protected:
+  void CheckNotRun() const
+  {
+    if(fRan){
+      std::cerr << "QueryLoader: can't declare spectra after Go()" << std::endl;
+      abort();
+    }
+  }
+
+  struct FillDef
+  {
+    std::vector<std::string> labels;
+    std::vector<Binning> bins;
+    std::vector<int> vars;
+    int cut, shift, wei;
+  };
+
+  struct NodeCache
+  {
+    uint64_t entry = 0;
+    uint64_t key = 0;
+    bool valid = false;
+    double value = 0;
+    long calls = 0, evals = 0;
+  };
+
+  // A shift as its systs and their sigmas, so that separately made but
+  // equal SystShifts are recognised. Sorted by name and sigma, and then by
+  // address, so systs with the same name still come in a fixed order.
+  typedef std::vector<std::pair<const ISyst*, double>> ShiftKey;
+
+  static ShiftKey KeyOf(const SystShifts& s)
+  {
+    ShiftKey key;
+    for(const ISyst* syst: s.ActiveSysts())
+      if(s.GetShift(syst) != 0) key.emplace_back(syst, s.GetShift(syst));
+    std::sort(key.begin(), key.end(), [](const auto& a, const auto& b){
+        if(a.first->ShortName() != b.first->ShortName()) return a.first->ShortName() < b.first->ShortName();
+        if(a.second != b.second) return a.second < b.second;
+        return std::less<const ISyst*>()(a.first, b.first);
+      });
+    return key;
+  }
+
+  static std::string ShiftName(const ShiftKey& key)
+  {
+    if(key.empty()) return "nominal";
+    std::string ret;
+    for(const auto& s: key){
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%+g", s.second);
+      ret += (ret.empty() ? "" : ", ") + s.first->ShortName() + " " + buf;
+    }
+    return ret;
+  }
+
+  static std::string Join(const std::set<std::string>& s)
+  {
+    std::string ret;
+    for(const std::string& x: s) ret += (ret.empty() ? "" : ", ") + x;
+    return ret.empty() ? "nothing" : ret;
+  }
+
+  int AddNode(PlanNode::Kind kind, const std::string& label, const std::vector<int>& inputs)
+  {
+    fPlan.fNodes.push_back({kind, label, inputs});
+    return fPlan.fNodes.size()-1;
+  }
+
+  int ReadNode(const std::string& field)
+  {
+    auto it = fReadNodes.find(field);
+    if(it != fReadNodes.end()) return it->second;
+    return fReadNodes[field] = AddNode(PlanNode::kRead, field, {});
+  }
+
+  int ShiftNode(const ShiftKey& key, const SystShifts& shift)
+  {
+    auto it = fShiftNodes.find(key);
+    if(it != fShiftNodes.end()) return it->second;
+    const int id = fShiftNodes[key] = AddNode(PlanNode::kShift, ShiftName(key), {});
+    fShiftOf.emplace(id, shift);
+    return id;
+  }
+
+  // The Var or Cut with this ID and footprint, under the part of the shift
+  // it depends on
+  int ExprNode(PlanNode::Kind kind, int objID, const Footprint& fp, const std::string& fallbackName,
+               const ShiftKey& shift, int fullShiftNode)
+  {
+    ShiftKey effective;
+    std::vector<const ISyst*> skipped;
+    bool random = false;
+    for(const auto& s: shift){
+      const SystFootprint sfp = FootprintRegistry::Instance().Find(s.first);
+      bool touches = false;
+      if(fp.known && fp.reads.empty()) touches = false;         // A constant
+      else if(sfp.known && sfp.writes.empty()) touches = false; // Only reweights
+      else if(!fp.known || !sfp.known) touches = true;
+      else for(const std::string& w: sfp.writes) touches = touches || fp.reads.count(w);
+      if(touches){
+        effective.push_back(s);
+        random = random || !sfp.known || sfp.random;
+      }
+      else{
+        skipped.push_back(s.first);
+      }
+    }
+
+    // Under a syst that draws its own random numbers, a value can't be
+    // shared with any other shift
+    const int group = random ? fullShiftNode : -1;
+    const auto key = std::make_tuple(int(kind), objID, effective, group);
+    auto it = fExprNodes.find(key);
+    int id;
+    if(it != fExprNodes.end()){
+      id = it->second;
+    }
+    else{
+      std::vector<int> inputs;
+      if(!effective.empty()) inputs.push_back(ShiftNode(effective, ShiftOf(effective)));
+      if(fp.known) for(const std::string& f: fp.reads) inputs.push_back(ReadNode(f));
+      else inputs.push_back(ReadNode("(any field)"));
+
+      std::string label = fp.known ? fp.name : fallbackName;
+      if(!effective.empty()) label += " under " + ShiftName(effective);
+      if(random) label += " (own random numbers)";
+      id = fExprNodes[key] = AddNode(kind, label, inputs);
+      if(!fp.known)
+        fPlan.fNodes[id].notes.push_back("not described, so assumed to read every field; Describe" +
+                                         std::string(kind == PlanNode::kVar ? "Var" : "Cut") +
+                                         "() it to share it between shifts");
+    }
+
+    // Say once for each syst why it didn't need a separate copy. Constants
+    // (reading nothing) go without saying.
+    if(!fp.reads.empty()){
+      for(const ISyst* s: skipped){
+        if(fNoted.insert({id, s}).second)
+          fPlan.fNodes[id].notes.push_back("shared across " + s->ShortName() + ", which changes " +
+                                           Join(FootprintRegistry::Instance().Find(s).writes) +
+                                           "; this reads " + Join(fp.reads));
+      }
+    }
+    return id;
+  }
+
+  // A SystShifts with just these shifts
+  static SystShifts ShiftOf(const ShiftKey& key)
+  {
+    SystShifts ret;
+    for(const auto& s: key) ret.SetShift(s.first, s.second);
+    return ret;
+  }
+
+  void Build()
+  {
+    fPlan = QueryPlan();
+    fPlan.fNDeclared = fDecls.size();
+    fReadNodes.clear();
+    fShiftNodes.clear();
+    fExprNodes.clear();
+    fNoted.clear();
+    fVarOf.clear();
+    fCutOf.clear();
+    fShiftOf.clear();
+    fFills.clear();
+    fFillOfDecl.clear();
+
+    const FootprintRegistry& reg = FootprintRegistry::Instance();
+    std::map<std::tuple<std::vector<std::vector<double>>, std::vector<int>, int, int, int>, int> fillNodes;
+    std::map<int, std::set<int>> usersOf;
+
+    for(size_t d = 0; d < fDecls.size(); ++d){
+      const SpectrumDecl& decl = fDecls[d];
+      const ShiftKey shift = KeyOf(decl.shift);
+      const int shiftNode = ShiftNode(shift, decl.shift);
+
+      FillDef f;
+      f.labels = decl.axis.GetLabels();
+      f.bins = decl.axis.GetBinnings();
+      f.shift = shiftNode;
+      const std::vector<Var>& axisVars = decl.axis.GetVars();
+      for(size_t i = 0; i < axisVars.size(); ++i){
+        const int v = ExprNode(PlanNode::kVar, axisVars[i].ID(), reg.Find(axisVars[i]),
+                               "\"" + f.labels[i] + "\"", shift, shiftNode);
+        fVarOf.emplace(v, axisVars[i]);
+        f.vars.push_back(v);
+      }
+      f.cut = ExprNode(PlanNode::kCut, decl.cut.ID(), reg.Find(decl.cut),
+                       "#" + std::to_string(decl.cut.ID()), shift, shiftNode);
+      fCutOf.emplace(f.cut, decl.cut);
+      f.wei = ExprNode(PlanNode::kVar, decl.wei.ID(), reg.Find(decl.wei),
+                       "#" + std::to_string(decl.wei.ID()), shift, shiftNode);
+      fVarOf.emplace(f.wei, decl.wei);
+
+      // Spectra with the same binning, Vars, Cut, shift and weight are the
+      // same spectrum
+      std::vector<std::vector<double>> edges;
+      for(const Binning& b: f.bins) edges.push_back(b.Edges());
+      const auto key = std::make_tuple(edges, f.vars, f.cut, f.shift, f.wei);
+      auto it = fillNodes.find(key);
+      if(it != fillNodes.end()){
+        const int node = it->second;
+        fPlan.fNodes[node].notes.push_back("also declared as " + decl.name);
+        fFillOfDecl.push_back(fFillIndex[node]);
+      }
+      else{
+        std::vector<int> inputs = {shiftNode, f.cut};
+        inputs.insert(inputs.end(), f.vars.begin(), f.vars.end());
+        inputs.push_back(f.wei);
+        const int node = AddNode(PlanNode::kFill, decl.name, inputs);
+        fillNodes[key] = node;
+        fFillIndex[node] = fFills.size();
+        fFillOfDecl.push_back(fFills.size());
+        fFills.push_back(f);
+      }
+
+      usersOf[shiftNode].insert(d);
+      for(int v: f.vars) usersOf[v].insert(d);
+      usersOf[f.cut].insert(d);
+      usersOf[f.wei].insert(d);
+    }
+
+    // Reads are used by whatever uses the nodes reading them, and shifts
+    // by the Vars and Cuts under them
+    for(int i = fPlan.fNodes.size()-1; i >= 0; --i){
+      for(int in: fPlan.fNodes[i].inputs)
+        usersOf[in].insert(usersOf[i].begin(), usersOf[i].end());
+    }
+    for(size_t i = 0; i < fPlan.fNodes.size(); ++i)
+      if(fPlan.fNodes[i].kind != PlanNode::kFill) fPlan.fNodes[i].users = usersOf[i].size();
+    for(const auto& it: fFillIndex){
+      int n = 0;
+      for(int f: fFillOfDecl) if(f == it.second) ++n;
+      fPlan.fNodes[it.first].users = n;
+    }
+
+    fBuilt = true;
+  }
+
+  std::vector<std::string> fFiles;
+  SpectrumDecls fDecls;
+
+  QueryPlan fPlan;
+  bool fBuilt = false;
+  bool fRan = false;
+
+  // Plan nodes, and what each stands for
+  std::map<std::string, int> fReadNodes;
+  std::map<ShiftKey, int> fShiftNodes;
+  std::map<std::tuple<int, int, ShiftKey, int>, int> fExprNodes;
+  std::set<std::pair<int, const ISyst*>> fNoted;
+  std::map<int, Var> fVarOf;
+  std::map<int, Cut> fCutOf;
+  std::map<int, SystShifts> fShiftOf;
+
+  std::vector<FillDef> fFills;
+  std::map<int, int> fFillIndex;  // Fill node -> fFills
+  std::vector<int> fFillOfDecl;   // Declaration -> fFills
+  std::vector<std::unique_ptr<Spectrum>> fSpectra;
+};
@@ -0,0 +1,300 @@
+// Load many files without one bad file ruining the whole job.
+//
+// If one of the files in a wildcard is truncated or unreadable, loader.Go()
+// either stops the whole job or, worse, carries on and normalises with the
+// wrong POT. A ResilientLoader deals with each file separately:
+//
+//  - it opens the file first, retrying a few times in case the failure was
+//    temporary (a busy dCache pool, say)
+//  - files that still can't be opened, that ROOT had to "recover", or that
+//    are missing their trees are quarantined
+//  - optionally (deepCheck) it reads every entry, so a single bad basket is
+//    found before any spectra are filled
+//  - each good file is then loaded on its own, and the results are added up.
+//    ROOT reports a bad basket through its error handler rather than by
+//    throwing, so while a file is read any ROOT error counts as a failure
+//    of that file
+//
+// A quarantined file contributes neither events nor POT, so the totals stay
+// correctly normalised. The POT is only recorded per file, not per basket,
+// so a file with one bad basket is left out completely. WriteReport() says
+// exactly what was left out and why.
+//
+//   ResilientLoader loader(CAFS);
+//   const int iCV = loader.AddSpectrum(axRecoQEFormula, kCC0PiSelection);
+//   loader.Go();
+//   loader.WriteReport("load_report.json");
+//   TH1D* h = loader[iCV].ToTH1(1e20);
+
+#pragma once
+
+#include "SystematicsCommon.h"
+#include "LoaderTools.h"
+
+#include "TError.h"
+#include "TFile.h"
+#include "TTree.h"
+
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+struct FileLoadStatus
+{
+  enum EStatus {kOK, kQuarantined};
+
+  std::string fname;
+  EStatus status = kOK;
+  int attempts = 0;    // How many tries it took, or how many failed
+  std::string reason;  // Why it was quarantined
+  double pot = 0;      // From the file's meta tree
+};
+
+// While one of these exists, every ROOT message of level kError or worse is
+// remembered, as well as being passed on to the usual handler. Only one
+// may exist at a time.
+class ROOTErrorTrap
+{
+public:
+  ROOTErrorTrap()
+  {
+    std::lock_guard<std::mutex> lock(Mutex());
+    First().clear();
+    Prev() = SetErrorHandler(Handler);
+  }
+
+  ~ROOTErrorTrap()
+  {
+    std::lock_guard<std::mutex> lock(Mutex());
+    SetErrorHandler(Prev());
+  }
+
+  ROOTErrorTrap(const ROOTErrorTrap&) = delete;
+  ROOTErrorTrap& operator=(const ROOTErrorTrap&) = delete;
+
+  // The first error seen, or empty if there wasn't one
+  std::string Error() const
+  {
+    std::lock_guard<std::mutex> lock(Mutex());
+    return First();
+  }
+
+protected:
+  static void Handler(int level, bool abort, const char* location, const char* msg)
+  {
+    ErrorHandlerFunc_t prev;
+    {
+      std::lock_guard<std::mutex> lock(Mutex());
+      if(level >= kError && First().empty())
+        First() = std::string(location ? location : "") + ": " + (msg ? msg : "");
+      prev = Prev();
+    }
+    if(prev) prev(level, abort, location, msg);
+    else DefaultErrorHandler(level, abort, location, msg);
+  }
+
+  static std::mutex& Mutex() {static std::mutex m; return m;}
+  static std::string& First() {static std::string s; return s;}
+  static ErrorHandlerFunc_t& Prev() {static ErrorHandlerFunc_t f = 0; return f;}
+};
+
+struct ResilientOptions
+{
+  int maxAttempts = 3;      // Tries per file, for opening and for loading
+  double backoffSec = 2;    // Wait this long after the first failure, then double it
+  bool deepCheck = false;   // Read every entry before loading. Slow, but finds bad baskets
+  std::string treeName = "cafTree";
+  std::string metaName = "meta";
+};
+
+class ResilientLoader
+{
+public:
+  ResilientLoader(const std::string& wildcard,
+                  const ResilientOptions& opts = ResilientOptions())
+    : fFiles(ExpandGlob(wildcard)), fOpts(opts)
+  {
+  }
+
+  ResilientLoader(const std::vector<std::string>& fnames,
+                  const ResilientOptions& opts = ResilientOptions())
+    : fFiles(fnames), fOpts(opts)
+  {
+  }
+
+  // Like the Spectrum constructor. Returns an index to look it up with
+  // after Go().
+  int AddSpectrum(const HistAxis& axis, const Cut& cut,
+                  const SystShifts& shift = kNoShift, const Var& wei = kUnweighted)
+  {
+    return fDecls.Declare(axis, cut, shift, "", wei);
+  }
+
+  void Go()
+  {
+    fTotals.clear();
+    fTotals.resize(fDecls.size());
+    fStatus.clear();
+
+    for(const std::string& fname: fFiles){
+      FileLoadStatus st;
+      st.fname = fname;
+      if(CheckFile(st)) LoadFile(st);
+      fStatus.push_back(st);
+
+      if(st.status == FileLoadStatus::kQuarantined)
+        std::cerr << "ResilientLoader: skipping " << fname << ": " << st.reason << std::endl;
+    }
+
+    if(!fTotals.empty() && !fTotals[0]){
+      std::cerr << "ResilientLoader: every file failed, see the report" << std::endl;
+      abort();
+    }
+  }
+
+  // The combined Spectrum, from every file that loaded
+  const Spectrum& operator[](int idx) const {return *fTotals[idx];}
+
+  const std::vector<FileLoadStatus>& Status() const {return fStatus;}
+
+  // POT from the files that were used, and from the ones that weren't
+  double POTUsed() const {return SumPOT(FileLoadStatus::kOK);}
+  double POTExcluded() const {return SumPOT(FileLoadStatus::kQuarantined);}
+
+  // A machine-readable summary of what happened to every file
+  void WriteReport(const std::string& fname) const
+  {
+    std::ofstream out(fname);
+    out << std::setprecision(17); // Every POT exactly, like SaveArrowEvents()
+    out << "{\n  \"pot_used\": " << POTUsed()
+        << ",\n  \"pot_excluded\": " << POTExcluded()
+        << ",\n  \"files\": [\n";
+    for(size_t i = 0; i < fStatus.size(); ++i){
+      const FileLoadStatus& st = fStatus[i];
+      out << "    {\"file\": \"" << JSONEscape(st.fname) << "\""
+          << ", \"status\": \"" << (st.status == FileLoadStatus::kOK ? "ok" : "quarantined") << "\""
+          << ", \"attempts\": " << st.attempts
+          << ", \"pot\": " << st.pot
+          << ", \"reason\": \"" << JSONEscape(st.reason) << "\"}"
+          << (i+1 < fStatus.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+  }
+
+protected:
+  void Backoff(int attempt) const
+  {
+    const double sec = fOpts.backoffSec * (1 << std::min(attempt, 10));
+    std::this_thread::sleep_for(std::chrono::milliseconds(int(1000*sec)));
+  }
+
+  // Open the file and check it looks sane. Fills in pot. False (and marks
+  // the file quarantined) if it should be left out.
+  bool CheckFile(FileLoadStatus& st) const
+  {
+    std::unique_ptr<TFile> f;
+    for(int attempt = 1; attempt <= fOpts.maxAttempts; ++attempt){
+      st.attempts = attempt;
+      f.reset(TFile::Open(st.fname.c_str()));
+      if(f && !f->IsZombie()) break;
+      f.reset();
+      if(attempt < fOpts.maxAttempts) Backoff(attempt-1);
+    }
+    if(!f) return Quarantine(st, "can't open");
+
+    if(f->TestBit(TFile::kRecovered)) return Quarantine(st, "file was truncated (ROOT had to recover it)");
+
+    TTree* tree = 0;
+    TTree* meta = 0;
+    f->GetObject(fOpts.treeName.c_str(), tree);
+    f->GetObject(fOpts.metaName.c_str(), meta);
+    if(!tree) return Quarantine(st, "no " + fOpts.treeName + " tree");
+    if(!meta) return Quarantine(st, "no " + fOpts.metaName + " tree");
+
+    // From here on the file is open, so any ROOT error is a read error
+    ROOTErrorTrap trap;
+
+    double pot = 0;
+    if(meta->SetBranchAddress("pot", &pot) != 0) return Quarantine(st, "no pot in meta tree");
+    st.pot = 0;
+    for(Long64_t i = 0; i < meta->GetEntries(); ++i){
+      if(meta->GetEntry(i) <= 0) return Quarantine(st, "can't read meta tree");
+      st.pot += pot;
+    }
+
+    if(fOpts.deepCheck){
+      for(Long64_t i = 0; i < tree->GetEntries(); ++i){
+        if(tree->GetEntry(i) < 0)
+          return Quarantine(st, "can't read entry " + std::to_string(i) + " of " + fOpts.treeName);
+      }
+    }
+    if(!trap.Error().empty()) return Quarantine(st, "read error: " + trap.Error());
+    return true;
+  }
+
+  // Fill this file's spectra on their own, and only add them to the totals
+  // if the whole file went through
+  void LoadFile(FileLoadStatus& st)
+  {
+    std::string err;
+    for(int attempt = 1; attempt <= fOpts.maxAttempts; ++attempt){
+      try{
+        ROOTErrorTrap trap;
+        SpectrumLoader loader(st.fname);
+        std::vector<std::unique_ptr<Spectrum>> spects = fDecls.MakeSpectra(loader);
+        loader.Go();
+        if(!trap.Error().empty()) throw std::runtime_error("read error: " + trap.Error());
+
+        for(size_t i = 0; i < spects.size(); ++i){
+          if(fTotals[i]) *fTotals[i] += *spects[i];
+          else fTotals[i] = std::move(spects[i]);
+        }
+        st.attempts = std::max(st.attempts, attempt);
+        return;
+      }
+      catch(std::exception& e){err = e.what();}
+      catch(...){err = "unknown error";}
+
+      if(attempt < fOpts.maxAttempts) Backoff(attempt-1);
+    }
+    st.attempts = fOpts.maxAttempts;
+    Quarantine(st, "loading failed: " + err);
+  }
+
+  static bool Quarantine(FileLoadStatus& st, const std::string& reason)
+  {
+    st.status = FileLoadStatus::kQuarantined;
+    st.reason = reason;
+    return false;
+  }
+
+  double SumPOT(FileLoadStatus::EStatus status) const
+  {
+    double ret = 0;
+    for(const FileLoadStatus& st: fStatus) if(st.status == status) ret += st.pot;
+    return ret;
+  }
+
+  static std::string JSONEscape(const std::string& s)
+  {
+    std::string ret;
+    for(char c: s){
+      if(c == '"' || c == '\\') ret += '\\';
+      if(c == '\n'){ret += "\\n"; continue;}
+      ret += c;
+    }
+    return ret;
+  }
+
+  std::vector<std::string> fFiles;
+  ResilientOptions fOpts;
+  SpectrumDecls fDecls;
+  std::vector<std::unique_ptr<Spectrum>> fTotals;
+  std::vector<FileLoadStatus> fStatus;
+};
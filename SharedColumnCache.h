@@ -0,0 +1,682 @@
+// Share decoded event columns between jobs on the same machine.
+//
+// When lots of people on one analysis node run variations of these macros
+// over the same CAF files, every job decompresses and decodes the same
+// branches. A SharedColumnCache puts the decoded columns of each file in
+// POSIX shared memory (they show up under /dev/shm/dunesyst_*). The first
+// job to need a file decodes it and publishes the columns; any job that
+// comes along later just maps them read-only, which costs almost nothing.
+// The events are read where they are in shared memory, through
+// ColumnViews, so the node holds one copy of each column however many jobs
+// use it.
+//
+// Each segment holds one column of one file, for one selection:
+// (user, file, cut tag, column). The cut tag is how the cache tells
+// selections apart, so give every different Cut its own tag. The file's
+// size and modification time are part of the key too, so a rewritten file
+// is never matched against stale columns.
+//
+// By default only your own jobs see your segments. Pass
+// ShmSharing::kAllUsers to share them with everyone on the machine who
+// does the same; then everyone using a tag has to mean the same cut by it.
+// A mistake there, or your own reuse of a tag for a new cut, is caught:
+// each segment records which events the cut kept, and Load() decodes one
+// file itself (the smallest that came from shared memory) and aborts if
+// its cut kept different ones. SetVerifyCut(false) skips that.
+//
+// A segment is written under a temporary name and only linked to its real
+// name once it is complete, so a job never sees half a column. While a job
+// decodes a file it holds a claim on it (a small segment with its process
+// ID), and other jobs wanting the same file wait for it rather than
+// decoding it too. If the claiming job has died, the claim is stale and
+// the next job takes over straight away.
+//
+// Segments stay around after everyone has finished, so the next job still
+// finds them, but /dev/shm is memory, so they can't stay forever. Each job
+// holds a shared lock on every segment it has mapped. At the end of each
+// Load(), if your segments take up more than the budget (a quarter of
+// /dev/shm unless you SetBudget()), the ones nobody has mapped are removed,
+// least recently used first. Purge() removes all of yours at once. Both
+// are safe while jobs are using the segments: a removed segment lives on
+// for as long as someone has it mapped.
+//
+//   SharedColumnCache cache(kCC0PiSelection, "CC0PiSelection");
+//   const SharedEvents events = cache.Load(CAFS);
+//   TH1D* h = events.ToTH1("Reconstructed QE energy (GeV)", binsEnergy, "Eqe", 1e20);
+
+#pragma once
+
+#include "EventTable.h"
+#include "CountingHistogram.h"
+#include "LoaderTools.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+const char kShmPrefix[] = "dunesyst_";
+
+// What sits at the start of every segment. The column data follows it.
+struct ShmColumnHeader
+{
+  char magic[8];                // "DSYSCOL3"
+  uint64_t nElems;
+  uint32_t elemSize;
+  double pot;                   // Exposure of the file, after its cut
+  uint64_t selection;           // SelectionPrint() of the events the cut kept
+  char key[512];                // The full key, to catch hash collisions
+};
+
+// A 64-bit FNV-1a hash. Unlike std::hash it is the same in every program.
+uint64_t StableHash(const std::string& s)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(unsigned char c: s){
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Which events a cut kept from a file: a hash of the identity of each one,
+// in order. Another cut gives a different print unless it keeps exactly
+// the same events.
+uint64_t SelectionPrint(const EventTable& t)
+{
+  uint64_t h = MixBits(t.Size());
+  for(size_t i = 0; i < t.Size(); ++i){
+    uint64_t ev;
+    memcpy(&ev, &t.Ev[i], sizeof(ev));
+    h = MixBits(h ^ MixBits((uint64_t(uint32_t(t.run[i])) << 32) | uint32_t(t.subrun[i])));
+    h = MixBits(h ^ MixBits((uint64_t(uint32_t(t.event[i])) << 32) ^ ev));
+  }
+  return h;
+}
+
+// Who can see the segments a SharedColumnCache publishes
+enum class ShmSharing
+{
+  kUser,    // Only jobs run by the same user
+  kAllUsers // Everyone on the machine who also asks for kAllUsers
+};
+
+// A column read in place, wherever it lives
+template<class T> struct ColumnView
+{
+  const T* data = 0;
+  size_t size = 0;
+
+  size_t Size() const {return size;}
+  const T& operator[](size_t i) const {return data[i];}
+  const T* begin() const {return data;}
+  const T* end() const {return data + size;}
+};
+
+// One mapped column of one file. It holds a shared lock on the segment
+// for as long as it is mapped, so Reclaim() leaves it alone.
+class SharedColumn
+{
+public:
+  SharedColumn() {}
+  SharedColumn(const SharedColumn&) = delete;
+  SharedColumn(SharedColumn&& c) noexcept : fHeader(c.fHeader), fBytes(c.fBytes), fFD(c.fFD)
+  {
+    c.fHeader = 0;
+    c.fFD = -1;
+  }
+  SharedColumn& operator=(SharedColumn&& c) noexcept
+  {
+    std::swap(fHeader, c.fHeader);
+    std::swap(fBytes, c.fBytes);
+    std::swap(fFD, c.fFD);
+    return *this;
+  }
+  ~SharedColumn()
+  {
+    if(fHeader) munmap((void*)fHeader, fBytes);
+    if(fFD >= 0) close(fFD); // Drops the lock
+  }
+
+  bool Valid() const {return fHeader;}
+  uint64_t Size() const {return fHeader->nElems;}
+  uint32_t ElemSize() const {return fHeader->elemSize;}
+  double POT() const {return fHeader->pot;}
+  uint64_t Selection() const {return fHeader->selection;}
+  template<class T> const T* Data() const
+  {
+    return (const T*)((const char*)fHeader + sizeof(ShmColumnHeader));
+  }
+
+  // Map a published segment, read-only. Not Valid() if there isn't one.
+  static SharedColumn Attach(const std::string& key)
+  {
+    SharedColumn ret;
+    const int fd = shm_open(SegmentName(key).c_str(), O_RDONLY, 0);
+    if(fd < 0) return ret;
+
+    // Only waits if Reclaim() is removing it this moment. Then we get the
+    // removed copy, which is still complete.
+    struct stat st;
+    if(flock(fd, LOCK_SH) != 0 ||
+       fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(ShmColumnHeader)){
+      close(fd);
+      return ret;
+    }
+    void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED){
+      close(fd);
+      return ret;
+    }
+
+    const ShmColumnHeader* h = (const ShmColumnHeader*)p;
+    if(memcmp(h->magic, "DSYSCOL3", 8) != 0 ||
+       strncmp(h->key, key.c_str(), sizeof(h->key)) != 0 ||
+       size_t(st.st_size) < sizeof(ShmColumnHeader) + h->nElems*h->elemSize){
+      munmap(p, st.st_size);
+      close(fd);
+      return ret;
+    }
+
+    // Mark it as just used, for Reclaim(). Only works on our own segments,
+    // which are the only ones we could remove anyway.
+    futimens(fd, 0);
+
+    ret.fHeader = h;
+    ret.fBytes = st.st_size;
+    ret.fFD = fd;
+    return ret;
+  }
+
+  // Publish a column. Returns true if the column is now there, whether we
+  // or another job published it, and false if shared memory isn't usable.
+  static bool Publish(const std::string& key, const void* data,
+                      uint64_t nElems, uint32_t elemSize, double pot,
+                      uint64_t selection, mode_t mode)
+  {
+    if(key.size() >= sizeof(ShmColumnHeader::key)) return false;
+
+    // Write it all under a name nobody else is looking for...
+    const std::string name = SegmentName(key);
+    const std::string tmp = name + ".tmp" + std::to_string(getpid());
+    const int fd = CreateSegment(tmp, mode);
+    if(fd < 0) return false;
+
+    const size_t bytes = sizeof(ShmColumnHeader) + nElems*elemSize;
+    void* p = MAP_FAILED;
+    if(ftruncate(fd, bytes) == 0) p = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED){
+      shm_unlink(tmp.c_str());
+      return false;
+    }
+
+    ShmColumnHeader* h = new (p) ShmColumnHeader;
+    memcpy(h->magic, "DSYSCOL3", 8);
+    h->nElems = nElems;
+    h->elemSize = elemSize;
+    h->pot = pot;
+    h->selection = selection;
+    strncpy(h->key, key.c_str(), sizeof(h->key));
+    if(nElems > 0) memcpy((char*)p + sizeof(ShmColumnHeader), data, nElems*elemSize);
+    munmap(p, bytes);
+
+    // ...then give it its real name in one step. link() won't replace a
+    // column another job published in the meantime.
+    const int ok = link(("/dev/shm" + tmp).c_str(), ("/dev/shm" + name).c_str());
+    const bool exists = ok == 0 || errno == EEXIST;
+    shm_unlink(tmp.c_str());
+    return exists;
+  }
+
+  // A new segment with exactly these permissions, whatever the umask
+  static int CreateSegment(const std::string& name, mode_t mode)
+  {
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+    if(fd >= 0) fchmod(fd, mode);
+    return fd;
+  }
+
+  static std::string SegmentName(const std::string& key)
+  {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "/%s%016llx", kShmPrefix, (unsigned long long)StableHash(key));
+    return buf;
+  }
+
+protected:
+  const ShmColumnHeader* fHeader = 0;
+  size_t fBytes = 0;
+  int fFD = -1;
+};
+
+// The events of one file, either mapped from shared memory or, if they
+// couldn't be shared, decoded into a table of our own
+class SharedEventFile
+{
+public:
+  SharedEventFile() {}
+
+  explicit SharedEventFile(std::map<std::string, SharedColumn>&& cols)
+    : fColumns(std::move(cols))
+  {
+    fSize = fColumns.begin()->second.Size();
+    fPOT = fColumns.begin()->second.POT();
+    fSelection = fColumns.begin()->second.Selection();
+  }
+
+  explicit SharedEventFile(EventTable&& t)
+    : fLocal(new EventTable(std::move(t)))
+  {
+    fSize = fLocal->Size();
+    fPOT = fLocal->pot;
+    fSelection = SelectionPrint(*fLocal);
+  }
+
+  size_t Size() const {return fSize;}
+  double POT() const {return fPOT;}
+  bool Shared() const {return !fLocal;}
+  uint64_t Selection() const {return fSelection;}
+
+  // One of the EventTable columns by name, eg Column<double>("Eqe")
+  template<class T> ColumnView<T> Column(const std::string& name) const
+  {
+    static_assert(std::is_same<T, int>::value || std::is_same<T, double>::value,
+                  "EventTable columns are int or double");
+    ColumnView<T> ret;
+    if(fLocal){
+      const std::vector<T>* v = 0;
+      if constexpr(std::is_same<T, int>::value){
+        for(const IntColumn& c: kIntColumns) if(name == c.name) v = &(*fLocal.*c.col);
+      }
+      else{
+        for(const DoubleColumn& c: kDoubleColumns) if(name == c.name) v = &(*fLocal.*c.col);
+      }
+      if(v){ret.data = v->data(); ret.size = v->size();}
+    }
+    else{
+      auto it = fColumns.find(name);
+      if(it != fColumns.end() && it->second.ElemSize() == sizeof(T)){
+        ret.data = it->second.Data<T>();
+        ret.size = it->second.Size();
+      }
+    }
+    if(!ret.data && fSize > 0){
+      std::cerr << "SharedEventFile: no " << (std::is_same<T, int>::value ? "int" : "double")
+                << " column called " << name << std::endl;
+      abort();
+    }
+    return ret;
+  }
+
+protected:
+  std::map<std::string, SharedColumn> fColumns;
+  std::unique_ptr<EventTable> fLocal;
+  size_t fSize = 0;
+  double fPOT = 0;
+  uint64_t fSelection = 0;
+};
+
+// Everything SharedColumnCache::Load() found, file by file
+class SharedEvents
+{
+public:
+  size_t NFiles() const {return fFiles.size();}
+  const SharedEventFile& File(size_t i) const {return fFiles[i];}
+
+  size_t Size() const
+  {
+    size_t n = 0;
+    for(const SharedEventFile& f: fFiles) n += f.Size();
+    return n;
+  }
+
+  double POT() const
+  {
+    double pot = 0;
+    for(const SharedEventFile& f: fFiles) pot += f.POT();
+    return pot;
+  }
+
+  // Histogram a double column, weighted by the weight column and scaled to
+  // pot, like TableToTH1()
+  TH1D* ToTH1(const std::string& label, const Binning& bins,
+              const std::string& column, double pot) const
+  {
+    CountingHistogram counts(bins);
+    for(const SharedEventFile& f: fFiles){
+      const ColumnView<double> x = f.Column<double>(column);
+      const ColumnView<double> w = f.Column<double>("weight");
+      for(size_t i = 0; i < f.Size(); ++i) counts.Fill(x[i], w[i]);
+    }
+    TH1D* h = MakeEmptyTH1(label, bins);
+    counts.FillTH1(h);
+    if(POT() > 0) h->Scale(pot/POT());
+    return h;
+  }
+
+  // A private copy of everything, for code that needs an EventTable. This
+  // costs the memory the cache saves, so only use it on small selections.
+  EventTable ToEventTable() const
+  {
+    EventTable ret;
+    ret.pot = POT();
+    for(const SharedEventFile& f: fFiles){
+      for(const IntColumn& c: kIntColumns){
+        const ColumnView<int> v = f.Column<int>(c.name);
+        (ret.*c.col).insert((ret.*c.col).end(), v.begin(), v.end());
+      }
+      for(const DoubleColumn& c: kDoubleColumns){
+        const ColumnView<double> v = f.Column<double>(c.name);
+        (ret.*c.col).insert((ret.*c.col).end(), v.begin(), v.end());
+      }
+    }
+    return ret;
+  }
+
+protected:
+  friend class SharedColumnCache;
+  std::vector<SharedEventFile> fFiles;
+};
+
+class SharedColumnCache
+{
+public:
+  // cutTag must be different for every different cut you use, and with
+  // kAllUsers, mean the same cut to everyone who uses it
+  SharedColumnCache(const Cut& cut, const std::string& cutTag,
+                    ShmSharing sharing = ShmSharing::kUser)
+    : fCut(cut), fCutTag(cutTag), fSharing(sharing)
+  {
+  }
+
+  // Whether Load() checks the cut against one file from shared memory
+  void SetVerifyCut(bool verify) {fVerifyCut = verify;}
+
+  // All the events in the files matching wildcard that pass the cut. Each
+  // file comes from shared memory if it is there, and otherwise is read
+  // and then published for the next job.
+  SharedEvents Load(const std::string& wildcard)
+  {
+    SharedEvents ret;
+    std::string smallest; // Of the files only found in shared memory
+    size_t smallestIdx = 0;
+    off_t smallestSize = 0;
+    for(const std::string& fname: ExpandGlob(wildcard)){
+      bool decoded;
+      ret.fFiles.push_back(LoadFile(fname, decoded));
+      struct stat st;
+      if(!decoded && stat(fname.c_str(), &st) == 0 && (smallest.empty() || st.st_size < smallestSize)){
+        smallest = fname;
+        smallestIdx = ret.fFiles.size()-1;
+        smallestSize = st.st_size;
+      }
+    }
+    std::cout << "SharedColumnCache: " << fNShared << " files from shared memory, "
+              << fNDecoded << " decoded here" << std::endl;
+
+    if(fVerifyCut && !smallest.empty())
+      CheckSelection(smallest, ret.fFiles[smallestIdx], Decode(smallest));
+
+    // Everything we use is mapped now, so this only removes other segments
+    Reclaim(fBudget);
+    return ret;
+  }
+
+  // Map one column of one file without copying it. Check Valid() - it
+  // isn't if nobody has published that file yet.
+  SharedColumn AttachColumn(const std::string& fname, const std::string& column) const
+  {
+    return SharedColumn::Attach(Key(fname, column));
+  }
+
+  // How much of /dev/shm your segments may use before Reclaim() starts
+  // removing them
+  void SetBudget(size_t bytes) {fBudget = bytes;}
+
+  // A quarter of /dev/shm
+  static size_t DefaultBudget()
+  {
+    struct statvfs vfs;
+    if(statvfs("/dev/shm", &vfs) != 0) return 0;
+    return size_t(vfs.f_blocks)*vfs.f_frsize/4;
+  }
+
+  // Remove your segments that no job has mapped, least recently used
+  // first, until the rest fit in budget. Load() calls it when it is done.
+  static void Reclaim(size_t budget)
+  {
+    struct Segment {std::string name; time_t used; size_t bytes;};
+    std::vector<Segment> segs;
+    size_t total = 0;
+    for(const std::string& name: OwnSegments()){
+      struct stat st;
+      // Claims and columns still being written have a "." in their name
+      if(name.find('.') != std::string::npos ||
+         stat(("/dev/shm/"+name).c_str(), &st) != 0) continue;
+      segs.push_back({name, st.st_mtime, size_t(st.st_size)});
+      total += st.st_size;
+    }
+    if(total <= budget) return;
+
+    std::sort(segs.begin(), segs.end(), [](const Segment& a, const Segment& b){return a.used < b.used;});
+    for(const Segment& seg: segs){
+      if(total <= budget) break;
+      const int fd = shm_open(("/"+seg.name).c_str(), O_RDONLY, 0);
+      if(fd < 0) continue;
+      // Every job with it mapped holds a shared lock
+      if(flock(fd, LOCK_EX | LOCK_NB) == 0 && shm_unlink(("/"+seg.name).c_str()) == 0) total -= seg.bytes;
+      close(fd);
+    }
+  }
+
+  // Remove every segment of yours (/dev/shm only lets the owner remove a
+  // file), mapped or not. Jobs that have a segment mapped keep using it
+  // until they are done, but new jobs will decode the files again.
+  static void Purge()
+  {
+    for(const std::string& name: OwnSegments()) shm_unlink(("/"+name).c_str());
+  }
+
+protected:
+  // The names in /dev/shm of the segments you own
+  static std::vector<std::string> OwnSegments()
+  {
+    std::vector<std::string> ret;
+    DIR* dir = opendir("/dev/shm");
+    if(!dir) return ret;
+    while(dirent* ent = readdir(dir)){
+      const std::string name = ent->d_name;
+      struct stat st;
+      if(name.compare(0, strlen(kShmPrefix), kShmPrefix) == 0 &&
+         stat(("/dev/shm/"+name).c_str(), &st) == 0 && st.st_uid == getuid())
+        ret.push_back(name);
+    }
+    closedir(dir);
+    return ret;
+  }
+
+  // Keys start with who may share them, so two users' tags never meet
+  // unless both asked for kAllUsers
+  std::string FileKey(const std::string& fname) const
+  {
+    struct stat st;
+    if(stat(fname.c_str(), &st) != 0) memset(&st, 0, sizeof(st));
+    const std::string who = fSharing == ShmSharing::kAllUsers ? "all" : "uid" + std::to_string(getuid());
+    return who + "|" + fname + "|" + std::to_string(st.st_size) + "|" + std::to_string(st.st_mtime) + "|" + fCutTag;
+  }
+
+  mode_t SegmentMode() const
+  {
+    return fSharing == ShmSharing::kAllUsers ? 0644 : 0600;
+  }
+
+  // Abort if the events our cut keeps from fname aren't the ones in f
+  void CheckSelection(const std::string& fname, const SharedEventFile& f, const EventTable& ours) const
+  {
+    if(f.Selection() == SelectionPrint(ours)) return;
+    std::cerr << "SharedColumnCache: the events in shared memory under tag \"" << fCutTag
+              << "\" for " << fname << " were selected by a different cut ("
+              << f.Size() << " events, this cut keeps " << ours.Size()
+              << "). Give each cut its own tag." << std::endl;
+    abort();
+  }
+
+  std::string Key(const std::string& fname, const std::string& column) const
+  {
+    return FileKey(fname) + "|" + column;
+  }
+
+  // decoded says whether we read the file ourselves
+  SharedEventFile LoadFile(const std::string& fname, bool& decoded)
+  {
+    SharedEventFile ret;
+    decoded = false;
+    while(true){
+      if(FromCache(fname, ret)){
+        ++fNShared;
+        return ret;
+      }
+
+      const EClaim claim = TryClaim(fname);
+      if(claim == kBusy){
+        // Another job is decoding this file right now
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        continue;
+      }
+
+      // It may have been published between looking and claiming
+      if(FromCache(fname, ret)){
+        if(claim == kClaimed) ReleaseClaim(fname);
+        ++fNShared;
+        return ret;
+      }
+
+      EventTable t = Decode(fname);
+      const bool published = ToCache(fname, t);
+      if(claim == kClaimed) ReleaseClaim(fname);
+      ++fNDecoded;
+      decoded = true;
+      // Read the shared copy, so ours can be freed. Another job may have
+      // published it first, so check it is what we decoded.
+      if(published && FromCache(fname, ret)){
+        CheckSelection(fname, ret, t);
+        return ret;
+      }
+      return SharedEventFile(std::move(t));
+    }
+  }
+
+  bool FromCache(const std::string& fname, SharedEventFile& f) const
+  {
+    // Look for every column, so a half-published file gets decoded
+    std::map<std::string, SharedColumn> cols;
+    for(const IntColumn& c: kIntColumns) cols[c.name] = AttachColumn(fname, c.name);
+    for(const DoubleColumn& c: kDoubleColumns) cols[c.name] = AttachColumn(fname, c.name);
+    for(const auto& it: cols){
+      if(!it.second.Valid() || it.second.Size() != cols.begin()->second.Size()) return false;
+    }
+    f = SharedEventFile(std::move(cols));
+    return true;
+  }
+
+  bool ToCache(const std::string& fname, const EventTable& t) const
+  {
+    const uint64_t sel = SelectionPrint(t);
+    bool ok = true;
+    for(const IntColumn& c: kIntColumns){
+      const std::vector<int>& v = t.*c.col;
+      ok = SharedColumn::Publish(Key(fname, c.name), v.data(), v.size(), sizeof(int), t.pot, sel, SegmentMode()) && ok;
+    }
+    for(const DoubleColumn& c: kDoubleColumns){
+      const std::vector<double>& v = t.*c.col;
+      ok = SharedColumn::Publish(Key(fname, c.name), v.data(), v.size(), sizeof(double), t.pot, sel, SegmentMode()) && ok;
+    }
+    return ok;
+  }
+
+  // kClaimed: we hold the claim. kBusy: a live job does. kUnclaimable: the
+  // claim is stale but belongs to another user, so we can't remove it;
+  // decode without one.
+  enum EClaim {kClaimed, kBusy, kUnclaimable};
+
+  std::string ClaimName(const std::string& fname) const
+  {
+    return SharedColumn::SegmentName(FileKey(fname)) + ".claim";
+  }
+
+  EClaim TryClaim(const std::string& fname) const
+  {
+    const std::string name = ClaimName(fname);
+    for(int attempt = 0; attempt < 2; ++attempt){
+      const int fd = SharedColumn::CreateSegment(name, SegmentMode());
+      if(fd >= 0){
+        const std::string pid = std::to_string(getpid());
+        const bool ok = write(fd, pid.c_str(), pid.size()) == ssize_t(pid.size());
+        close(fd);
+        if(ok) return kClaimed;
+        shm_unlink(name.c_str());
+        return kUnclaimable;
+      }
+      if(errno != EEXIST) return kUnclaimable; // No shared memory to speak of
+
+      if(ClaimHolderAlive(name)) return kBusy;
+      // The job that claimed it died before finishing
+      if(shm_unlink(name.c_str()) != 0 && errno != ENOENT) return kUnclaimable;
+    }
+    return kBusy;
+  }
+
+  // Whether the process named in a claim is still running. A claim with
+  // no process ID yet is only alive while it is new.
+  static bool ClaimHolderAlive(const std::string& name)
+  {
+    const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if(fd < 0) return false;
+    char buf[32] = {0};
+    const ssize_t n = read(fd, buf, sizeof(buf)-1);
+    struct stat st;
+    const bool fresh = fstat(fd, &st) == 0 && time(0) - st.st_mtime < 10;
+    close(fd);
+    const pid_t pid = n > 0 ? atoi(buf) : 0;
+    if(pid <= 0) return fresh;
+    return kill(pid, 0) == 0 || errno == EPERM;
+  }
+
+  void ReleaseClaim(const std::string& fname) const
+  {
+    shm_unlink(ClaimName(fname).c_str());
+  }
+
+  EventTable Decode(const std::string& fname) const
+  {
+    SpectrumLoader loader(fname);
+    EventRecorder rec(loader, fCut);
+    loader.Go();
+    return rec.Table();
+  }
+
+  Cut fCut;
+  std::string fCutTag;
+  ShmSharing fSharing;
+  bool fVerifyCut = true;
+  size_t fBudget = DefaultBudget();
+  int fNShared = 0, fNDecoded = 0;
+};
@@ -0,0 +1,356 @@
+// Fill spectra live from events sent down a pipe or socket.
+//
+// Normally you wait for a simulation or reconstruction job to finish and
+// write its CAF files before you can look at anything. Instead, the job (the
+// "producer") can send its events as it makes them, and a StreamConsumer
+// fills histograms as they arrive. You can take a Snapshot() of any of them
+// at any time.
+//
+// Events travel in batches. Each batch is a 4-byte length followed by that
+// many bytes: the POT the batch corresponds to, the number of events, and
+// then the events themselves (see WriteEventBatch() for the layout). Writes
+// block while the pipe or socket is full, so a slow consumer just slows
+// the producer down; it never piles up batches in memory. A stream that
+// stops in the middle of a batch, or sends a malformed one, is an error
+// (see StreamConsumer::Failed()), not the end of the stream.
+//
+// StreamEventTable() is a stand-in producer: it sends the contents of an
+// EventTable, for testing without a real job.
+
+#pragma once
+
+#include "EventTable.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Refuse batches bigger than this, in case we are sent garbage
+const uint32_t kMaxStreamBatchBytes = 256u << 20;
+
+// The fields each event carries, in the order they are sent
+const size_t kStreamIntFields = 9;    // run subrun event mode LepPDG nP nipip nipim nipi0
+const size_t kStreamDoubleFields = 4; // Ev Elep_reco theta_reco weight
+const size_t kStreamEventBytes = kStreamIntFields*sizeof(int32_t) + kStreamDoubleFields*sizeof(double);
+
+// The most events that fit in one batch
+const size_t kMaxStreamBatchEvents = (kMaxStreamBatchBytes - sizeof(double) - sizeof(uint32_t))/kStreamEventBytes;
+
+// What ReadEventBatch() found
+enum class BatchStatus
+{
+  kOK,    // A batch
+  kEnd,   // The stream ended cleanly, between batches
+  kError  // A read error, a stream cut off mid-batch, or a malformed batch
+};
+
+// Write all n bytes, however many calls it takes. False if the other end
+// went away. NB unless the producer ignores SIGPIPE, writing to a pipe whose
+// reader has gone kills the producer instead.
+bool WriteFully(int fd, const void* buf, size_t n)
+{
+  const char* p = (const char*)buf;
+  while(n > 0){
+    const ssize_t w = write(fd, p, n);
+    if(w < 0 && errno == EINTR) continue;
+    if(w <= 0) return false;
+    p += w;
+    n -= w;
+  }
+  return true;
+}
+
+// Read exactly n bytes. False at end of stream or on error; then, if got
+// is given, it says how many bytes were read before that (0 for a stream
+// that ended cleanly), or -1 for an error.
+bool ReadFully(int fd, void* buf, size_t n, ssize_t* got = 0)
+{
+  char* p = (char*)buf;
+  ssize_t total = 0;
+  while(n > 0){
+    const ssize_t r = read(fd, p, n);
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0){
+      if(got) *got = r < 0 ? -1 : total;
+      return false;
+    }
+    p += r;
+    n -= r;
+    total += r;
+  }
+  return true;
+}
+
+// Send rows [begin, end) of a table as one batch, corresponding to pot. At
+// most kMaxStreamBatchEvents rows fit.
+bool WriteEventBatch(int fd, const EventTable& t, size_t begin, size_t end, double pot)
+{
+  if(end - begin > kMaxStreamBatchEvents){
+    std::cerr << "WriteEventBatch: " << end - begin << " events is more than the "
+              << kMaxStreamBatchEvents << " that fit in a batch" << std::endl;
+    return false;
+  }
+  const uint32_t nEvents = end - begin;
+  const uint32_t len = sizeof(double) + sizeof(uint32_t) + nEvents*kStreamEventBytes;
+
+  std::vector<char> buf(sizeof(uint32_t) + len);
+  char* p = buf.data();
+  auto put = [&p](const void* x, size_t n){memcpy(p, x, n); p += n;};
+
+  put(&len, sizeof(len));
+  put(&pot, sizeof(pot));
+  put(&nEvents, sizeof(nEvents));
+  for(size_t i = begin; i < end; ++i){
+    const int32_t ints[kStreamIntFields] = {t.run[i], t.subrun[i], t.event[i], t.mode[i], t.LepPDG[i],
+                                            t.nP[i], t.nipip[i], t.nipim[i], t.nipi0[i]};
+    const double doubles[kStreamDoubleFields] = {t.Ev[i], t.Elep_reco[i], t.theta_reco[i], t.weight[i]};
+    put(ints, sizeof(ints));
+    put(doubles, sizeof(doubles));
+  }
+
+  return WriteFully(fd, buf.data(), buf.size());
+}
+
+// Read one batch into t (which is cleared first)
+BatchStatus ReadEventBatch(int fd, EventTable& t)
+{
+  t.Clear();
+  t.pot = 0;
+
+  uint32_t len;
+  ssize_t got;
+  if(!ReadFully(fd, &len, sizeof(len), &got)){
+    if(got == 0) return BatchStatus::kEnd;
+    if(got < 0) std::cerr << "ReadEventBatch: " << strerror(errno) << std::endl;
+    else std::cerr << "ReadEventBatch: stream ended in the middle of a batch length" << std::endl;
+    return BatchStatus::kError;
+  }
+  if(len < sizeof(double) + sizeof(uint32_t) || len > kMaxStreamBatchBytes){
+    std::cerr << "ReadEventBatch: bad batch length " << len << std::endl;
+    return BatchStatus::kError;
+  }
+
+  std::vector<char> buf(len);
+  if(!ReadFully(fd, buf.data(), len, &got)){
+    if(got < 0) std::cerr << "ReadEventBatch: " << strerror(errno) << std::endl;
+    else std::cerr << "ReadEventBatch: stream ended " << got << " bytes into a batch of " << len << std::endl;
+    return BatchStatus::kError;
+  }
+  const char* p = buf.data();
+  auto get = [&p](void* x, size_t n){memcpy(x, p, n); p += n;};
+
+  uint32_t nEvents;
+  get(&t.pot, sizeof(double));
+  get(&nEvents, sizeof(nEvents));
+  if(len != sizeof(double) + sizeof(uint32_t) + nEvents*kStreamEventBytes){
+    std::cerr << "ReadEventBatch: batch of " << len << " bytes can't hold "
+              << nEvents << " events" << std::endl;
+    return BatchStatus::kError;
+  }
+
+  t.Reserve(nEvents);
+  for(uint32_t i = 0; i < nEvents; ++i){
+    int32_t ints[kStreamIntFields];
+    double doubles[kStreamDoubleFields];
+    get(ints, sizeof(ints));
+    get(doubles, sizeof(doubles));
+    t.run.push_back(ints[0]); t.subrun.push_back(ints[1]); t.event.push_back(ints[2]);
+    t.mode.push_back(ints[3]); t.LepPDG.push_back(ints[4]); t.nP.push_back(ints[5]);
+    t.nipip.push_back(ints[6]); t.nipim.push_back(ints[7]); t.nipi0.push_back(ints[8]);
+    t.Ev.push_back(doubles[0]); t.Elep_reco.push_back(doubles[1]); t.theta_reco.push_back(doubles[2]);
+    t.Eqe.push_back(RecoQEEnergy(doubles[1], doubles[2]));
+    t.weight.push_back(doubles[3]);
+  }
+  return BatchStatus::kOK;
+}
+
+// The stand-in producer: send a whole table in batches, sharing its POT out
+// in proportion to the number of events in each batch. Batches bigger than
+// kMaxStreamBatchEvents are split.
+bool StreamEventTable(int fd, const EventTable& t, size_t batchSize = 1000)
+{
+  batchSize = std::max<size_t>(1, std::min(batchSize, kMaxStreamBatchEvents));
+  const size_t n = t.Size();
+  for(size_t begin = 0; begin < n; begin += batchSize){
+    const size_t end = std::min(begin + batchSize, n);
+    if(!WriteEventBatch(fd, t, begin, end, t.pot*(end-begin)/n)) return false;
+  }
+  return true;
+}
+
+// A histogram that StreamConsumer keeps up to date
+struct LiveSpectrum
+{
+  std::string label;
+  Binning bins;
+  TableVar var;
+  TableCut cut;
+  TH1D* hist; // Unscaled, protected by the consumer's mutex
+};
+
+class StreamConsumer
+{
+public:
+  StreamConsumer() {}
+  ~StreamConsumer() {Wait();}
+
+  // Register a histogram. Returns its index, for Snapshot(). Do this before Start().
+  int AddSpectrum(const std::string& label, const Binning& bins,
+                  const TableVar& var, const TableCut& cut = kTableNoCut)
+  {
+    TH1D* h = MakeEmptyTH1(label, bins);
+    h->SetDirectory(0);
+    fSpectra.push_back({label, bins, var, cut, h});
+    return fSpectra.size()-1;
+  }
+
+  // Read batches from fd on a background thread until the stream ends
+  void Start(int fd)
+  {
+    fThread = std::thread([this, fd]{Run(fd);});
+  }
+
+  // Read batches from fd on this thread until the stream ends, or is
+  // broken (see Failed())
+  void Run(int fd)
+  {
+    EventTable batch;
+    BatchStatus status;
+    while((status = ReadEventBatch(fd, batch)) == BatchStatus::kOK){
+      // Work out the bins outside the lock, so snapshots don't wait on us
+      std::vector<std::vector<std::pair<double, double>>> fills(fSpectra.size());
+      for(size_t s = 0; s < fSpectra.size(); ++s)
+        for(size_t i = 0; i < batch.Size(); ++i)
+          if(fSpectra[s].cut(batch, i)) fills[s].emplace_back(fSpectra[s].var(batch, i), batch.weight[i]);
+
+      std::lock_guard<std::mutex> lock(fMutex);
+      for(size_t s = 0; s < fSpectra.size(); ++s)
+        for(const auto& f: fills[s]) fSpectra[s].hist->Fill(f.first, f.second);
+      fPOT += batch.pot;
+      fNEvents += batch.Size();
+    }
+    fFailed = status == BatchStatus::kError;
+    fFinished = true;
+  }
+
+  // Wait for the stream to end
+  void Wait()
+  {
+    if(fThread.joinable()) fThread.join();
+  }
+
+  bool Finished() const {return fFinished;}
+
+  // Whether the stream ended with an error rather than cleanly. The
+  // histograms then hold only what arrived before it.
+  bool Failed() const {return fFailed;}
+
+  double POT() const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fPOT;
+  }
+
+  size_t NEvents() const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fNEvents;
+  }
+
+  // A copy of histogram idx as it is right now, scaled to pot. You own it.
+  TH1D* Snapshot(int idx, double pot) const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    TH1D* ret = (TH1D*)fSpectra[idx].hist->Clone(UniqueName().c_str());
+    ret->SetDirectory(0);
+    if(fPOT > 0) ret->Scale(pot/fPOT);
+    return ret;
+  }
+
+protected:
+  std::vector<LiveSpectrum> fSpectra;
+  double fPOT = 0;
+  size_t fNEvents = 0;
+  std::atomic<bool> fFinished{false};
+  std::atomic<bool> fFailed{false};
+  mutable std::mutex fMutex;
+  std::thread fThread;
+};
+
+// Open a named pipe for reading, making it if it isn't there yet. This
+// waits until a producer opens the other end.
+int OpenFifoForReading(const std::string& path)
+{
+  if(mkfifo(path.c_str(), 0600) != 0 && errno != EEXIST){
+    std::cerr << "OpenFifoForReading: can't make " << path << ": " << strerror(errno) << std::endl;
+    return -1;
+  }
+  return open(path.c_str(), O_RDONLY);
+}
+
+// The producer's end of a named pipe
+int OpenFifoForWriting(const std::string& path)
+{
+  if(mkfifo(path.c_str(), 0600) != 0 && errno != EEXIST){
+    std::cerr << "OpenFifoForWriting: can't make " << path << ": " << strerror(errno) << std::endl;
+    return -1;
+  }
+  return open(path.c_str(), O_WRONLY);
+}
+
+// Listen on a Unix socket at path and wait for one producer to connect.
+// Returns the connection to read from.
+int AcceptUnixSocket(const std::string& path)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path)){
+    std::cerr << "AcceptUnixSocket: path too long: " << path << std::endl;
+    return -1;
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0) return -1;
+  unlink(path.c_str()); // Left over from last time
+  if(bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0){
+    std::cerr << "AcceptUnixSocket: can't listen on " << path << ": " << strerror(errno) << std::endl;
+    close(sock);
+    return -1;
+  }
+  const int conn = accept(sock, 0, 0);
+  close(sock);
+  return conn;
+}
+
+// The producer's end of a Unix socket
+int ConnectUnixSocket(const std::string& path)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path)){
+    std::cerr << "ConnectUnixSocket: path too long: " << path << std::endl;
+    return -1;
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0) return -1;
+  if(connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0){
+    std::cerr << "ConnectUnixSocket: can't connect to " << path << ": " << strerror(errno) << std::endl;
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
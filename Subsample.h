@@ -0,0 +1,269 @@
+// Keep a reproducible fraction of the events, for fast approximate plots.
+//
+// While you are trying things out, you don't always need every event. A
+// subsample keeps each event with some probability p and gives the ones it
+// keeps a weight of 1/p. On average that gives the same histogram as the
+// full sample, so ToTH1(pot)-style normalisation still works, just with
+// bigger statistical errors.
+//
+// Throwing away events at random would starve the rare ones: there are few
+// MEC events, and few at high energy. So events are split into "strata" by
+// interaction mode and by which region of the plotted variable they fall
+// in, and every stratum keeps at least minPerStratum events (or all of them,
+// if it has fewer than that).
+//
+// Whether an event is kept depends only on its run/subrun/event numbers and
+// the seed, so the same settings always give the same subsample.
+
+#pragma once
+
+#include "EventTable.h"
+
+#include "TSystem.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+struct SubsampleOptions
+{
+  double fraction = .05;         // Fraction of events to keep overall
+  size_t minPerStratum = 1000;   // Never keep fewer than this from one stratum
+  Binning regions = Binning::Custom({0, 1, 2, 3, 5, 10}); // Regions of the variable
+  TableVar var = kTableEqe;      // The variable the regions are in
+  std::string varName = "Eqe";   // Its name, saved to tell subsamples apart. Change it with var.
+  uint64_t seed = 12345;
+};
+
+// The options as text, saved with a subsample so a cached one made with
+// different options isn't reused
+std::string SubsampleOptionsString(const SubsampleOptions& opts)
+{
+  char buf[256];
+  snprintf(buf, sizeof(buf), "fraction=%.17g minPerStratum=%zu seed=%llu var=",
+           opts.fraction, opts.minPerStratum, (unsigned long long)opts.seed);
+  std::string ret = buf + opts.varName + " regions=";
+  for(double e: opts.regions.Edges()){
+    snprintf(buf, sizeof(buf), "%.17g,", e);
+    ret += buf;
+  }
+  return ret;
+}
+
+class Subsampler
+{
+public:
+  // Works out how often to keep events in each stratum of the full table
+  Subsampler(const EventTable& full, const SubsampleOptions& opts = SubsampleOptions())
+    : fOpts(opts)
+  {
+    for(size_t i = 0; i < full.Size(); ++i) ++fCounts[Stratum(full, i)];
+
+    for(const auto& it: fCounts){
+      const double n = it.second;
+      double p = std::max(fOpts.fraction, fOpts.minPerStratum/n);
+      fKeepProb[it.first] = std::min(p, 1.);
+    }
+  }
+
+  // Which stratum row i belongs to: (mode, region)
+  std::pair<int, int> Stratum(const EventTable& t, size_t i) const
+  {
+    const std::vector<double>& edges = fOpts.regions.Edges();
+    const double x = fOpts.var(t, i);
+    int region = std::upper_bound(edges.begin(), edges.end(), x) - edges.begin();
+    return std::make_pair(t.mode[i], region);
+  }
+
+  double KeepProbability(const EventTable& t, size_t i) const
+  {
+    auto it = fKeepProb.find(Stratum(t, i));
+    return it == fKeepProb.end() ? 1 : it->second;
+  }
+
+  bool Keep(const EventTable& t, size_t i) const
+  {
+    return HashToUniform(EventKey(t, i), fOpts.seed) < KeepProbability(t, i);
+  }
+
+  // The subsample, with each event's weight divided by its chance of
+  // being kept. The POT is unchanged.
+  EventTable Apply(const EventTable& full) const
+  {
+    EventTable sub;
+    sub.pot = full.pot;
+    for(size_t i = 0; i < full.Size(); ++i){
+      if(!Keep(full, i)) continue;
+      sub.Append(full, i);
+      sub.weight.back() /= KeepProbability(full, i);
+    }
+    return sub;
+  }
+
+  // How much bigger the statistical variance in each bin is for the
+  // subsample than for the full sample. The full sample has sum(w^2) in a
+  // bin, and the subsample sum(w^2/p) on average. 1 means nothing was lost;
+  // 20 means you would need 20 times the exposure to get the same precision.
+  TH1D* VarianceInflation(const EventTable& full,
+                          const std::string& label,
+                          const Binning& bins,
+                          const TableVar& var) const
+  {
+    TH1D* hFull = MakeEmptyTH1(label, bins);
+    TH1D* hSub = MakeEmptyTH1(label, bins);
+    for(size_t i = 0; i < full.Size(); ++i){
+      const double x = var(full, i);
+      const double w2 = sqr(full.weight[i]);
+      hFull->Fill(x, w2);
+      hSub->Fill(x, w2/KeepProbability(full, i));
+    }
+    hSub->Divide(hFull);
+    hSub->GetYaxis()->SetTitle("Variance inflation");
+    delete hFull;
+    return hSub;
+  }
+
+  // The same, worked out from the subsample alone. Each kept event stands
+  // for 1/p events, so sum(W^2) over the subsample (W = w/p) estimates the
+  // subsample variance and sum(p W^2) the full-sample variance.
+  TH1D* EstimatedVarianceInflation(const EventTable& sub,
+                                   const std::string& label,
+                                   const Binning& bins,
+                                   const TableVar& var) const
+  {
+    TH1D* hFull = MakeEmptyTH1(label, bins);
+    TH1D* hSub = MakeEmptyTH1(label, bins);
+    for(size_t i = 0; i < sub.Size(); ++i){
+      const double x = var(sub, i);
+      const double W2 = sqr(sub.weight[i]);
+      hFull->Fill(x, W2*KeepProbability(sub, i));
+      hSub->Fill(x, W2);
+    }
+    hSub->Divide(hFull);
+    hSub->GetYaxis()->SetTitle("Variance inflation");
+    delete hFull;
+    return hSub;
+  }
+
+  // Add the strata to a file written by SaveEventTable(), so that a
+  // Subsampler can be rebuilt from it later
+  void Save(const std::string& fname) const
+  {
+    TFile fout(fname.c_str(), "UPDATE");
+    TTree* strata = new TTree("strata", "Subsample strata"); // The file owns it
+    int mode, region;
+    double count, prob;
+    strata->Branch("mode", &mode); strata->Branch("region", &region);
+    strata->Branch("count", &count); strata->Branch("prob", &prob);
+    for(const auto& it: fKeepProb){
+      mode = it.first.first; region = it.first.second;
+      count = fCounts.at(it.first); prob = it.second;
+      strata->Fill();
+    }
+    TTree* options = new TTree("options", "Subsample options");
+    std::string text = SubsampleOptionsString(fOpts);
+    options->Branch("options", &text);
+    options->Fill();
+    fout.Write();
+    fout.Close();
+  }
+
+  // Rebuild from a file written by Save(). Pass the same options as when
+  // the subsample was made.
+  static Subsampler Load(const std::string& fname,
+                         const SubsampleOptions& opts = SubsampleOptions())
+  {
+    Subsampler ret(opts);
+    TFile* fin = TFile::Open(fname.c_str());
+    TTree* strata = 0;
+    if(fin) fin->GetObject("strata", strata);
+    if(!strata){
+      std::cerr << "Subsampler::Load: no strata in " << fname << std::endl;
+      abort();
+    }
+    int mode, region;
+    double count, prob;
+    strata->SetBranchAddress("mode", &mode); strata->SetBranchAddress("region", &region);
+    strata->SetBranchAddress("count", &count); strata->SetBranchAddress("prob", &prob);
+    for(Long64_t i = 0; i < strata->GetEntries(); ++i){
+      strata->GetEntry(i);
+      ret.fCounts[std::make_pair(mode, region)] = count;
+      ret.fKeepProb[std::make_pair(mode, region)] = prob;
+    }
+    delete fin;
+    return ret;
+  }
+
+  // The options saved in a file by Save(), or "" if there are none
+  static std::string SavedOptions(const std::string& fname)
+  {
+    std::unique_ptr<TFile> fin(TFile::Open(fname.c_str()));
+    TTree* options = 0;
+    if(fin && !fin->IsZombie()) fin->GetObject("options", options);
+    if(!options || options->GetEntries() < 1) return "";
+    std::string* text = 0;
+    options->SetBranchAddress("options", &text);
+    options->GetEntry(0);
+    const std::string ret = text ? *text : "";
+    delete text;
+    return ret;
+  }
+
+  void Print() const
+  {
+    std::cout << "Subsample strata (mode, region): events, keep probability" << std::endl;
+    const std::vector<double>& edges = fOpts.regions.Edges();
+    for(const auto& it: fKeepProb){
+      const int r = it.first.second;
+      std::cout << "  mode " << std::setw(3) << it.first.first << ", ";
+      if(r == 0) std::cout << "below " << edges.front();
+      else if(r == int(edges.size())) std::cout << "above " << edges.back();
+      else std::cout << edges[r-1] << " - " << edges[r];
+      std::cout << ": " << fCounts.at(it.first) << ", " << it.second << std::endl;
+    }
+  }
+
+protected:
+  explicit Subsampler(const SubsampleOptions& opts) : fOpts(opts) {}
+
+  SubsampleOptions fOpts;
+  std::map<std::pair<int, int>, size_t> fCounts;
+  std::map<std::pair<int, int>, double> fKeepProb;
+};
+
+// Use the subsample in fname if it exists and was made with the same
+// options. Otherwise make it from the full table that makeFull() returns,
+// and save it to fname for next time. The Subsampler that made it is
+// returned through sampler, for reports.
+EventTable CachedSubsample(const std::string& fname,
+                           std::function<EventTable()> makeFull,
+                           const SubsampleOptions& opts = SubsampleOptions(),
+                           std::unique_ptr<Subsampler>* sampler = 0)
+{
+  if(!gSystem->AccessPathName(fname.c_str())){ // NB returns false if the file exists
+    const std::string saved = Subsampler::SavedOptions(fname);
+    if(saved == SubsampleOptionsString(opts)){
+      std::cout << "Reading subsample from " << fname << std::endl;
+      if(sampler) sampler->reset(new Subsampler(Subsampler::Load(fname, opts)));
+      return LoadEventTable(fname);
+    }
+    std::cout << fname << " was made with different options ("
+              << (saved.empty() ? "unknown" : saved) << "), remaking it" << std::endl;
+  }
+
+  const EventTable full = makeFull();
+  std::unique_ptr<Subsampler> s(new Subsampler(full, opts));
+  s->Print();
+  EventTable sub = s->Apply(full);
+  std::cout << "Kept " << sub.Size() << " of " << full.Size()
+            << " events, saving to " << fname << std::endl;
+  SaveEventTable(sub, fname);
+  s->Save(fname);
+  if(sampler) *sampler = std::move(s);
+  return sub;
+}
@@ -0,0 +1,162 @@
+// Try many variations of a cut and binning in one pass over the files.
+//
+// Comparing "nP >= 1" with "nP >= 2", or different ways of treating pions,
+// normally means a separate Spectrum for every combination, or even a
+// separate job. A CutSweep instead reads the events once, with a loose cut
+// that every variation shares, and keeps them in an EventTable. Every
+// variation is then worked out from that table in memory.
+//
+// Cuts are built out of named conditions. Each condition is evaluated once
+// per event, however many cuts use it, and each Var is evaluated once per
+// event, however many binnings it is drawn with.
+//
+//   CutSweep sweep(loader, kLooseCut);
+//   sweep.AddCondition("numu", ...);
+//   for(int n: {1, 2, 3}) sweep.AddCondition(Form("nP>=%d", n), ...);
+//   sweep.AddCut("nP>=1", {"numu", "nP>=1"});
+//   sweep.AddVar("Reco QE energy (GeV)", kTableEqe);
+//   sweep.AddBinning("40 bins", binsEnergy);
+//   loader.Go();
+//   sweep.Print(1e20);
+
+#pragma once
+
+#include "EventTable.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// One entry in the table of results
+struct SweepResult
+{
+  std::string cut, var, binning;
+  TH1D* hist;
+};
+
+class CutSweep
+{
+public:
+  // Every variation must be tighter than commonCut, which is applied while
+  // reading. The shift, if any, applies to all variations.
+  CutSweep(SpectrumLoaderBase& loader,
+           const Cut& commonCut = kNoCut,
+           const SystShifts& shift = kNoShift)
+    : fRecorder(loader, commonCut, shift)
+  {
+  }
+
+  void AddCondition(const std::string& name, const TableCut& cond)
+  {
+    if(fConditionIdx.count(name)){
+      std::cerr << "CutSweep: condition '" << name << "' defined twice" << std::endl;
+      abort();
+    }
+    fConditionIdx[name] = fConditions.size();
+    fConditions.push_back(cond);
+  }
+
+  // A cut is the AND of some conditions. An empty list passes everything
+  // recorded, ie just the common cut.
+  void AddCut(const std::string& label, const std::vector<std::string>& conditions)
+  {
+    std::vector<int> idxs;
+    for(const std::string& c: conditions){
+      auto it = fConditionIdx.find(c);
+      if(it == fConditionIdx.end()){
+        std::cerr << "CutSweep: cut '" << label << "' uses unknown condition '" << c << "'" << std::endl;
+        abort();
+      }
+      idxs.push_back(it->second);
+    }
+    fCuts.push_back({label, idxs});
+  }
+
+  void AddVar(const std::string& label, const TableVar& var)
+  {
+    fVars.push_back({label, var});
+  }
+
+  void AddBinning(const std::string& label, const Binning& bins)
+  {
+    fBinnings.push_back({label, bins});
+  }
+
+  // One histogram per (cut, var, binning), scaled to pot. Only call this
+  // after loader.Go(). You own the histograms.
+  std::vector<SweepResult> Results(double pot) const
+  {
+    const EventTable& table = fRecorder.Table();
+    const size_t nEvents = table.Size();
+
+    // Each condition once per event
+    std::vector<std::vector<char>> pass(fConditions.size(), std::vector<char>(nEvents));
+    for(size_t c = 0; c < fConditions.size(); ++c)
+      for(size_t i = 0; i < nEvents; ++i) pass[c][i] = fConditions[c](table, i);
+
+    // Each var once per event
+    std::vector<std::vector<double>> vals(fVars.size(), std::vector<double>(nEvents));
+    for(size_t v = 0; v < fVars.size(); ++v)
+      for(size_t i = 0; i < nEvents; ++i) vals[v][i] = fVars[v].var(table, i);
+
+    std::vector<SweepResult> ret;
+    std::vector<char> sel(nEvents);
+    for(const CutDef& cut: fCuts){
+      // AND together the conditions this cut needs
+      std::fill(sel.begin(), sel.end(), 1);
+      for(int c: cut.conditions)
+        for(size_t i = 0; i < nEvents; ++i) sel[i] &= pass[c][i];
+
+      for(size_t v = 0; v < fVars.size(); ++v){
+        for(const BinningDef& b: fBinnings){
+          TH1D* h = MakeEmptyTH1(fVars[v].label, b.bins);
+          h->SetTitle((cut.label + ", " + b.label + ";" + fVars[v].label).c_str());
+          for(size_t i = 0; i < nEvents; ++i)
+            if(sel[i]) h->Fill(vals[v][i], table.weight[i]);
+          if(table.pot > 0) h->Scale(pot/table.pot);
+          ret.push_back({cut.label, fVars[v].label, b.label, h});
+        }
+      }
+    }
+    return ret;
+  }
+
+  // Print a table of every variation with its total and mean
+  void Print(double pot) const
+  {
+    const std::vector<SweepResult> res = Results(pot);
+
+    std::cout << std::left
+              << std::setw(30) << "Cut" << std::setw(30) << "Var"
+              << std::setw(16) << "Binning"
+              << std::right << std::setw(14) << "Events" << std::setw(10) << "Mean"
+              << std::endl;
+    for(const SweepResult& r: res){
+      std::cout << std::left
+                << std::setw(30) << r.cut << std::setw(30) << r.var
+                << std::setw(16) << r.binning
+                << std::right << std::setw(14) << std::setprecision(6) << r.hist->Integral()
+                << std::setw(10) << std::setprecision(3) << r.hist->GetMean()
+                << std::endl;
+      delete r.hist;
+    }
+  }
+
+  const EventTable& Table() const {return fRecorder.Table();}
+
+protected:
+  struct CutDef {std::string label; std::vector<int> conditions;};
+  struct VarDef {std::string label; TableVar var;};
+  struct BinningDef {std::string label; Binning bins;};
+
+  EventRecorder fRecorder;
+
+  std::vector<TableCut> fConditions;
+  std::map<std::string, int> fConditionIdx;
+  std::vector<CutDef> fCuts;
+  std::vector<VarDef> fVars;
+  std::vector<BinningDef> fBinnings;
+};
@@ -0,0 +1,199 @@
+// Definitions shared by the extra systematics macros.
+//
+// The exercises (Systematics1-3) each define their own Vars, Cuts and systs
+// inside the main function so that you can see everything in one place.
+// The extra macros in this directory build on those same definitions, so
+// rather than copying them into every file they live here. If you change
+// something in here, every macro that includes it will pick it up.
+//
+// To use it, put  #include "SystematicsCommon.h"  at the top of your macro.
+
+#pragma once
+
+// These are standard header files from the CAFAna analysis tool
+#include "CAFAna/Core/SpectrumLoader.h"
+#include "CAFAna/Core/Spectrum.h"
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Core/Var.h"
+#include "CAFAna/Core/Cut.h"
+#include "CAFAna/Core/ISyst.h"
+#include "CAFAna/Core/SystShifts.h"
+#include "CAFAna/Core/Utilities.h"
+
+#include "CAFAna/Vars/Vars.h" // Variables
+#include "CAFAna/Cuts/TruthCuts.h" // Cuts
+
+#include "StandardRecord/SRProxy.h" // A wrapper for the CAF format
+
+// ROOT
+#include "TH1.h"
+#include "TMath.h"
+#include "TRandom3.h"
+
+// Standard C++ library
+#include <cmath>
+#include <string>
+
+using namespace ana;
+using util::sqr;
+
+/* *****************
+ GENIE interaction modes.
+ See full list at https://wiki.dunescience.org/wiki/Scattering_mode
+ */
+const int MODE_QE = 1;
+const int MODE_RES = 4;
+const int MODE_DIS = 3;
+const int MODE_MEC = 10;
+
+/* ********
+ PDG codes (https://pdg.lbl.gov/2007/reviews/montecarlorpp.pdf)
+ */
+const int PDG_MU=13;
+const int PDG_E=11;
+const int PDG_NUMU=14;
+const int PDG_NUE=12;
+
+/* *********
+ Physical constants
+ */
+const double M_P = .938; // Proton mass in GeV
+const double M_N = .939; // Neutron mass in GeV
+const double M_MU = .106; // Muon mass in GeV
+const double E_B = .028; // Binding energy for nucleons in argon-40 in GeV
+
+// The ten ND-LAr FHC files used in the exercises
+const std::string CAFS = "/pnfs/dune/persistent/users/marshalc/CAF/CAFv5/00/CAF_FHC_90*.root";
+
+// The 40 bins from 0 to 10 GeV used in all the exercises
+const Binning binsEnergy = Binning::Simple(40, 0, 10);
+
+// Make a fractional plot, (shifted - cv) / cv
+TH1D *MakeFractionalPlot( TH1D* shifted, TH1D *cv)
+{
+  TH1D *frac= (TH1D*) shifted->Clone();
+  frac->Add(cv,-1);
+  frac->Divide(cv);
+  return frac;
+}
+
+// The quasi-elastic formula for neutrino energy
+double QEFormula(double Emu, double cosmu) // Muon energy and cosine of muon angle
+{
+  //Muon momentum
+  const double pmu = sqrt(sqr(Emu) - sqr(M_MU)); // Use the relativity formula E^2 = p^2 + m^2
+  // This is the neutrino-mode version of the formula. For antineutrino mode, swap neutron and proton masses.
+  const double num = sqr(M_P) - sqr(M_N - E_B) - sqr(M_MU) + 2 * (M_N - E_B) * Emu;
+  const double denom = 2 * (M_N - E_B - Emu + pmu * cosmu);
+  if (denom==0) return 0;
+  return num/denom;
+}
+
+// QE energy from the reconstructed muon, with the same protections as
+// kRecoQEFormulaEnergy. Having it as a plain function means code that works
+// on stored columns (rather than on a caf::SRProxy) gets exactly the same answer.
+double RecoQEEnergy(double Emu, double theta)
+{
+  // NB reco doesn't always work out!
+  if(Emu < M_MU) return 0.;
+  const double cosmu = cos(theta);
+  if (std::isnan(Emu) || std::isnan(cosmu)) return 0.;
+  return QEFormula(Emu, cosmu);
+}
+
+// Muon energy
+const Var kRecoMuonEnergy([](const caf::SRProxy* sr)
+                          {
+                            return double(sr->Elep_reco);
+                          });
+
+// Neutrino energy from the QE reconstruction formula
+const Var kRecoQEFormulaEnergy([](const caf::SRProxy* sr)
+                               {
+                                 return RecoQEEnergy(sr->Elep_reco, sr->theta_reco);
+                               });
+
+const HistAxis axMuons("Reconstructed E_{#mu} (GeV)", binsEnergy, kRecoMuonEnergy);
+const HistAxis axRecoQEFormula("Reconstructed QE energy (GeV)", binsEnergy, kRecoQEFormulaEnergy);
+
+// The CC0pi selection from the exercises
+const Cut kHasCC0PiFinalState([](const caf::SRProxy* sr)
+                              {
+                                const int totPi = sr->nipip + sr->nipim + sr->nipi0;
+                                return abs(sr->LepPDG) == 13 && sr->nP >= 1 && totPi == 0;
+                              });
+
+// ...and with the requirement that the QE energy was actually reconstructed
+const Cut kCC0PiSelection = kHasCC0PiFinalState && kRecoQEFormulaEnergy>0;
+
+
+// Scales the muon energy by +/- 20 %
+class EMuScale: public ISyst
+{
+public:
+  EMuScale(): ISyst("muScale", "Muon energy scale") {}
+
+  virtual void Shift(double sigma,
+                     Restorer& restore,
+                     caf::SRProxy* sr,
+                     double& weight) const override
+  {
+    restore.Add(sr->Elep_reco);
+    sr->Elep_reco *= (1 + 0.2 * sigma);
+  }
+};
+
+// 20% smear of the muon energy
+class EMuSmear: public ISyst
+{
+public:
+  EMuSmear(): ISyst("muSmear", "Muon energy smearing") {}
+
+  virtual void Shift(double sigma,
+                     Restorer& restore,
+                     caf::SRProxy* sr,
+                     double& weight) const override
+  {
+    restore.Add(sr->Elep_reco);
+
+    // NB - the way this syst works there's no sense in doing -1 sigma
+    sr->Elep_reco *= 1 + sigma*gRandom->Gaus(0, 0.2);
+  }
+};
+
+// Change the probability of RES events by 50%
+class ResNorm: public ISyst
+{
+public:
+  ResNorm(): ISyst("resNorm", "Resonant event normalization") {}
+
+  virtual void Shift(double sigma,
+                     Restorer& restore,
+                     caf::SRProxy* sr,
+                     double& weight) const override
+  {
+    if (sr->mode == MODE_RES)
+      weight *= 1 + .5*sigma; // NB *= not =, so it composes with other systs
+  }
+};
+
+// Smear muon angle with sigma of 30 degrees (pi/6 radians)
+class ThetaSmear: public ISyst
+{
+public:
+  ThetaSmear(): ISyst("thetaSmear", "Muon angle smearing") {}
+
+  virtual void Shift(double sigma,
+                     Restorer& restore,
+                     caf::SRProxy* sr,
+                     double& weight) const override
+  {
+    restore.Add(sr->theta_reco);
+    sr->theta_reco += sigma*gRandom->Gaus(0, TMath::Pi()/6.0);
+  }
+};
+
+const EMuScale kEMuScale;
+const EMuSmear kEMuSmear;
+const ResNorm kResNorm;
+const ThetaSmear kThetaSmear;
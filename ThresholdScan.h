@@ -0,0 +1,198 @@
+// Get a spectrum for every value of a cut threshold from one pass.
+//
+// To see what a cut like "muon energy > x" does, you could rerun with lots
+// of different values of x. Instead, a ThresholdScanSpectrum fills a 2D
+// Spectrum of (cut variable, plotted variable). The events that pass
+// "cut variable >= x" are then just the sum of all the rows from x upwards,
+// so every threshold on the cut variable's bin edges is available once the
+// loader has run. The running sums are worked out once and reused.
+//
+// The cut variable's axis has a guard bin at each end, one for events
+// below the range of the cut binning and one for events at or above its
+// top edge, so Above() and Below() never lose events off the ends. Events
+// where the cut variable is NaN pass neither "x >= t" nor "x < t", so they
+// go in a third guard bin that neither counts.
+
+#pragma once
+
+#include "SystematicsCommon.h"
+
+#include "TGraph.h"
+#include "TH2.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+class ThresholdScanSpectrum
+{
+public:
+  ThresholdScanSpectrum(SpectrumLoaderBase& loader,
+                        const HistAxis& axis,
+                        const std::string& cutLabel,
+                        const Binning& cutBins,
+                        const Var& cutVar,
+                        const Cut& cut = kNoCut,
+                        const SystShifts& shift = kNoShift,
+                        const Var& wei = kUnweighted)
+    : fCutBins(cutBins)
+  {
+    // Put everything outside the binning into the guard bins, so nothing
+    // ends up in an under- or overflow bin that the 2D histogram would drop
+    const double lo = cutBins.Min();
+    const double hi = cutBins.Max();
+    const double guard = hi - lo;
+    std::vector<double> edges = cutBins.Edges();
+    edges.insert(edges.begin(), lo - guard);
+    edges.push_back(hi + guard);
+    edges.push_back(hi + 2*guard);
+    const Var kGuardedCutVar([=](const caf::SRProxy* sr)
+                             {
+                               const double x = cutVar(sr);
+                               if(std::isnan(x)) return hi + 1.5*guard;
+                               if(x < lo) return lo - .5*guard;
+                               if(x >= hi) return hi + .5*guard;
+                               return x;
+                             });
+
+    const HistAxis ax2D(cutLabel, Binning::Custom(edges), kGuardedCutVar,
+                        axis.GetLabels()[0], axis.GetBinnings()[0], axis.GetVars()[0]);
+    fSpect.reset(new Spectrum(loader, ax2D, cut, shift, wei));
+  }
+
+  // The thresholds we can cut at: the edges of the cut binning
+  std::vector<double> Thresholds() const
+  {
+    return fCutBins.Edges();
+  }
+
+  // Events with the cut variable >= threshold, scaled to pot
+  TH1D* Above(double threshold, double pot) const
+  {
+    return Row(true, ThresholdBin(threshold), pot);
+  }
+
+  // Events with the cut variable < threshold, scaled to pot
+  TH1D* Below(double threshold, double pot) const
+  {
+    return Row(false, ThresholdBin(threshold), pot);
+  }
+
+  // Total number of events passing "cut variable >= x" (or "< x") for
+  // every threshold x, as a graph against x
+  TGraph* IntegralVsThreshold(double pot, bool above = true) const
+  {
+    const TH2D& cum = CachedCumulative(above);
+    const std::vector<double> edges = Thresholds();
+    TGraph* g = new TGraph;
+    for(unsigned int k = 0; k < edges.size(); ++k){
+      double tot = 0;
+      for(int j = 1; j <= cum.GetNbinsY(); ++j) tot += cum.GetBinContent(k+1, j);
+      g->SetPoint(k, edges[k], tot*pot/fSpect->POT());
+    }
+    return g;
+  }
+
+  // The 2D (cut variable, plotted variable) distribution, scaled to pot.
+  // The first x bin holds events below the cut binning, and the last two
+  // those at or above it and those where the cut variable is NaN.
+  TH2D* ToTH2(double pot) const {return fSpect->ToTH2(pot);}
+
+  // Running sums over the cut variable, scaled to pot. Row k (x bin k+1)
+  // holds the events passing the threshold at edge k. There is one more
+  // threshold than there are cut bins; the one at the top edge is in the
+  // overflow. You own the result.
+  TH2D* Cumulative(double pot, bool above = true) const
+  {
+    TH2D* ret = (TH2D*)CachedCumulative(above).Clone(UniqueName().c_str());
+    ret->Scale(pot/fSpect->POT());
+    return ret;
+  }
+
+protected:
+  // Which edge of the cut binning a threshold corresponds to. Only edges
+  // can be cut at; anything else is an error.
+  int ThresholdBin(double threshold) const
+  {
+    const std::vector<double> edges = Thresholds();
+    int best = 0;
+    for(unsigned int k = 1; k < edges.size(); ++k)
+      if(fabs(edges[k]-threshold) < fabs(edges[best]-threshold)) best = k;
+
+    if(fabs(edges[best]-threshold) > 1e-9*std::max(1., fabs(threshold))){
+      std::cerr << "ThresholdScanSpectrum: " << threshold
+                << " is not an edge of the cut binning (the nearest is " << edges[best] << ")" << std::endl;
+      abort();
+    }
+    return best;
+  }
+
+  // Pull one threshold's row out of the running sums
+  TH1D* Row(bool above, int k, double pot) const
+  {
+    TH1D* ret = CachedCumulative(above).ProjectionY(UniqueName().c_str(), k+1, k+1, "e");
+    ret->SetDirectory(0);
+    ret->Scale(pot/fSpect->POT());
+    return ret;
+  }
+
+  // The running sums at the POT the loader read. These are only worked
+  // out the first time they are needed, and only valid after loader.Go().
+  const TH2D& CachedCumulative(bool above) const
+  {
+    std::unique_ptr<TH2D>& cum = above ? fCumAbove : fCumBelow;
+    if(cum) return *cum;
+
+    // x bin 1 is the guard below the binning, 2 to nCut+1 are the cut
+    // bins, nCut+2 is the guard above and nCut+3 is for NaN
+    const std::unique_ptr<TH2D> h(fSpect->ToTH2(fSpect->POT()));
+    const int nCut = fCutBins.NBins();
+    const int nAx = h->GetNbinsY();
+    const int under = 1, over = nCut+2;
+
+    const std::vector<double> cutEdges = fCutBins.Edges();
+    std::vector<double> axEdges(nAx+1);
+    for(int j = 0; j <= nAx; ++j) axEdges[j] = h->GetYaxis()->GetBinLowEdge(j+1);
+
+    // Our rows are thresholds, not bins, but keep the binning so the axes
+    // are labelled sensibly
+    cum.reset(new TH2D(UniqueName().c_str(), h->GetTitle(),
+                       nCut, &cutEdges[0], nAx, &axEdges[0]));
+    cum->SetDirectory(0);
+
+    // Threshold k is the low edge of cut bin k, x bin k+2
+    for(int j = 1; j <= nAx; ++j){
+      if(above){
+        double sum = h->GetBinContent(over, j);
+        double sumErr2 = sqr(h->GetBinError(over, j));
+        for(int k = nCut; k >= 0; --k){
+          if(k < nCut){
+            sum += h->GetBinContent(k+2, j);
+            sumErr2 += sqr(h->GetBinError(k+2, j));
+          }
+          cum->SetBinContent(k+1, j, sum);
+          cum->SetBinError(k+1, j, sqrt(sumErr2));
+        }
+      }
+      else{
+        double sum = h->GetBinContent(under, j);
+        double sumErr2 = sqr(h->GetBinError(under, j));
+        for(int k = 0; k <= nCut; ++k){
+          cum->SetBinContent(k+1, j, sum);
+          cum->SetBinError(k+1, j, sqrt(sumErr2));
+          if(k < nCut){
+            sum += h->GetBinContent(k+2, j);
+            sumErr2 += sqr(h->GetBinError(k+2, j));
+          }
+        }
+      }
+    }
+    return *cum;
+  }
+
+  Binning fCutBins;
+  std::unique_ptr<Spectrum> fSpect;
+  mutable std::unique_ptr<TH2D> fCumAbove, fCumBelow;
+};
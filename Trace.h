@@ -0,0 +1,133 @@
+// Record a timeline of what each thread is doing, for Perfetto.
+//
+// When a job is slower than it should be, a profile tells you which
+// functions are hot but not when, or on which thread. With tracing on,
+// each piece of work is recorded as a span (name, thread, start, length)
+// and WriteTrace() saves them as Chrome trace-event JSON. Open that at
+// ui.perfetto.dev (it runs in the browser and nothing is uploaded) or
+// chrome://tracing.
+//
+// What is recorded:
+//
+//  - ROOT file opens, basket reads and basket decompression, on threads
+//    that called TraceRootIO()
+//  - Vars, Cuts and systs wrapped in TracedVar(), TracedCut() and
+//    TracedSyst
+//  - universe fills in UniverseEngine, and anything else inside a
+//    TraceSpan
+//
+//   EnableTracing();
+//   TraceRootIO();
+//   const Var kTracedEqe = TracedVar("Eqe", kRecoQEFormulaEnergy);
+//   ...
+//   loader.Go();
+//   WriteTrace("trace.json");
+//
+// Recording has to cost far less than what it measures. Each thread writes
+// to its own fixed-size ring buffer, with no locks and no allocation, so
+// threads never wait for each other. If a buffer fills up, its oldest
+// spans are overwritten: with per-event spans from TracedVar() and friends
+// that is after a few thousand events, so the timeline shows only the end
+// of a long run. The ROOT I/O spans are the exception. There are few of
+// them next to the time they take, and they are kept for the whole run,
+// file opens and all, on a list beside the ring. A thread's buffer is reused by later threads once
+// it exits, so there are only ever as many as there were threads running
+// at once. When tracing is off a span costs one flag check. Call
+// WriteTrace() once the traced work has finished.
+//
+// The buffers and TraceSpan are in TraceSpan.h, for code that only needs
+// to record spans.
+
+#pragma once
+
+#include "SystematicsCommon.h"
+#include "TraceSpan.h"
+
+#include "TTimeStamp.h"
+#include "TVirtualPerfStats.h"
+
+#include <string>
+
+// A Var that records a span each time it is evaluated
+Var TracedVar(const std::string& name, const Var& var)
+{
+  const char* n = Tracer::Instance().Intern(name);
+  return Var([=](const caf::SRProxy* sr){
+      TraceSpan span(n, "var");
+      return var(sr);
+    });
+}
+
+Cut TracedCut(const std::string& name, const Cut& cut)
+{
+  const char* n = Tracer::Instance().Intern(name);
+  return Cut([=](const caf::SRProxy* sr){
+      TraceSpan span(n, "cut");
+      return cut(sr);
+    });
+}
+
+// A syst that records a span each time it shifts an event. Use it in
+// place of the original in SystShifts.
+class TracedSyst: public ISyst
+{
+public:
+  TracedSyst(const ISyst* syst)
+    : ISyst("traced_" + syst->ShortName(), syst->LatexName()),
+      fSyst(syst), fName(Tracer::Instance().Intern(syst->ShortName()))
+  {
+  }
+
+  virtual void Shift(double sigma,
+                     Restorer& restore,
+                     caf::SRProxy* sr,
+                     double& weight) const override
+  {
+    TraceSpan span(fName, "syst");
+    fSyst->Shift(sigma, restore, sr, weight);
+  }
+
+protected:
+  const ISyst* fSyst;
+  const char* fName;
+};
+
+// Receives ROOT's I/O callbacks. ROOT reports the start time and we take
+// the end as the moment it calls us.
+class TraceIOStats: public TVirtualPerfStats
+{
+public:
+  virtual void FileOpenEvent(TFile*, const char*, Double_t start) override {Record("file open", start);}
+  virtual void FileReadEvent(TFile*, Int_t, Double_t start) override {Record("basket read", start);}
+  virtual void UnzipEvent(TObject*, Long64_t, Double_t start, Int_t, Int_t) override {Record("decompress", start);}
+
+  // The rest of the interface is for PROOF
+  virtual void SimpleEvent(EEventType) override {}
+  virtual void PacketEvent(const char*, const char*, const char*, Long64_t,
+                           Double_t, Double_t, Double_t, Long64_t) override {}
+  virtual void FileEvent(const char*, const char*, const char*, const char*, Bool_t) override {}
+  virtual void RateEvent(Double_t, Double_t, Long64_t, Long64_t) override {}
+  virtual void SetBytesRead(Long64_t n) override {fBytesRead = n;}
+  virtual Long64_t GetBytesRead() const override {return fBytesRead;}
+  virtual void SetNumEvents(Long64_t n) override {fNumEvents = n;}
+  virtual Long64_t GetNumEvents() const override {return fNumEvents;}
+
+protected:
+  void Record(const char* name, Double_t start)
+  {
+    const Tracer& t = Tracer::Instance();
+    if(t.Enabled()) TraceComplete(name, "io", t.FromUnixTime(start), t.Now(), true);
+  }
+
+  Long64_t fBytesRead = 0;
+  Long64_t fNumEvents = 0;
+};
+
+// Trace ROOT's I/O on the calling thread. ROOT keeps one gPerfStats per
+// thread, so call this on each thread that runs a loader, eg at the start
+// of a job passed to LoaderPool::Submit().
+void TraceRootIO()
+{
+  thread_local TraceIOStats stats;
+  gPerfStats = &stats;
+}
@@ -0,0 +1,241 @@
+// The core of tracing (see Trace.h): the per-thread ring buffers, the
+// tracer that owns them, and TraceSpan. It needs nothing from ROOT or
+// CAFAna, so low-level code like CountingHistogram.h can record spans
+// without pulling in the rest.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct TraceEvent
+{
+  const char* name; // Must outlive the trace. See Tracer::Intern().
+  const char* cat;
+  int64_t start;    // ns since tracing was enabled
+  int64_t dur;      // ns
+};
+
+// One thread's spans. Only that thread writes to it. Most go in a ring
+// that wraps round, but the few that are worth keeping from the whole run
+// (see Keep()) are never overwritten.
+class TraceRing
+{
+public:
+  static const size_t kCapacity = 1 << 16;
+
+  TraceRing(int tid) : fTid(tid), fEvents(kCapacity) {}
+
+  void Push(const TraceEvent& ev)
+  {
+    const uint64_t h = fHead.load(std::memory_order_relaxed);
+    fEvents[h % kCapacity] = ev;
+    fHead.store(h+1, std::memory_order_release);
+  }
+
+  // For spans that are rare next to what they cost, like file opens and
+  // reads. They are kept however long the run is, so the start of the
+  // timeline isn't lost to the ring wrapping round. Takes a lock, which
+  // only Snapshot() ever contends.
+  void Keep(const TraceEvent& ev)
+  {
+    std::lock_guard<std::mutex> lock(fKeptMutex);
+    fKept.push_back(ev);
+  }
+
+  int Tid() const {return fTid;}
+
+  // The kept spans, then the ring's, oldest first
+  std::vector<TraceEvent> Snapshot() const
+  {
+    std::vector<TraceEvent> ret;
+    {
+      std::lock_guard<std::mutex> lock(fKeptMutex);
+      ret = fKept;
+    }
+    const uint64_t h = fHead.load(std::memory_order_acquire);
+    const uint64_t n = std::min<uint64_t>(h, kCapacity);
+    ret.reserve(ret.size() + n);
+    for(uint64_t i = h-n; i < h; ++i) ret.push_back(fEvents[i % kCapacity]);
+    return ret;
+  }
+
+  // Spans lost because the buffer wrapped round
+  uint64_t Dropped() const
+  {
+    const uint64_t h = fHead.load(std::memory_order_acquire);
+    return h > kCapacity ? h - kCapacity : 0;
+  }
+
+protected:
+  int fTid;
+  std::vector<TraceEvent> fEvents;
+  std::atomic<uint64_t> fHead{0};
+  mutable std::mutex fKeptMutex;
+  std::vector<TraceEvent> fKept;
+};
+
+class Tracer
+{
+public:
+  static Tracer& Instance()
+  {
+    static Tracer t;
+    return t;
+  }
+
+  bool Enabled() const {return fEnabled.load(std::memory_order_relaxed);}
+
+  void Enable(bool on)
+  {
+    if(on) fEpoch = std::chrono::steady_clock::now();
+    fEnabled = on;
+  }
+
+  int64_t Now() const
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - fEpoch).count();
+  }
+
+  // The trace time of a wall-clock time in seconds since 1970, as ROOT
+  // gives its start times
+  int64_t FromUnixTime(double t) const
+  {
+    const double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    return Now() - int64_t(1e9*(now - t));
+  }
+
+  // This thread's ring. Getting one takes a lock, but only on a thread's
+  // first span. When the thread exits its ring goes back on a free list
+  // for the next new thread, spans and all, so code that starts fresh
+  // threads over and over doesn't need a new ring each time.
+  TraceRing& Ring()
+  {
+    thread_local RingLease lease;
+    if(!lease.ring) lease.ring = Acquire();
+    return *lease.ring;
+  }
+
+  // A copy of name that lives as long as the tracer, for spans with
+  // names made at run time. Not for use inside the traced code itself.
+  const char* Intern(const std::string& name)
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    fNames.push_back(name);
+    return fNames.back().c_str();
+  }
+
+  void Write(const std::string& fname) const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    std::ofstream out(fname);
+    out << std::fixed << std::setprecision(3); // Microseconds, to the ns
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    uint64_t dropped = 0;
+    for(const auto& ring: fRings){
+      out << (first ? "" : ",\n")
+          << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << ring->Tid()
+          << ", \"args\": {\"name\": \"thread " << ring->Tid() << "\"}}";
+      first = false;
+      for(const TraceEvent& ev: ring->Snapshot()){
+        out << ",\n{\"name\": \"" << ev.name << "\", \"cat\": \"" << ev.cat
+            << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << ring->Tid()
+            << ", \"ts\": " << ev.start/1e3 << ", \"dur\": " << ev.dur/1e3 << "}";
+      }
+      dropped += ring->Dropped();
+    }
+    out << "\n]}\n";
+    if(dropped > 0)
+      std::cerr << "WriteTrace: " << dropped << " early spans were overwritten; the timeline "
+                << "only shows the end of the run, apart from the file I/O" << std::endl;
+  }
+
+protected:
+  Tracer() : fEpoch(std::chrono::steady_clock::now()) {}
+
+  // Hands a thread's ring back when the thread exits
+  struct RingLease
+  {
+    TraceRing* ring = 0;
+    ~RingLease() {if(ring) Tracer::Instance().Release(ring);}
+  };
+
+  TraceRing* Acquire()
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    if(!fFree.empty()){
+      TraceRing* ring = fFree.back();
+      fFree.pop_back();
+      return ring;
+    }
+    fRings.emplace_back(new TraceRing(fRings.size()));
+    return fRings.back().get();
+  }
+
+  void Release(TraceRing* ring)
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    fFree.push_back(ring);
+  }
+
+  std::atomic<bool> fEnabled{false};
+  std::chrono::steady_clock::time_point fEpoch;
+  mutable std::mutex fMutex;
+  std::vector<std::unique_ptr<TraceRing>> fRings;
+  std::vector<TraceRing*> fFree; // Rings of threads that have exited
+  std::deque<std::string> fNames;
+};
+
+void EnableTracing(bool on = true) {Tracer::Instance().Enable(on);}
+void WriteTrace(const std::string& fname) {Tracer::Instance().Write(fname);}
+
+// Record a span that has already happened. With keep it is never
+// overwritten (see TraceRing::Keep()).
+inline void TraceComplete(const char* name, const char* cat, int64_t start, int64_t end,
+                          bool keep = false)
+{
+  TraceRing& ring = Tracer::Instance().Ring();
+  if(keep) ring.Keep({name, cat, start, end - start});
+  else ring.Push({name, cat, start, end - start});
+}
+
+// Records a span from construction to destruction. name and cat must be
+// string literals, or come from Tracer::Intern(). The thread's ring is
+// found before the clock starts, so the first span on a thread doesn't
+// include getting one (nor do any spans around it).
+class TraceSpan
+{
+public:
+  TraceSpan(const char* name, const char* cat)
+    : fName(name), fCat(cat), fRing(0), fStart(-1)
+  {
+    Tracer& t = Tracer::Instance();
+    if(!t.Enabled()) return;
+    fRing = &t.Ring();
+    fStart = t.Now();
+  }
+
+  ~TraceSpan()
+  {
+    if(fRing) fRing->Push({fName, fCat, fStart, Tracer::Instance().Now() - fStart});
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+
+protected:
+  const char* fName;
+  const char* fCat;
+  TraceRing* fRing;
+  int64_t fStart;
+};
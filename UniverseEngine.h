@@ -0,0 +1,729 @@
+// Throw universes over an EventTable, and keep throwing until the band has
+// converged.
+//
+// How many universes is enough? A fixed 1000 wastes time if the band has
+// settled down after 200, and isn't enough if it needs 5000. The RMS in
+// each bin, estimated from N universes, is itself uncertain by roughly
+// 1/sqrt(2N) (more if the universes have long tails). RunAdaptive() throws
+// universes in batches, keeps running estimates of the per-bin RMS and the
+// bin-to-bin covariance, and stops as soon as both are known to the
+// precision you asked for, or when it hits the cap.
+//
+// The engine works on events already selected into an EventTable, so each
+// universe costs a pass over memory rather than over the files. The systs
+// are applied to the table's columns by "table" versions of the usual
+// systs (see TableShiftFor()). Record the table with a cut that doesn't
+// depend on the shifted quantities, eg kHasCC0PiFinalState rather than
+// kCC0PiSelection, or events that only pass in some universes are missing.
+// The part of the selection that does depend on them is applied after the
+// shifts, in each universe, with SetShiftedCut(): for kCC0PiSelection that
+// is kShiftedQEReconstructed.
+//
+//   UniverseEngine engine(table, binsEnergy);
+//   engine.SetShiftedCut(kShiftedQEReconstructed);
+//   AdaptiveOptions opts;
+//   opts.targetRMS = .02;
+//   AdaptiveResult res = engine.RunAdaptive(gen, opts);
+//   res.Print();
+//
+// MeanShift() is for the opposite question: not the spread of the
+// universes, but the average effect of a smearing syst, with as little
+// random-number noise as possible (see also kDetEMuSmearAnti).
+
+#pragma once
+
+#include "Deterministic.h"
+#include "EventTable.h"
+#include "HugePages.h"
+#include "LoaderTools.h"
+#include "Trace.h"
+#include "Universes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The parts of an event that the systs can change
+struct ShiftedEvent
+{
+  double Elep;
+  double theta;
+  double weight;
+};
+
+// Shift row i of a table by sigma in universe univ. Smearing systs use univ
+// to get different random numbers in each universe.
+typedef std::function<void(double sigma, const EventTable& t, size_t i,
+                           uint64_t univ, ShiftedEvent& ev)> TableShift;
+
+// What to histogram, after the shifts
+typedef std::function<double(const EventTable& t, size_t i, const ShiftedEvent& ev)> ShiftedVar;
+
+const ShiftedVar kShiftedEqe = [](const EventTable&, size_t, const ShiftedEvent& ev)
+{
+  return RecoQEEnergy(ev.Elep, ev.theta);
+};
+
+const ShiftedVar kShiftedMuonEnergy = [](const EventTable&, size_t, const ShiftedEvent& ev)
+{
+  return ev.Elep;
+};
+
+// Which events to keep, after the shifts
+typedef std::function<bool(const EventTable& t, size_t i, const ShiftedEvent& ev)> ShiftedCut;
+
+const ShiftedCut kShiftedNoCut = [](const EventTable&, size_t, const ShiftedEvent&){return true;};
+
+// The "kRecoQEFormulaEnergy>0" half of kCC0PiSelection. A muon scaled or
+// smeared below the muon mass fails the reconstruction, and the event is
+// dropped in that universe, as it is from a Spectrum.
+const ShiftedCut kShiftedQEReconstructed = [](const EventTable&, size_t, const ShiftedEvent& ev)
+{
+  return RecoQEEnergy(ev.Elep, ev.theta) > 0;
+};
+
+// Set in a universe key to make it the antithetic partner of the same key
+// without it: every smear gets minus the random number it had there
+const uint64_t kAntitheticBit = 1ULL << 63;
+
+// Random numbers for smearing row i in universe univ. Each universe gets
+// its own, but the same universe always gets the same ones.
+double UniverseGaus(const EventTable& t, size_t i, uint64_t univ, uint64_t stream)
+{
+  const uint64_t key = IntrinsicEventKey(t.run[i], t.subrun[i], t.event[i], t.Ev[i]);
+  const double z = EventGaus(key ^ MixBits(univ & ~kAntitheticBit), stream);
+  return (univ & kAntitheticBit) ? -z : z;
+}
+
+// The table version of each syst in SystematicsCommon.h and Deterministic.h.
+// The Det smears use the same random numbers in every universe, like they
+// do in a Spectrum.
+TableShift TableShiftFor(const ISyst* syst)
+{
+  if(syst == &kEMuScale)
+    return [](double sigma, const EventTable&, size_t, uint64_t, ShiftedEvent& ev){
+      ev.Elep *= 1 + 0.2*sigma;
+    };
+  if(syst == &kEMuSmear)
+    return [](double sigma, const EventTable& t, size_t i, uint64_t univ, ShiftedEvent& ev){
+      ev.Elep *= 1 + sigma*0.2*UniverseGaus(t, i, univ, 1);
+    };
+  if(syst == &kResNorm)
+    return [](double sigma, const EventTable& t, size_t i, uint64_t, ShiftedEvent& ev){
+      if(t.mode[i] == MODE_RES) ev.weight *= 1 + .5*sigma;
+    };
+  if(syst == &kThetaSmear)
+    return [](double sigma, const EventTable& t, size_t i, uint64_t univ, ShiftedEvent& ev){
+      ev.theta += sigma*TMath::Pi()/6.0*UniverseGaus(t, i, univ, 2);
+    };
+  if(const DetEMuSmear* s = dynamic_cast<const DetEMuSmear*>(syst)){
+    const uint64_t stream = s->Stream();
+    const int sign = s->Sign();
+    return [stream, sign](double sigma, const EventTable& t, size_t i, uint64_t, ShiftedEvent& ev){
+      ev.Elep *= 1 + sigma*0.2*sign*EventGaus(IntrinsicEventKey(t.run[i], t.subrun[i], t.event[i], t.Ev[i]), stream);
+    };
+  }
+  if(const DetThetaSmear* s = dynamic_cast<const DetThetaSmear*>(syst)){
+    const uint64_t stream = s->Stream();
+    const int sign = s->Sign();
+    return [stream, sign](double sigma, const EventTable& t, size_t i, uint64_t, ShiftedEvent& ev){
+      ev.theta += sigma*TMath::Pi()/6.0*sign*EventGaus(IntrinsicEventKey(t.run[i], t.subrun[i], t.event[i], t.Ev[i]), stream);
+    };
+  }
+
+  std::cerr << "TableShiftFor: no table version of syst " << syst->ShortName() << std::endl;
+  abort();
+}
+
+struct AdaptiveOptions
+{
+  double targetRMS = .05;     // Wanted relative uncertainty on the RMS of every bin
+  double targetCov = .1;      // Wanted uncertainty on each covariance, in units of sigma_i*sigma_j
+  int batchSize = 50;         // Universes thrown between convergence checks
+  int minUniverses = 100;     // Never stop before this many
+  int maxUniverses = 5000;    // Always stop at this many
+  unsigned int seed = 42;
+  unsigned int nThreads = 0;  // 0 means one per core
+  bool verbose = false;       // Print the precision after every batch
+
+  // Where the universes come from. Null means pseudo-random, from seed. The
+  // precisions reported assume independent universes, so with a
+  // quasi-random sampler (see QuasiRandom.h) they are pessimistic; use
+  // UniverseEngine::RMSConvergence() to see how much.
+  IUniverseSampler* sampler = 0;
+};
+
+// Running mean and covariance of the universe histograms, updated one
+// universe at a time (Welford's method, with Terriberry's extension to the
+// fourth moment, which the uncertainty on the RMS needs)
+class UniverseStats
+{
+public:
+  explicit UniverseStats(int nBins)
+    : fMean(nBins, 0), fM3(nBins, 0), fM4(nBins, 0), fC(nBins*nBins, 0)
+  {
+  }
+
+  void Add(const std::vector<double>& x)
+  {
+    const int nb = fMean.size();
+    ++fN;
+    const double n = fN;
+
+    std::vector<double> dOld(nb);
+    for(int i = 0; i < nb; ++i) dOld[i] = x[i] - fMean[i];
+
+    for(int i = 0; i < nb; ++i){
+      const double M2 = fC[i*nb+i];
+      const double dn = dOld[i]/n;
+      const double term1 = dOld[i]*dn*(n-1);
+      fM4[i] += term1*dn*dn*(n*n-3*n+3) + 6*dn*dn*M2 - 4*dn*fM3[i];
+      fM3[i] += term1*dn*(n-2) - 3*dn*M2;
+      fMean[i] += dn;
+    }
+
+    // The co-moment uses the old mean on one side and the new on the other
+    for(int i = 0; i < nb; ++i)
+      for(int j = 0; j < nb; ++j)
+        fC[i*nb+j] += dOld[i]*(x[j] - fMean[j]);
+  }
+
+  int N() const {return fN;}
+  int NBins() const {return fMean.size();}
+  double Mean(int i) const {return fMean[i];}
+  double Cov(int i, int j) const {return fN > 1 ? fC[i*NBins()+j]/(fN-1) : 0;}
+  double RMS(int i) const {return sqrt(Cov(i, i));}
+
+  // Relative uncertainty on the RMS of the worst bin. For a Gaussian spread
+  // this is 1/sqrt(2N); it is bigger if the spread has long tails.
+  double RMSPrecision() const
+  {
+    double worst = 0;
+    const int nb = NBins();
+    for(int i = 0; i < nb; ++i){
+      const double M2 = fC[i*nb+i];
+      if(M2 <= 0) continue; // Bins with no spread at all are as converged as they'll get
+      const double kurt = fN*fM4[i]/(M2*M2);
+      worst = std::max(worst, .5*sqrt(std::max(kurt-1, 0.)/fN));
+    }
+    return fN > 1 ? worst : 1;
+  }
+
+  // Uncertainty on the worst covariance element, in units of
+  // sigma_i*sigma_j. This assumes the spread is roughly Gaussian, where it
+  // is sqrt((1+rho^2)/(N-1)).
+  double CovPrecision() const
+  {
+    if(fN < 2) return 1;
+    double worst = 0;
+    const int nb = NBins();
+    for(int i = 0; i < nb; ++i){
+      for(int j = 0; j < i; ++j){
+        const double vv = Cov(i, i)*Cov(j, j);
+        if(vv <= 0) continue;
+        const double rho2 = util::sqr(Cov(i, j))/vv;
+        worst = std::max(worst, sqrt((1+rho2)/(fN-1)));
+      }
+    }
+    return worst;
+  }
+
+protected:
+  int fN = 0;
+  std::vector<double> fMean, fM3, fM4;
+  std::vector<double> fC; // Co-moment, nBins x nBins
+};
+
+struct AdaptiveResult
+{
+  int nUniverses;
+  bool converged;      // False if it stopped at maxUniverses
+  double rmsPrecision; // Achieved relative uncertainty on the worst bin's RMS
+  double covPrecision; // Achieved uncertainty on the worst covariance element
+  UniverseBand band;   // Scaled to the POT given to RunAdaptive()
+
+  void Print() const
+  {
+    std::cout << (converged ? "Converged" : "Stopped at the cap") << " after "
+              << nUniverses << " universes: RMS known to " << 100*rmsPrecision
+              << "%, covariance to " << covPrecision << " sigma_i sigma_j" << std::endl;
+  }
+};
+
+// The average effect of a shift, from UniverseEngine::MeanShift()
+struct ShiftEstimate
+{
+  std::vector<double> diff; // Shifted minus nominal, per bin, unscaled
+  std::vector<double> err;  // Uncertainty on diff from the finite number of draws
+  int nFills;               // How many universes were filled to get it
+};
+
+// How FillUniverses() loops over events and universes
+enum class FillOrder
+{
+  kEventMajor,    // Every universe for one event, then the next event
+  kUniverseMajor, // Every event for one universe, then the next universe
+  kBlocked        // Every universe for a block of events, then the next block
+};
+
+// Block sizes (in events) to try when tuning kBlocked
+const std::vector<size_t> kBlockSizes = {256, 1024, 4096, 16384, 65536};
+
+class UniverseEngine
+{
+public:
+  UniverseEngine(const EventTable& table,
+                 const Binning& bins,
+                 const TableCut& cut = kTableNoCut,
+                 const ShiftedVar& var = kShiftedEqe)
+    : fTable(table), fEdges(bins.Edges()), fVar(var)
+  {
+    for(size_t i = 0; i < table.Size(); ++i)
+      if(cut(table, i)) fSelected.push_back(i);
+  }
+
+  int NBins() const {return fEdges.size()-1;}
+  const EventTable& Table() const {return fTable;}
+
+  // Applied to each event in each universe, after the shifts. Nominal()
+  // uses it too.
+  void SetShiftedCut(const ShiftedCut& cut) {fShiftedCut = cut;}
+
+  // kBlocked, the default, is usually fastest with many universes
+  void SetFillOrder(FillOrder order) {fOrder = order;}
+
+  // Events per block for kBlocked. 0 (the default) means time a few sizes
+  // the first time universes are filled, and use the fastest.
+  void SetBlockSize(size_t blockSize)
+  {
+    std::lock_guard<std::mutex> lock(fBlockSizeMutex);
+    fBlockSize = blockSize;
+  }
+
+  size_t BlockSize() const
+  {
+    std::lock_guard<std::mutex> lock(fBlockSizeMutex);
+    return fBlockSize;
+  }
+
+  // Where each thread keeps its stack of universe histograms. With
+  // thousands of universes these can be large enough that huge pages cut
+  // the TLB misses noticeably. Pinning keeps each thread on the NUMA node
+  // its stack was placed on (the stacks are always created by the thread
+  // that fills them, so they start out local).
+  void SetHugePages(HugePageMode mode) {fHugePages = mode;}
+  void SetPinThreads(bool pin) {fPinThreads = pin;}
+
+  // How long it takes to fill nUniverses universes from gen, in seconds
+  double TimeFill(const CorrelatedUniverseGenerator& gen, int nUniverses,
+                  unsigned int nThreads = 1, unsigned int seed = 42) const
+  {
+    std::vector<TableShift> shifts;
+    for(const ISyst* s: gen.Systs()) shifts.push_back(TableShiftFor(s));
+    const TMatrixD sigmas = gen.ThrowSigmas(nUniverses, seed);
+    std::vector<uint64_t> univs(nUniverses);
+    for(int u = 0; u < nUniverses; ++u) univs[u] = UniverseKey(seed, u);
+
+    // Tune first, so that isn't included in the time
+    if(fOrder == FillOrder::kBlocked) TunedBlockSize(shifts, sigmas.GetMatrixArray(), gen.NSysts(), univs);
+
+    const auto start = std::chrono::steady_clock::now();
+    FillUniverses(shifts, sigmas.GetMatrixArray(), gen.NSysts(), univs, nThreads);
+    const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+    return dt.count();
+  }
+
+  // The histogram (unscaled, without under- or overflow) in one universe,
+  // with shift sigmas[k] of syst k
+  std::vector<double> FillUniverse(const std::vector<TableShift>& shifts,
+                                   const double* sigmas,
+                                   uint64_t univ) const
+  {
+    std::vector<double> ret(NBins(), 0);
+    for(size_t i: fSelected){
+      ShiftedEvent ev{fTable.Elep_reco[i], fTable.theta_reco[i], fTable.weight[i]};
+      for(size_t k = 0; k < shifts.size(); ++k)
+        if(sigmas[k] != 0) shifts[k](sigmas[k], fTable, i, univ, ev);
+
+      const int bin = ShiftedBin(i, ev);
+      if(bin >= 0) ret[bin] += ev.weight;
+    }
+    return ret;
+  }
+
+  std::vector<double> Nominal() const
+  {
+    return FillUniverse({}, 0, 0);
+  }
+
+  // Throw universes from gen until the band has converged (see
+  // AdaptiveOptions), and return it scaled to pot
+  AdaptiveResult RunAdaptive(const CorrelatedUniverseGenerator& gen,
+                             const AdaptiveOptions& opts,
+                             double pot = 1e20) const
+  {
+    std::vector<TableShift> shifts;
+    for(const ISyst* s: gen.Systs()) shifts.push_back(TableShiftFor(s));
+
+    const unsigned int nThreads = opts.nThreads > 0 ? opts.nThreads : NCores();
+
+    UniverseStats stats(NBins());
+    AdaptiveResult res;
+    res.converged = false;
+
+    if(opts.sampler) opts.sampler->Reset(opts.seed);
+
+    for(int batch = 0; stats.N() < opts.maxUniverses; ++batch){
+      const int nThis = std::min(opts.batchSize, opts.maxUniverses - stats.N());
+      const TMatrixD sigmas = opts.sampler ? gen.ThrowSigmas(*opts.sampler, nThis) : gen.ThrowSigmas(nThis, opts.seed + batch);
+
+      // Fill this batch's universes in parallel, then add them to the stats
+      // in order, so the answer doesn't depend on the thread count
+      std::vector<uint64_t> univs(nThis);
+      for(int u = 0; u < nThis; ++u) univs[u] = UniverseKey(opts.seed, stats.N() + u);
+      const std::vector<std::vector<double>> hists =
+        FillUniverses(shifts, sigmas.GetMatrixArray(), gen.NSysts(), univs, nThreads);
+      for(const std::vector<double>& h: hists) stats.Add(h);
+
+      res.rmsPrecision = stats.RMSPrecision();
+      res.covPrecision = stats.CovPrecision();
+      if(opts.verbose)
+        std::cout << "  " << stats.N() << " universes: RMS to " << 100*res.rmsPrecision
+                  << "%, covariance to " << res.covPrecision << std::endl;
+
+      if(stats.N() >= opts.minUniverses &&
+         res.rmsPrecision <= opts.targetRMS &&
+         res.covPrecision <= opts.targetCov){
+        res.converged = true;
+        break;
+      }
+    }
+
+    res.nUniverses = stats.N();
+    res.band = MakeBand(stats, pot);
+    return res;
+  }
+
+  // The mean shifted-minus-nominal histogram for systs shifted by sigmas,
+  // averaged over nDraws sets of smearing random numbers. Nominal and
+  // shifted use the same events, so the statistical fluctuations of the
+  // sample cancel in the difference. With antithetic set, each draw is the
+  // average of a universe and its antithetic partner (every random number
+  // negated), which cancels the part of the smearing noise that is linear
+  // in the random numbers. That takes two fills per draw, so compare it to
+  // plain draws at the same ShiftEstimate::nFills.
+  ShiftEstimate MeanShift(const std::vector<const ISyst*>& systs,
+                          const std::vector<double>& sigmas,
+                          int nDraws,
+                          bool antithetic = true,
+                          unsigned int seed = 42,
+                          unsigned int nThreads = 0) const
+  {
+    if(systs.size() != sigmas.size()){
+      std::cerr << "UniverseEngine::MeanShift: " << systs.size() << " systs but "
+                << sigmas.size() << " sigmas" << std::endl;
+      abort();
+    }
+    if(nThreads == 0) nThreads = NCores();
+
+    std::vector<TableShift> shifts;
+    for(const ISyst* s: systs) shifts.push_back(TableShiftFor(s));
+
+    const int perDraw = antithetic ? 2 : 1;
+    std::vector<uint64_t> univs;
+    std::vector<double> allSigmas;
+    for(int d = 0; d < nDraws; ++d){
+      for(int k = 0; k < perDraw; ++k){
+        univs.push_back(UniverseKey(seed, d) | (k ? kAntitheticBit : 0));
+        allSigmas.insert(allSigmas.end(), sigmas.begin(), sigmas.end());
+      }
+    }
+    const std::vector<std::vector<double>> hists =
+      FillUniverses(shifts, allSigmas.data(), sigmas.size(), univs, nThreads);
+
+    const std::vector<double> nom = Nominal();
+    UniverseStats stats(NBins());
+    for(int d = 0; d < nDraws; ++d){
+      std::vector<double> diff(NBins(), 0);
+      for(int k = 0; k < perDraw; ++k)
+        for(int b = 0; b < NBins(); ++b) diff[b] += (hists[d*perDraw+k][b] - nom[b])/perDraw;
+      stats.Add(diff);
+    }
+
+    ShiftEstimate ret;
+    ret.nFills = univs.size();
+    for(int b = 0; b < NBins(); ++b){
+      ret.diff.push_back(stats.Mean(b));
+      ret.err.push_back(stats.RMS(b)/sqrt(nDraws));
+    }
+    return ret;
+  }
+
+  // How fast does the band converge with universes from sampler? For each
+  // of nReplicates different seeds, throw universes and note the RMS in each
+  // bin after each number in checkpoints. Returns, for each checkpoint, the
+  // spread of those RMSs between seeds relative to their mean, averaged
+  // over bins: the actual precision of the band, with no assumptions about
+  // how the universes were made.
+  std::vector<double> RMSConvergence(const CorrelatedUniverseGenerator& gen,
+                                     IUniverseSampler& sampler,
+                                     std::vector<int> checkpoints,
+                                     int nReplicates = 20,
+                                     unsigned int nThreads = 0) const
+  {
+    if(nThreads == 0) nThreads = NCores();
+    std::sort(checkpoints.begin(), checkpoints.end());
+    const int nMax = checkpoints.empty() ? 0 : checkpoints.back();
+    const int nb = NBins();
+
+    std::vector<TableShift> shifts;
+    for(const ISyst* s: gen.Systs()) shifts.push_back(TableShiftFor(s));
+
+    // rms[c][r*nb + b]: RMS of bin b at checkpoint c in replicate r
+    std::vector<std::vector<double>> rms(checkpoints.size(), std::vector<double>(nReplicates*nb));
+    for(int r = 0; r < nReplicates; ++r){
+      sampler.Reset(r+1);
+      const TMatrixD sigmas = gen.ThrowSigmas(sampler, nMax);
+      std::vector<uint64_t> univs(nMax);
+      for(int u = 0; u < nMax; ++u) univs[u] = UniverseKey(r+1, u);
+      const std::vector<std::vector<double>> hists =
+        FillUniverses(shifts, sigmas.GetMatrixArray(), gen.NSysts(), univs, nThreads);
+
+      UniverseStats stats(nb);
+      size_t c = 0;
+      for(int u = 0; u < nMax; ++u){
+        stats.Add(hists[u]);
+        for(; c < checkpoints.size() && checkpoints[c] == stats.N(); ++c)
+          for(int b = 0; b < nb; ++b) rms[c][r*nb + b] = stats.RMS(b);
+      }
+    }
+
+    std::vector<double> ret;
+    for(size_t c = 0; c < checkpoints.size(); ++c){
+      double sum = 0;
+      int nUsed = 0;
+      for(int b = 0; b < nb; ++b){
+        UniverseStats spread(1);
+        for(int r = 0; r < nReplicates; ++r) spread.Add({rms[c][r*nb + b]});
+        if(spread.Mean(0) <= 0) continue;
+        sum += spread.RMS(0)/spread.Mean(0);
+        ++nUsed;
+      }
+      ret.push_back(nUsed > 0 ? sum/nUsed : 0);
+    }
+    return ret;
+  }
+
+protected:
+  // A key for universe u of a run with this seed. Never has the antithetic
+  // bit set.
+  static uint64_t UniverseKey(unsigned int seed, uint64_t u)
+  {
+    return (MixBits(seed) ^ u) & ~kAntitheticBit;
+  }
+
+  // Fill several universes in parallel. Universe u has key univs[u] and
+  // shifts sigmas[u*stride + k].
+  std::vector<std::vector<double>> FillUniverses(const std::vector<TableShift>& shifts,
+                                                 const double* sigmas,
+                                                 size_t stride,
+                                                 const std::vector<uint64_t>& univs,
+                                                 unsigned int nThreads) const
+  {
+    const size_t n = univs.size();
+    std::vector<std::vector<double>> ret(n);
+
+    if(fOrder == FillOrder::kUniverseMajor){
+      // Each thread takes whole universes
+      std::vector<std::thread> threads;
+      for(unsigned int k = 0; k < nThreads; ++k){
+        threads.emplace_back([&, k]{
+            TraceSpan span("fill universes", "fill");
+            for(size_t u = k; u < n; u += nThreads)
+              ret[u] = FillUniverse(shifts, sigmas + u*stride, univs[u]);
+          });
+      }
+      for(std::thread& t: threads) t.join();
+      return ret;
+    }
+
+    const size_t blockSize =
+      fOrder == FillOrder::kBlocked ? TunedBlockSize(shifts, sigmas, stride, univs) : 0;
+
+    // Each thread takes a share of the universes, and goes over all the
+    // events for them. Every universe is summed in the same order whatever
+    // the number of threads.
+    const NumaTopology topo = fPinThreads ? NumaTopology::Detect() : NumaTopology();
+    std::vector<std::thread> threads;
+    for(unsigned int k = 0; k < nThreads; ++k){
+      threads.emplace_back([&, k]{
+          if(fPinThreads) PinThisThread(topo.CpuForThread(k));
+          TraceSpan span("fill universes", "fill");
+
+          std::vector<size_t> which;
+          for(size_t u = k; u < n; u += nThreads) which.push_back(u);
+
+          // Zeroed here, so its pages are on this thread's node
+          LargeVector<double> stack(which.size()*NBins(), 0,
+                                    LargePageAllocator<double>(fHugePages));
+          if(fOrder == FillOrder::kBlocked)
+            FillBlocked(shifts, sigmas, stride, univs, which, blockSize, stack.data());
+          else
+            FillEventMajor(shifts, sigmas, stride, univs, which, stack.data());
+
+          for(size_t p = 0; p < which.size(); ++p)
+            ret[which[p]].assign(stack.begin() + p*NBins(), stack.begin() + (p+1)*NBins());
+        });
+    }
+    for(std::thread& t: threads) t.join();
+    return ret;
+  }
+
+  // For each event, apply every universe in turn. Each event touches every
+  // universe's histogram, which is a lot of memory once there are hundreds.
+  // Only the universes listed in which are filled. Universe which[p] goes
+  // in stack[p*NBins()] onwards.
+  void FillEventMajor(const std::vector<TableShift>& shifts, const double* sigmas, size_t stride,
+                      const std::vector<uint64_t>& univs, const std::vector<size_t>& which,
+                      double* stack) const
+  {
+    for(size_t i: fSelected){
+      for(size_t p = 0; p < which.size(); ++p){
+        const size_t u = which[p];
+        ShiftedEvent ev{fTable.Elep_reco[i], fTable.theta_reco[i], fTable.weight[i]};
+        const double* sig = sigmas + u*stride;
+        for(size_t k = 0; k < shifts.size(); ++k)
+          if(sig[k] != 0) shifts[k](sig[k], fTable, i, univs[u], ev);
+        const int bin = ShiftedBin(i, ev);
+        if(bin >= 0) stack[p*NBins() + bin] += ev.weight;
+      }
+    }
+  }
+
+  // Take the events a block at a time, small enough that the block stays
+  // in cache while every universe is applied to it. For each universe,
+  // first work out the bin and weight of each event in the block, then add
+  // them to that universe's histogram in one go.
+  void FillBlocked(const std::vector<TableShift>& shifts, const double* sigmas, size_t stride,
+                   const std::vector<uint64_t>& univs, const std::vector<size_t>& which,
+                   size_t blockSize, double* stack,
+                   size_t nEvents = size_t(-1)) const
+  {
+    const size_t end = std::min(nEvents, fSelected.size());
+    std::vector<int> bins(blockSize);
+    std::vector<double> weights(blockSize);
+    for(size_t b0 = 0; b0 < end; b0 += blockSize){
+      const size_t b1 = std::min(b0 + blockSize, end);
+      for(size_t p = 0; p < which.size(); ++p){
+        const size_t u = which[p];
+        const double* sig = sigmas + u*stride;
+        for(size_t j = b0; j < b1; ++j){
+          const size_t i = fSelected[j];
+          ShiftedEvent ev{fTable.Elep_reco[i], fTable.theta_reco[i], fTable.weight[i]};
+          for(size_t k = 0; k < shifts.size(); ++k)
+            if(sig[k] != 0) shifts[k](sig[k], fTable, i, univs[u], ev);
+          bins[j-b0] = ShiftedBin(i, ev);
+          weights[j-b0] = ev.weight;
+        }
+        double* h = stack + p*NBins();
+        for(size_t j = 0; j < b1-b0; ++j)
+          if(bins[j] >= 0) h[bins[j]] += weights[j];
+      }
+    }
+  }
+
+  // The block size to use, tuning it first if that hasn't been done. Only
+  // one caller tunes; any others calling at the same time wait for it.
+  size_t TunedBlockSize(const std::vector<TableShift>& shifts, const double* sigmas, size_t stride,
+                        const std::vector<uint64_t>& univs) const
+  {
+    std::lock_guard<std::mutex> lock(fBlockSizeMutex);
+    if(fBlockSize == 0) fBlockSize = AutotuneBlockSize(shifts, sigmas, stride, univs);
+    return fBlockSize;
+  }
+
+  // Time a few block sizes on the first part of the table, and return the
+  // fastest. Each size is timed several times and its best time kept, so
+  // neither a cold cache on the first try nor an interruption on one of
+  // them decides the answer.
+  size_t AutotuneBlockSize(const std::vector<TableShift>& shifts, const double* sigmas, size_t stride,
+                           const std::vector<uint64_t>& univs) const
+  {
+    const size_t nSample = 20000;
+    const int nRepeats = 5;
+    // Don't spend long on it if there are lots of universes
+    std::vector<size_t> which;
+    for(size_t u = 0; u < univs.size() && u < 64; ++u) which.push_back(u);
+    std::vector<double> stack(which.size()*NBins());
+
+    size_t best = kBlockSizes[0];
+    double bestTime = -1;
+    for(int r = 0; r < nRepeats; ++r){
+      // Take the sizes in turn on each repeat, so slow drifts (the clock
+      // speeding up, say) hit them all alike
+      for(size_t bs: kBlockSizes){
+        std::fill(stack.begin(), stack.end(), 0);
+        const auto start = std::chrono::steady_clock::now();
+        FillBlocked(shifts, sigmas, stride, univs, which, bs, stack.data(), nSample);
+        const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+        if(bestTime < 0 || dt.count() < bestTime){
+          bestTime = dt.count();
+          best = bs;
+        }
+      }
+    }
+    return best;
+  }
+
+  int FindBin(double x) const
+  {
+    if(x < fEdges.front() || x >= fEdges.back()) return -1;
+    return std::upper_bound(fEdges.begin(), fEdges.end(), x) - fEdges.begin() - 1;
+  }
+
+  // The bin of row i once shifted to ev, or -1 if it fails the shifted cut
+  int ShiftedBin(size_t i, const ShiftedEvent& ev) const
+  {
+    if(!fShiftedCut(fTable, i, ev)) return -1;
+    return FindBin(fVar(fTable, i, ev));
+  }
+
+  UniverseBand MakeBand(const UniverseStats& stats, double pot) const
+  {
+    const double scale = fTable.pot > 0 ? pot/fTable.pot : 1;
+    const int nb = NBins();
+    const std::vector<double> nom = Nominal();
+
+    UniverseBand band;
+    band.cv = MakeEmptyTH1("", Binning::Custom(fEdges));
+    band.mean = MakeEmptyTH1("", Binning::Custom(fEdges));
+    band.up = MakeEmptyTH1("", Binning::Custom(fEdges));
+    band.dn = MakeEmptyTH1("", Binning::Custom(fEdges));
+    band.cov.ResizeTo(nb, nb);
+    for(int i = 0; i < nb; ++i){
+      band.cv->SetBinContent(i+1, scale*nom[i]);
+      band.mean->SetBinContent(i+1, scale*stats.Mean(i));
+      band.up->SetBinContent(i+1, scale*(nom[i] + stats.RMS(i)));
+      band.dn->SetBinContent(i+1, scale*(nom[i] - stats.RMS(i)));
+      for(int j = 0; j < nb; ++j) band.cov(i, j) = scale*scale*stats.Cov(i, j);
+    }
+    return band;
+  }
+
+  const EventTable& fTable;
+  std::vector<double> fEdges;
+  ShiftedVar fVar;
+  ShiftedCut fShiftedCut = kShiftedNoCut;
+  std::vector<size_t> fSelected;
+
+  FillOrder fOrder = FillOrder::kBlocked;
+  mutable size_t fBlockSize = 0; // 0 until it has been tuned
+  mutable std::mutex fBlockSizeMutex;
+  HugePageMode fHugePages = HugePageMode::kOff;
+  bool fPinThreads = false;
+};
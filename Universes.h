@@ -0,0 +1,236 @@
+// Tools for throwing many systematic "universes" at once.
+//
+// In Systematics2 and 3 you made one Spectrum per shift, +1 or -1 sigma of a
+// single syst. Real systematics come with a prior covariance: the muon energy
+// scale might be correlated with the angle smearing, for example. The honest
+// way to get the combined uncertainty is to throw lots of random "universes",
+// each with every syst shifted by a correlated random amount, fill a Spectrum
+// in each universe, and look at the spread of the results.
+//
+// All the universe Spectra are attached to the same loader, so one
+// loader.Go() fills every universe in a single pass over the files.
+
+#pragma once
+
+#include "SystematicsCommon.h"
+
+#include "TDecompChol.h"
+#include "TMatrixD.h"
+#include "TMatrixDSym.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Fill the array v with independent standard normal numbers. Uniforms are
+// generated in one go and then transformed in pairs (Box-Muller), which keeps
+// the inner loop free of function calls so the compiler can vectorise it.
+void FillStandardNormals(std::vector<double>& v, TRandom3& rng)
+{
+  const size_t n = v.size();
+  const size_t nPairs = (n+1)/2;
+  std::vector<double> u(2*nPairs);
+  rng.RndmArray(u.size(), u.data()); // Uniform in (0, 1], never exactly zero
+
+  const double twoPi = 2*TMath::Pi();
+  for(size_t i = 0; i < nPairs; ++i){
+    const double r = sqrt(-2*log(u[2*i]));
+    const double phi = twoPi*u[2*i+1];
+    v[2*i] = r*cos(phi);
+    if(2*i+1 < n) v[2*i+1] = r*sin(phi);
+  }
+}
+
+// Where the independent standard normals behind the universes come from.
+// Samplers hand out universes in sequence; Reset() starts again from the
+// first, with a new seed.
+class IUniverseSampler
+{
+public:
+  virtual ~IUniverseSampler() {}
+
+  // The next nUniverses rows of nDims standard normals
+  virtual TMatrixD Next(int nUniverses, int nDims) = 0;
+
+  virtual void Reset(unsigned int seed) = 0;
+};
+
+// Ordinary pseudo-random throws, the same as ThrowSigmas() makes
+class PseudoRandomSampler: public IUniverseSampler
+{
+public:
+  PseudoRandomSampler(unsigned int seed = 42) : fRNG(seed) {}
+
+  virtual TMatrixD Next(int nUniverses, int nDims) override
+  {
+    std::vector<double> flat(nUniverses*nDims);
+    FillStandardNormals(flat, fRNG);
+    return TMatrixD(nUniverses, nDims, flat.data());
+  }
+
+  virtual void Reset(unsigned int seed) override {fRNG.SetSeed(seed);}
+
+protected:
+  TRandom3 fRNG;
+};
+
+// Generates universes for a list of systs with a given prior covariance.
+// The covariance is in units of each syst's sigma, so a diagonal of 1 and
+// no correlations gives the same throws as shifting each syst on its own.
+class CorrelatedUniverseGenerator
+{
+public:
+  CorrelatedUniverseGenerator(const std::vector<const ISyst*>& systs,
+                              const TMatrixDSym& cov)
+    : fSysts(systs)
+  {
+    if(cov.GetNrows() != int(systs.size())){
+      std::cerr << "CorrelatedUniverseGenerator: covariance is "
+                << cov.GetNrows() << "x" << cov.GetNcols() << " but there are "
+                << systs.size() << " systs" << std::endl;
+      abort();
+    }
+
+    // Do the Cholesky decomposition once, here, and reuse it for every throw.
+    // ROOT gives us U with cov = U^T U.
+    TDecompChol chol(cov);
+    if(!chol.Decompose()){
+      std::cerr << "CorrelatedUniverseGenerator: covariance is not positive definite" << std::endl;
+      abort();
+    }
+    fU.ResizeTo(chol.GetU());
+    fU = chol.GetU();
+  }
+
+  unsigned int NSysts() const {return fSysts.size();}
+  const std::vector<const ISyst*>& Systs() const {return fSysts;}
+
+  // The upper-triangular Cholesky factor U, with cov = U^T U
+  const TMatrixD& CholeskyFactor() const {return fU;}
+
+  // Turn independent standard normals z (one row per universe, one column
+  // per syst) into correlated shifts. Row-wise x = L z is X = Z U.
+  TMatrixD Correlate(const TMatrixD& z) const
+  {
+    return TMatrixD(z, TMatrixD::kMult, fU);
+  }
+
+  // Throw nUniverses correlated sigma vectors. Row i holds the shift of each
+  // syst in universe i. The same seed always gives the same universes.
+  TMatrixD ThrowSigmas(int nUniverses, unsigned int seed) const
+  {
+    TRandom3 rng(seed);
+    std::vector<double> flat(nUniverses*NSysts());
+    FillStandardNormals(flat, rng);
+    TMatrixD z(nUniverses, NSysts(), flat.data());
+    return Correlate(z);
+  }
+
+  // The same, with the universes drawn from sampler instead
+  TMatrixD ThrowSigmas(IUniverseSampler& sampler, int nUniverses) const
+  {
+    return Correlate(sampler.Next(nUniverses, NSysts()));
+  }
+
+  // Convert one row of sigmas into the SystShifts CAFAna understands
+  SystShifts ToShifts(const TMatrixD& sigmas, int univ) const
+  {
+    SystShifts shifts;
+    for(unsigned int j = 0; j < NSysts(); ++j) shifts.SetShift(fSysts[j], sigmas(univ, j));
+    return shifts;
+  }
+
+  std::vector<SystShifts> Throw(int nUniverses, unsigned int seed) const
+  {
+    const TMatrixD sigmas = ThrowSigmas(nUniverses, seed);
+    std::vector<SystShifts> ret;
+    ret.reserve(nUniverses);
+    for(int i = 0; i < nUniverses; ++i) ret.push_back(ToShifts(sigmas, i));
+    return ret;
+  }
+
+protected:
+  std::vector<const ISyst*> fSysts;
+  TMatrixD fU;
+};
+
+// Make one Spectrum per universe, all attached to the same loader. Nothing
+// is read until you call loader.Go(), which then fills all of them together.
+std::vector<std::unique_ptr<Spectrum>> MakeUniverseSpectra(SpectrumLoaderBase& loader,
+                                                           const HistAxis& axis,
+                                                           const Cut& cut,
+                                                           const std::vector<SystShifts>& shifts,
+                                                           const Var& wei = kUnweighted)
+{
+  std::vector<std::unique_ptr<Spectrum>> ret;
+  ret.reserve(shifts.size());
+  for(const SystShifts& shift: shifts)
+    ret.emplace_back(new Spectrum(loader, axis, cut, shift, wei));
+  return ret;
+}
+
+// The spread of a set of universes around the central value
+struct UniverseBand
+{
+  TH1D* cv;   // Central value
+  TH1D* mean; // Mean over universes
+  TH1D* up;   // cv + RMS of the universes
+  TH1D* dn;   // cv - RMS of the universes
+  TMatrixDSym cov; // Bin-to-bin covariance over universes
+};
+
+// Work out the per-bin mean, RMS and covariance of a set of universe
+// histograms, and make the +/- 1 sigma band around cv. Takes ownership of cv.
+UniverseBand MakeUniverseBand(TH1D* cv, const std::vector<TH1D*>& univs)
+{
+  const int nBins = cv->GetNbinsX();
+  const int nUnivs = univs.size();
+  if(nUnivs < 2){
+    std::cerr << "MakeUniverseBand: need at least 2 universes to estimate a spread, got "
+              << nUnivs << std::endl;
+    abort();
+  }
+
+  UniverseBand band;
+  band.cv = cv;
+  band.mean = (TH1D*)cv->Clone(UniqueName().c_str());
+  band.mean->Reset();
+  band.cov.ResizeTo(nBins, nBins);
+  band.cov.Zero();
+
+  for(TH1D* h: univs) band.mean->Add(h, 1./nUnivs);
+
+  for(TH1D* h: univs){
+    for(int i = 0; i < nBins; ++i){
+      const double di = h->GetBinContent(i+1) - band.mean->GetBinContent(i+1);
+      for(int j = 0; j <= i; ++j){
+        const double dj = h->GetBinContent(j+1) - band.mean->GetBinContent(j+1);
+        band.cov(i, j) += di*dj/(nUnivs-1);
+      }
+    }
+  }
+  for(int i = 0; i < nBins; ++i)
+    for(int j = 0; j < i; ++j) band.cov(j, i) = band.cov(i, j);
+
+  band.up = (TH1D*)cv->Clone(UniqueName().c_str());
+  band.dn = (TH1D*)cv->Clone(UniqueName().c_str());
+  for(int i = 0; i < nBins; ++i){
+    const double rms = sqrt(band.cov(i, i));
+    band.up->SetBinContent(i+1, cv->GetBinContent(i+1) + rms);
+    band.dn->SetBinContent(i+1, cv->GetBinContent(i+1) - rms);
+  }
+  return band;
+}
+
+UniverseBand MakeUniverseBand(const Spectrum& cv,
+                              const std::vector<std::unique_ptr<Spectrum>>& univs,
+                              double pot)
+{
+  std::vector<TH1D*> hs;
+  hs.reserve(univs.size());
+  for(const auto& s: univs) hs.push_back(s->ToTH1(pot));
+  UniverseBand band = MakeUniverseBand(cv.ToTH1(pot), hs);
+  for(TH1D* h: hs) delete h;
+  return band;
+}